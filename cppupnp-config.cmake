@@ -21,6 +21,10 @@ add_library(cpp_upnp
         ${CPPUPnP_DIR}/src/ssdp.cpp
         ${CPPUPnP_DIR}/src/url.cpp
         ${CPPUPnP_DIR}/src/parse_device.cpp
+        ${CPPUPnP_DIR}/src/description_cache.cpp
+        ${CPPUPnP_DIR}/src/igd_registry.cpp
+        ${CPPUPnP_DIR}/src/shared_discovery.cpp
+        ${CPPUPnP_DIR}/src/soap_fields.cpp
 )
 
 target_include_directories(cpp_upnp
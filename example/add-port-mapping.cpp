@@ -20,15 +20,15 @@ void list_port_mappings_igd1(upnp::igd& igd, net::yield_context yield)
 {
     cerr << "Getting list of port mappings IGD1\n";
 
-    for (unsigned i = 0; ; ++i) {
-        auto r = igd.get_generic_port_mapping_entry(i, yield);
-        if (!r) {
-            if (i == 0) {
-                cerr << pad << "Error: " << r.error() << "\n";
-            }
-            break;
+    auto r = igd.get_port_mapping_table(yield);
+
+    if (r) {
+        cerr << pad << "Found " << r.value().size() << " entries:\n";
+        for (auto& e : r.value()) {
+            cerr << pad << e << "\n";
         }
-        cerr << pad << r.value() << "\n";
+    } else {
+        cerr << pad << "Error: " << r.error() << "\n";
     }
 }
 
@@ -36,20 +36,22 @@ void list_port_mappings_igd2(upnp::igd& igd, net::yield_context yield)
 {
     cerr << "Getting list of port mappings IGD2\n";
 
-    auto r = igd.get_list_of_port_mappings( upnp::igd::udp
-                                          , 0
-                                          , 65535
-                                          , 100
-                                          , yield);
+    auto pager = igd.list_port_mappings(upnp::igd::udp);
+    size_t n = 0;
 
-    if (r) {
-        cerr << pad << "Found " << r.value().size() << " entries:\n";
-        for (auto e : r.value()) {
-            cerr << pad << e << "\n";
+    while (true) {
+        auto r = pager.next(yield);
+        if (!r) {
+            cerr << pad << "Error: " << r.error() << "\n";
+            return;
         }
-    } else {
-        cerr << pad << "Error: " << r.error() << "\n";
+        if (!r.value()) break;
+        cerr << pad << *r.value() << "\n";
+        ++n;
     }
+
+    cerr << pad << "Found " << n << " entries in "
+         << pager.requests() << " requests\n";
 }
 
 void delete_port_mapping(upnp::igd& igd, uint16_t port, net::yield_context yield)
@@ -2,3 +2,6 @@
 
 #include <upnp/ssdp.h>
 #include <upnp/igd.h>
+#include <upnp/description_cache.h>
+#include <upnp/igd_registry.h>
+#include <upnp/shared_discovery.h>
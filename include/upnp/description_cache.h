@@ -0,0 +1,91 @@
+#pragma once
+
+#include <upnp/device.h>
+#include <upnp/url.h>
+#include <upnp/third_party/error_code.h>
+#include <upnp/third_party/optional.h>
+#include <upnp/third_party/result.h>
+#include <upnp/third_party/string_view.h>
+#include <chrono>
+#include <map>
+#include <vector>
+
+namespace upnp {
+
+// Root device descriptions of IGDs, so that repeated discoveries don't
+// need to fetch and parse them again. Entries are keyed by the USN and
+// LOCATION from the SSDP response and expire after the max-age the device
+// advertised in its CACHE-CONTROL header.
+//
+// The cache can be saved to and loaded from a file, which lets a restarted
+// process rebuild `igd` handles (see `igd::from_cache`) without any network
+// round trip. Such handles are checked lazily: an entry is evicted when the
+// first request through it shows the device is no longer there.
+class description_cache {
+public:
+    using clock = std::chrono::system_clock;
+
+    struct entry {
+        std::string usn;
+        std::string uuid;
+        url_t location;
+        clock::time_point expires;
+        device root_device;
+        // The description as received, kept for `save`.
+        std::string xml;
+    };
+
+public:
+    description_cache() = default;
+
+    description_cache(const description_cache&)            = delete;
+    description_cache& operator=(const description_cache&) = delete;
+
+    // Used for devices which don't send max-age (UDA requires it, but
+    // not all devices comply).
+    void default_max_age(std::chrono::seconds s) { _default_max_age = s; }
+
+    // Returns nullptr if there is no unexpired entry for the USN at the
+    // given location. Other search targets of the same device (same uuid
+    // and location) are a match as well.
+    const entry* find(string_view usn, const url_t& location) const;
+
+    // Parses `xml` and stores the result. Returns nullptr if `xml` isn't a
+    // valid root device description.
+    const entry* insert( std::string usn
+                       , std::string uuid
+                       , url_t location
+                       , optional<std::chrono::seconds> max_age
+                       , std::string xml);
+
+    void erase(string_view usn);
+
+    // Remove every entry of the device with the given uuid.
+    void erase_uuid(string_view uuid);
+
+    void erase_expired();
+
+    size_t size() const { return _entries.size(); }
+
+    // Unexpired entries, in no particular order.
+    std::vector<const entry*> entries() const;
+
+    result<void> save(const std::string& path) const;
+
+    // Adds unexpired entries from a file written by `save`. Entries which
+    // fail to parse are skipped.
+    result<void> load(const std::string& path);
+
+private:
+    entry* emplace( std::string usn
+                  , std::string uuid
+                  , url_t location
+                  , clock::time_point expires
+                  , std::string xml);
+
+private:
+    std::chrono::seconds _default_max_age = std::chrono::minutes(30);
+    std::map<std::string, entry, std::less<>> _entries;
+};
+
+} // namespace upnp
@@ -5,10 +5,17 @@
 #include <upnp/third_party/result.h>
 #include <upnp/third_party/string_view.h>
 #include <upnp/third_party/variant.h>
+#include <upnp/third_party/optional.h>
 #include <boost/beast/http/message.hpp>
 #include <boost/beast/http/string_body.hpp>
 #include <boost/asio/ip/address.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/ip/udp.hpp>
 #include <upnp/device.h>
+#include <upnp/ssdp.h>
+#include <memory>
+#include <functional>
+#include <set>
 
 #include <boost/range/begin.hpp> // needed by spawn
 #include <boost/range/end.hpp> // needed by spawn
@@ -18,6 +25,15 @@ namespace upnp {
 
 namespace beast = boost::beast;
 
+class description_cache;
+class connection_pool;
+
+namespace soap {
+    enum class action : uint8_t;
+    class envelope;
+    class field_collector;
+}
+
 // Internet Gateway Device
 class igd final {
 private:
@@ -39,6 +55,13 @@ public:
         struct invalid_xml_body {};
         struct invalid_response {};
         struct bad_address {};
+        // A field of the response is missing or its value is invalid
+        struct bad_field {
+            std::string name;
+            bool missing;
+        };
+        // The port mapping table kept changing while it was being read
+        struct table_changed {};
 
         struct tcp_connect{};
         struct http_request{};
@@ -46,6 +69,13 @@ public:
         struct http_status{
             beast::http::status status;
         };
+        // The action failed and the device said why (UDA 1.1, section
+        // 3.2.2), e.g. 713 SpecifiedArrayIndexInvalid or 730
+        // PortMappingNotFound.
+        struct upnp_fault {
+            uint16_t code;
+            std::string description;
+        };
 
         struct soap_request {
             variant<
@@ -53,10 +83,21 @@ public:
                 tcp_connect,
                 http_request,
                 http_response,
-                http_status
+                http_status,
+                upnp_fault
             > inner;
         };
 
+        // UPnP error code of `e` if it's a fault reported by the device.
+        template<class E>
+        static optional<uint16_t> fault_code(const E& e) {
+            auto rq = boost::get<soap_request>(&e);
+            if (!rq) return boost::none;
+            auto f = boost::get<upnp_fault>(&rq->inner);
+            if (!f) return boost::none;
+            return f->code;
+        }
+
         friend os_t& operator<<(os_t& os, const igd_host_parse_failed& e) {
             return os << "failed to parse IGD host " << e.url;
         }
@@ -75,6 +116,12 @@ public:
         friend os_t& operator<<(os_t& os, const bad_address&) {
             return os << "bad address";
         }
+        friend os_t& operator<<(os_t& os, const bad_field& e) {
+            return os << (e.missing ? "missing field " : "invalid field ") << e.name;
+        }
+        friend os_t& operator<<(os_t& os, const table_changed&) {
+            return os << "port mapping table changed while being read";
+        }
         friend os_t& operator<<(os_t& os, const tcp_connect&) {
             return os << "tcp connect";
         }
@@ -87,6 +134,9 @@ public:
         friend os_t& operator<<(os_t& os, const http_status& e) {
             return os << "IGD resonded with non OK status " << e.status;
         }
+        friend os_t& operator<<(os_t& os, const upnp_fault& e) {
+            return os << "IGD reported UPnP error " << e.code << " " << e.description;
+        }
 
         using add_port_mapping = variant<
             igd_host_parse_failed,
@@ -98,7 +148,8 @@ public:
             soap_request,
             invalid_xml_body,
             invalid_response,
-            bad_address
+            bad_address,
+            bad_field
         >;
 
         using get_list_of_port_mappings = variant<
@@ -110,7 +161,16 @@ public:
         using get_generic_port_mapping_entry = variant<
             soap_request,
             invalid_xml_body,
-            invalid_response
+            invalid_response,
+            bad_field
+        >;
+
+        using get_port_mapping_table = variant<
+            soap_request,
+            invalid_xml_body,
+            invalid_response,
+            bad_field,
+            table_changed
         >;
 
         using delete_port_mapping = variant<
@@ -124,12 +184,138 @@ public:
 
     const std::string& friendly_name() const { return _upnp_device.friendly_name; }
 
+    struct request_policy {
+        // Deadlines for each phase of an HTTP exchange with the device, so
+        // that e.g. a dropped SYN fails fast instead of using up the time
+        // meant for a slow response.
+        std::chrono::milliseconds connect_timeout = std::chrono::seconds(2);
+        std::chrono::milliseconds write_timeout   = std::chrono::seconds(2);
+        std::chrono::milliseconds read_timeout    = std::chrono::seconds(5);
+
+        // Number of times a request failing with a transient error is
+        // repeated: always if the connection couldn't be made, and if the
+        // request or response was lost only for the Get* actions and
+        // DeletePortMapping (a resent delete finding no entry succeeds).
+        // AddPortMapping isn't resent once it may have reached the
+        // device. The n-th retry (from 0) comes after a random wait between
+        // half and all of `backoff * 2^n`, capped at `max_backoff`.
+        unsigned retries = 2;
+        std::chrono::milliseconds backoff     = std::chrono::milliseconds(100);
+        std::chrono::milliseconds max_backoff = std::chrono::seconds(2);
+    };
+
+    struct keep_alive_options {
+        // Most idle connections kept open to the device.
+        size_t max_idle_connections = 4;
+
+        // Idle connections aren't reused after this long, devices tend to
+        // close them on their own after a few seconds anyway.
+        std::chrono::milliseconds idle_timeout = std::chrono::seconds(5);
+    };
+
+    struct discover_options {
+        // Maximum number of root device descriptions being fetched at the
+        // same time. Each SSDP response is handed to a fetcher as soon as it
+        // arrives, so the total discovery time is close to that of the
+        // slowest device instead of the sum over all of them.
+        size_t max_concurrent_fetches = 8;
+
+        // Local IPv4 addresses to search on. Each gets its own socket and
+        // all of them are searched in parallel within a single discovery
+        // round. If empty, all local interfaces which are up and support
+        // multicast are used.
+        std::vector<net::ip::address_v4> interfaces;
+
+        // Link-local IPv6 addresses, with the scope id set to the interface
+        // index, to search on alongside IPv4. If both this and `interfaces`
+        // are empty, all local IPv6 interfaces are searched as well.
+        // Gateways answering over both families are reported once.
+        std::vector<net::ip::address_v6> interfaces_v6;
+
+        // Besides multicast, search the default gateway(s) directly. It
+        // is where the IGD usually is.
+        bool search_default_gateway = true;
+
+        // If set, once the default gateway or one of `unicast_targets`
+        // answers, other devices are only waited for this much longer
+        // instead of the whole search window. Off by default, since an
+        // IGD other than the gateway may answer later and be missed.
+        optional<std::chrono::milliseconds> gateway_linger;
+
+        // Other known addresses of IGDs to search with unicast M-SEARCH,
+        // treated like the default gateway.
+        std::vector<net::ip::udp::endpoint> unicast_targets;
+
+        // If set, descriptions are looked up here before being fetched over
+        // HTTP, and fetched descriptions are added to it.
+        std::shared_ptr<description_cache> cache;
+
+        // If set, the MX value and the response window are chosen from
+        // the latencies of previous discoveries, and the latencies of this
+        // one are recorded.
+        std::shared_ptr<ssdp::response_history> history;
+
+        // Settings of the SSDP search, such as the socket receive buffer,
+        // the response queue, the per source rate limit and retransmits.
+        // Its interfaces, unicast targets and linger are replaced by the
+        // options above, and so are MX and timeout if `history` is set.
+        ssdp::query::options query;
+
+        // Used to fetch descriptions and given to discovered handles.
+        request_policy policy;
+
+        // If set, discovered handles reuse HTTP connections between SOAP
+        // requests, see `enable_keep_alive`.
+        optional<keep_alive_options> keep_alive;
+    };
+
+    /*
+     * Discover IGD devices.
+     */
+    static
+    result<std::vector<igd>> discover( net::any_io_executor
+                                     , const discover_options&
+                                     , net::yield_context);
+
+    /*
+     * Discover IGD devices, handing each to `on_igd` as soon as its
+     * description is resolved instead of waiting for the whole search
+     * window to pass. Returning `false` from `on_igd` stops the discovery
+     * right away.
+     *
+     * Fails the same way as the above if no IGD is found.
+     */
+    static
+    result<void> discover( net::any_io_executor
+                         , const discover_options&
+                         , std::function<bool(igd)> on_igd
+                         , net::yield_context);
+
+    /*
+     * Return the first WANIPConnection or WANPPPConnection service found
+     * and stop searching.
+     */
+    static
+    result<igd> discover_first( net::any_io_executor
+                              , const discover_options&
+                              , net::yield_context);
+
     /*
      * Discover IGD devices.
      */
     static
     result<std::vector<igd>> discover(net::any_io_executor, const net::ip::address_v4& bind_ip, net::yield_context);
 
+    /*
+     * Create IGD handles from unexpired cache entries without touching the
+     * network, e.g. after loading the cache from disk on startup. Handles
+     * are verified on first use; if the device doesn't respond, its entries
+     * are evicted from the cache so that the next `discover` fetches
+     * the description again.
+     */
+    static
+    std::vector<igd> from_cache(net::any_io_executor, std::shared_ptr<description_cache>);
+
     /*
      * Discover IGD devices.
      */
@@ -160,6 +346,24 @@ public:
                     , std::chrono::seconds duration
                     , net::yield_context yield) noexcept;
 
+    struct mapping_spec {
+        protocol proto;
+        uint16_t external_port;
+        uint16_t internal_port;
+        std::string description;
+        std::chrono::seconds duration;
+    };
+
+    /*
+     * Add all `mappings`, with up to `max_in_flight` requests running at a
+     * time (at least one), and return the result for each in the same
+     * order. Requests share connections when keep-alive is enabled.
+     */
+    std::vector<result<void, error::add_port_mapping>>
+    add_port_mappings( const std::vector<mapping_spec>& mappings
+                     , size_t max_in_flight
+                     , net::yield_context yield) noexcept;
+
     /*
      * Section 2.4.18 from (IGD:1)
      * http://upnp.org/specs/gw/UPnP-gw-WANIPConnection-v1-Service.pdf
@@ -192,6 +396,43 @@ public:
                              , uint16_t max_count
                              , net::yield_context yield) noexcept;
 
+    /*
+     * Same as above, but each mapping is handed to `on_entry` as soon as
+     * it's read from the response instead of being collected, so memory
+     * use doesn't grow with the size of the table. Returns the number of
+     * mappings handed over, which may have happened even if it fails.
+     */
+    result<size_t, error::get_list_of_port_mappings>
+    get_list_of_port_mappings( protocol
+                             , uint16_t min_port
+                             , uint16_t max_port
+                             , uint16_t max_count
+                             , const std::function<void(map_entry)>& on_entry
+                             , net::yield_context yield) noexcept;
+
+    struct listing_options {
+        uint16_t min_port = 0;
+        uint16_t max_port = 65535;
+
+        // Mappings asked for by each GetListOfPortMappings request. Devices
+        // may return fewer, the listing goes on from the highest port
+        // returned until a page comes back empty (or as error 730).
+        uint16_t page_size = 100;
+
+        // Request the next page as soon as the current one arrives instead
+        // of once it has been consumed.
+        bool prefetch = true;
+    };
+
+    class port_mapping_pager;
+
+    /*
+     * All mappings of `proto` in a port range, requested from an IGD:2
+     * device a page at a time, see `port_mapping_pager`.
+     */
+    port_mapping_pager list_port_mappings(protocol proto) const;
+    port_mapping_pager list_port_mappings(protocol proto, listing_options) const;
+
     /*
      * Section 2.4.14 from (IGD:1)
      * http://upnp.org/specs/gw/UPnP-gw-WANIPConnection-v1-Service.pdf
@@ -203,6 +444,37 @@ public:
     get_generic_port_mapping_entry( uint16_t index
                                   , net::yield_context yield) noexcept;
 
+    struct table_options {
+        // GetGenericPortMappingEntry requests for consecutive indices in
+        // flight at once, at least one, plus up to three re-reads. With
+        // keep-alive enabled they go over the pooled connections.
+        size_t window = 8;
+
+        // Times the scan is started over if the table changed under it, or
+        // a window is read again after the device answered with a fault.
+        unsigned max_restarts = 3;
+    };
+
+    /*
+     * A snapshot of the whole port mapping table with
+     * GetGenericPortMappingEntry (IGD:1 and IGD:2), keeping a window of
+     * requests for consecutive indices in flight instead of waiting for
+     * each. The table ends at the first index the device reports as
+     * SpecifiedArrayIndexInvalid (713) or NoSuchEntryInArray (714).
+     *
+     * Indices shift when mappings are added or removed. Along with each
+     * window the last entries of the two windows before it are read again,
+     * and once the end is found so are the last entries and the end. The
+     * scan starts over if one of them differs in any way but its lease, or
+     * an entry shows up twice. A window answered with any other fault is
+     * read again.
+     */
+    result<std::vector<map_entry>, error::get_port_mapping_table>
+    get_port_mapping_table(net::yield_context) noexcept;
+
+    result<std::vector<map_entry>, error::get_port_mapping_table>
+    get_port_mapping_table(table_options, net::yield_context) noexcept;
+
     /*
      * Section 2.4.17 from (IGD:1)
      * http://upnp.org/specs/gw/UPnP-gw-WANIPConnection-v1-Service.pdf
@@ -215,6 +487,32 @@ public:
                        , uint16_t ext_port
                        , net::yield_context yield) noexcept;
 
+    struct mapping_key {
+        protocol proto;
+        uint16_t external_port;
+    };
+
+    /*
+     * Delete all `mappings` like `add_port_mappings` adds them.
+     */
+    std::vector<result<void, error::delete_port_mapping>>
+    delete_port_mappings( const std::vector<mapping_key>& mappings
+                        , size_t max_in_flight
+                        , net::yield_context yield) noexcept;
+
+    void set_request_policy(request_policy p) { _policy = p; }
+
+    /*
+     * Send SOAP requests over persistent HTTP/1.1 connections instead of
+     * opening a new one for each action. If the device has closed a reused
+     * connection before responding, requests which are safe to repeat are
+     * retried once on a new connection. Handles cloned from this one share
+     * its connections.
+     */
+    void enable_keep_alive();
+    void enable_keep_alive(keep_alive_options);
+    void disable_keep_alive();
+
     /*
      * Stop all currently running actions
      */
@@ -223,6 +521,9 @@ public:
     ~igd() { stop(); }
 
 private:
+    friend class igd_registry;
+    friend class shared_discovery;
+
     igd( std::string          uuid
        , device               upnp_device
        , std::string          service_id
@@ -230,17 +531,83 @@ private:
        , std::string          urn
        , net::any_io_executor exec);
 
+    // A new handle to the same service. Actions running on this one
+    // aren't shared.
+    igd clone() const;
+
+    // Creates an `igd` for each WANIPConnection or WANPPPConnection service
+    // found in `root_dev`. UDNs of WAN devices are recorded in `already_seen`
+    // so that devices reachable through multiple SSDP responses are only
+    // reported once.
     static
-    result<device>
-    query_root_device(net::any_io_executor, const url_t&, net::yield_context) noexcept;
+    void add_igds( const device& root_dev
+                 , const std::string& uuid
+                 , const url_t& location
+                 , std::set<std::string>& already_seen
+                 , net::any_io_executor
+                 , std::vector<igd>& igds);
+
+    static
+    result<std::string>
+    fetch_description( net::any_io_executor
+                     , const url_t&
+                     , const request_policy&
+                     , cancel_t&
+                     , net::yield_context) noexcept;
+
+    result<void, error::add_port_mapping>
+    add_port_mapping( protocol
+                    , uint16_t external_port
+                    , uint16_t internal_port
+                    , string_view description
+                    , std::chrono::seconds duration
+                    , const net::ip::address& local_ip
+                    , net::yield_context) noexcept;
+
+    struct listing_stats {
+        // Mappings handed over
+        size_t delivered;
+        // Entries in the listing, including those which were skipped
+        size_t records;
+    };
+
+    result<listing_stats, error::get_list_of_port_mappings>
+    get_port_listing( protocol
+                    , uint16_t min_port
+                    , uint16_t max_port
+                    , uint16_t max_count
+                    , const std::function<void(map_entry)>& on_entry
+                    , net::yield_context) noexcept;
 
     using soap_response = beast::http::response<beast::http::string_body>;
 
+    // If `fields` is set, the response body is fed to it instead of being
+    // stored in the returned response, and reading stops once it has
+    // what it needs.
     result<soap_response, error::soap_request>
-    soap_request( string_view command
-                , string_view message
+    soap_request( soap::action
+                , string_view args
+                , soap::field_collector* fields
                 , net::yield_context) noexcept;
 
+    // Sets `resent` if it sent the request again after the device may
+    // have processed it.
+    result<soap_response, error::soap_request>
+    send_soap_request( soap::action
+                     , string_view args
+                     , soap::field_collector* fields
+                     , bool& resent
+                     , net::yield_context) noexcept;
+
+    // Address of the interface the device is reached through, for
+    // NewInternalClient. Looked up once and then kept up to date from the
+    // connections made to the device.
+    optional<net::ip::address> local_address(const net::ip::tcp::endpoint&);
+
+    // Evicts this device from the description cache if `rs` shows it is no
+    // longer reachable. Only done for the first request of each handle.
+    void verify_cached(const result<soap_response, error::soap_request>& rs);
+
 private:
     std::string          _uuid;
     device               _upnp_device;
@@ -249,6 +616,64 @@ private:
     std::string          _urn;
     net::any_io_executor _exec;
     cancel_t             _cancel;
+
+    std::weak_ptr<description_cache> _cache;
+    bool                             _verified = true;
+
+    std::shared_ptr<connection_pool> _pool;
+
+    // Shared with clones
+    std::shared_ptr<const soap::envelope> _envelope;
+
+    optional<net::ip::address> _local_address;
+
+    request_policy _policy;
+};
+
+/*
+ * Iterates over the mappings in a port range with GetListOfPortMappings,
+ * each request starting past the highest port returned by the previous one.
+ * With `listing_options::prefetch` the round trip for the next page
+ * overlaps with the caller going through the current one.
+ *
+ *     auto pager = igd.list_port_mappings(igd::udp);
+ *
+ *     while (true) {
+ *         auto r = pager.next(yield);
+ *         if (!r) { ...; break; }
+ *         if (!r.value()) break; // Done
+ *         use(*r.value());
+ *     }
+ *
+ * A failed page is requested again by the next call to `next`. Devices
+ * without any mapping in the range (error 730 PortMappingNotFound) have an
+ * empty listing.
+ */
+class igd::port_mapping_pager {
+public:
+    using error = igd::error::get_list_of_port_mappings;
+
+    port_mapping_pager(port_mapping_pager&&)            = default;
+    port_mapping_pager& operator=(port_mapping_pager&&) = default;
+
+    // The next mapping, none past the last one.
+    result<optional<map_entry>, error> next(net::yield_context) noexcept;
+
+    // Number of pages requested so far
+    size_t requests() const;
+
+    // Stops a request for the next page which may be in flight.
+    ~port_mapping_pager();
+
+private:
+    friend class igd;
+
+    struct state;
+
+    explicit port_mapping_pager(std::shared_ptr<state>);
+
+private:
+    std::shared_ptr<state> _state;
 };
 
 } // namespace upnp
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <upnp/igd.h>
+#include <upnp/description_cache.h>
+
+namespace upnp {
+
+// Keeps an up to date list of the IGDs on the local network by listening to
+// their SSDP announcements (ssdp:alive, ssdp:byebye and ssdp:update)
+// instead of repeatedly running `igd::discover`. Descriptions of newly
+// announced gateways are fetched right away, so looking the gateways up is
+// instant and the network is only touched when something changes.
+class igd_registry {
+public:
+    struct options {
+        // Local IPv4 addresses to listen on. If empty, all local interfaces
+        // which are up and support multicast are used.
+        std::vector<net::ip::address_v4> interfaces;
+
+        // Run one M-SEARCH round on start to learn about gateways that
+        // announced themselves before we started listening.
+        bool initial_search = true;
+
+        // Used when announcements don't include max-age.
+        std::chrono::seconds default_max_age = std::chrono::minutes(30);
+
+        // If set, descriptions are looked up here before being fetched.
+        std::shared_ptr<description_cache> cache;
+
+        // Used to fetch descriptions and given to the handles returned by
+        // `igds`.
+        igd::request_policy policy;
+    };
+
+public:
+    igd_registry(const igd_registry&)            = delete;
+    igd_registry& operator=(const igd_registry&) = delete;
+
+    igd_registry(igd_registry&&)            = default;
+    igd_registry& operator=(igd_registry&&) = default;
+
+    static result<igd_registry> start(net::any_io_executor, options);
+
+    // Handles to the currently known, unexpired gateways whose descriptions
+    // have been fetched.
+    std::vector<igd> igds() const;
+
+    // Number of gateways currently tracked, including those whose
+    // description is still being fetched.
+    size_t size() const;
+
+    void stop();
+
+    ~igd_registry();
+
+private:
+    struct state_t;
+    igd_registry(std::shared_ptr<state_t>);
+
+private:
+    std::shared_ptr<state_t> _state;
+};
+
+} // namespace upnp
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <upnp/igd.h>
+#include <chrono>
+#include <memory>
+
+namespace upnp {
+
+// Runs at most one `igd::discover` at a time on behalf of any number of
+// callers. Those which call `discover` while a round is in progress wait
+// for it and get the same results instead of starting a search of their
+// own. Optionally, the results of a finished round are also handed to
+// callers arriving shortly after it.
+//
+// Every caller gets its own `igd` handles.
+class shared_discovery {
+public:
+    struct options {
+        igd::discover_options discover;
+
+        // How long the results of a finished round are reused for. Zero
+        // only shares rounds in progress.
+        std::chrono::milliseconds result_ttl{0};
+    };
+
+public:
+    shared_discovery(net::any_io_executor);
+    shared_discovery(net::any_io_executor, options);
+
+    shared_discovery(const shared_discovery&)            = delete;
+    shared_discovery& operator=(const shared_discovery&) = delete;
+
+    shared_discovery(shared_discovery&&)            = default;
+    shared_discovery& operator=(shared_discovery&&) = default;
+
+    result<std::vector<igd>> discover(net::yield_context);
+
+    // Don't reuse the results of the last round, e.g. because one of the
+    // gateways stopped responding. A round in progress is still shared.
+    void invalidate();
+
+private:
+    struct state_t;
+
+private:
+    std::shared_ptr<state_t> _state;
+};
+
+} // namespace upnp
@@ -5,20 +5,28 @@
 #include <upnp/third_party/variant.h>
 #include <upnp/third_party/error_code.h>
 #include <upnp/url.h>
+#include <upnp/third_party/optional.h>
 
 #include <boost/range/begin.hpp> // needed by spawn
 #include <boost/range/end.hpp> // needed by spawn
 #include <boost/asio/spawn.hpp>
+#include <boost/asio/ip/address.hpp>
 #include <boost/asio/ip/address_v4.hpp>
+#include <boost/asio/ip/address_v6.hpp>
+#include <boost/asio/ip/udp.hpp>
+#include <chrono>
+#include <map>
+#include <vector>
 
 namespace upnp { namespace ssdp {
 
 class query {
 public:
     struct error {
-        struct http_status_line { std::string response; };
-        struct http_result      { std::string response; };
-        struct location_url     { std::string response; };
+        // Offsets are from the start of the received datagram.
+        struct http_status_line { size_t offset; };
+        struct http_result      { size_t offset; };
+        struct location_url     { size_t offset; };
 
         struct parse {
             variant< http_status_line
@@ -27,6 +35,19 @@ public:
                    > inner;
         };
 
+        friend std::ostream& operator<<(std::ostream& os, const http_status_line& e) {
+            return os << "invalid status line at offset " << e.offset;
+        }
+        friend std::ostream& operator<<(std::ostream& os, const http_result& e) {
+            return os << "non OK result at offset " << e.offset;
+        }
+        friend std::ostream& operator<<(std::ostream& os, const location_url& e) {
+            return os << "invalid location at offset " << e.offset;
+        }
+        friend std::ostream& operator<<(std::ostream& os, const parse& e) {
+            return os << "failed to parse response: " << e.inner;
+        }
+
         struct get_response {
             // get_response may continue working after reporting
             // `parse` error.
@@ -43,13 +64,43 @@ public:
         };
     };
 
+    // Response with fields pointing into the received datagram. Parsing it
+    // doesn't allocate, so duplicates and unwanted responses are dropped
+    // without copying anything.
+    struct response_view {
+        string_view service_type;
+        string_view usn;
+        string_view uuid;
+        string_view location;
+        string_view server;
+        optional<std::chrono::seconds> max_age;
+        // BOOTID.UPNP.ORG and CONFIGID.UPNP.ORG (UDA 1.1)
+        optional<uint32_t> boot_id;
+        optional<uint32_t> config_id;
+
+        string_view datagram;
+
+        static result<response_view, error::parse> parse(string_view);
+    };
+
     struct response {
         std::string service_type;
         std::string usn; // usn stands for unique servie name
         std::string uuid; // uuid is part of usn
         url_t location;
+        std::string server;
+        optional<uint32_t> boot_id;
+        optional<uint32_t> config_id;
+        // Local address of the interface the response was received on.
+        net::ip::address interface_address;
+        // From the CACHE-CONTROL header, how long the advertisement
+        // (and the description behind `location`) stays valid.
+        optional<std::chrono::seconds> max_age;
+        // Time between sending the M-SEARCH and receiving this response.
+        std::chrono::steady_clock::duration latency{};
 
         static result<response, error::parse> parse(string_view);
+        static result<response, error::parse> parse(const response_view&);
 
         friend std::ostream& operator<<(std::ostream& os, const response& r)
         {
@@ -57,10 +108,81 @@ public:
                       << " location:" << r.location
                       << " service_type:" << r.service_type
                       << " usn:" << r.usn
+                      << " interface:" << r.interface_address
                       << ")";
         }
     };
 
+    struct options {
+        // Local IPv4 addresses to search on, each with its own socket.
+        std::vector<net::ip::address_v4> interfaces;
+
+        // Link-local IPv6 addresses (with the scope id set to the interface
+        // index) to search on in parallel with IPv4. Each gets a socket
+        // which searches both the link-local (ff02::c) and the site-local
+        // (ff05::c) groups. Responses are deduplicated by USN across both
+        // address families, the first one received is reported.
+        std::vector<net::ip::address_v6> interfaces_v6;
+
+        // Value of the MX header, devices delay their responses by a
+        // random time of up to this long.
+        std::chrono::seconds mx = std::chrono::seconds(2);
+
+        // How long to wait for responses after sending the M-SEARCH.
+        std::chrono::milliseconds timeout = std::chrono::milliseconds(2200);
+
+        // Hosts sent a unicast M-SEARCH besides the multicast ones, usually
+        // the default gateway (UDA 1.1 allows searching a known address
+        // directly). Only IPv4 targets are searched from IPv4 interfaces
+        // and likewise for IPv6.
+        std::vector<net::ip::udp::endpoint> unicast_targets;
+
+        // If set, once one of `unicast_targets` responds the query only
+        // waits this much longer for multicast responses instead of the
+        // rest of `timeout`.
+        optional<std::chrono::milliseconds> unicast_linger;
+
+        // How many more times each M-SEARCH is sent, at jittered intervals
+        // over the first half of `timeout`. Searches which were already
+        // answered on an interface aren't sent on it again.
+        unsigned retransmits = 2;
+
+        // SO_RCVBUF of each socket. A M-SEARCH on a busy network can be
+        // answered by a burst of thousands of datagrams which the default
+        // buffer may be too small for. Zero keeps the system default.
+        int receive_buffer_size = 0;
+
+        // Responses received but not yet taken by `get_response`. When
+        // the queue is full the sockets aren't read until there is room
+        // again, so excess datagrams are dropped by the system instead of
+        // piling up in memory.
+        size_t max_queued_responses = 64;
+
+        // Upper bound on distinct USNs remembered for dropping duplicates.
+        // Responses with new USNs past this limit are dropped.
+        size_t max_unique_responses = 4096;
+
+        // Token bucket applied to each sending address, so that a single
+        // noisy or malicious host can't crowd out the others. A host may
+        // send `source_burst` datagrams at once, then `source_rate` per
+        // second.
+        double source_rate = 20;
+        size_t source_burst = 40;
+    };
+
+    // What happened to the datagrams received so far.
+    struct counters {
+        size_t received = 0;
+        size_t duplicates = 0;
+        // Dropped by the per source rate limit.
+        size_t rate_limited = 0;
+        // Dropped because the queue or the set of USNs was full.
+        size_t overflow = 0;
+        // Datagrams that failed to parse. Only the first one from each
+        // source is reported by `get_response`.
+        size_t parse_errors = 0;
+    };
+
 public:
     query(const query&)            = delete;
     query& operator=(const query&) = delete;
@@ -70,12 +192,23 @@ public:
 
     static result<query> start(net::any_io_executor exec, const net::ip::address_v4& bind_ip, net::yield_context yield);
 
+    // Search on each of the `bind_ips` in parallel, each with its own
+    // socket. Responses from all of them are received through the one
+    // returned query. Interfaces which fail to set up are skipped, an error
+    // is only returned if none of them could be used.
+    static result<query> start(net::any_io_executor exec, const std::vector<net::ip::address_v4>& bind_ips, net::yield_context yield);
+
+    static result<query> start(net::any_io_executor exec, const options&, net::yield_context yield);
+
     // May be called multiple times until error is of type error_code.
     // This let's callers of this function decide what to do when ssdp
     // received a response that we failed to parse.
     result<response, error::get_response>
     get_response(net::yield_context);
 
+    // Still valid after `stop`, counting up to that point.
+    counters stats() const;
+
     void stop();
 
     ~query();
@@ -84,6 +217,115 @@ private:
     struct state_t;
     query(std::shared_ptr<state_t>);
 
+private:
+    std::shared_ptr<state_t> _state;
+    // As they were when stopped
+    counters _stopped_stats;
+};
+
+// Remembers how long devices took to respond to M-SEARCH, so that later
+// queries can use a smaller MX and a shorter response window. Most
+// gateways answer within tens of milliseconds, while some honor MX
+// literally and spread their responses across the whole window; the window
+// is chosen to cover the slowest device seen so far.
+//
+// Without any history (or after a round in which nothing responded) the
+// conservative defaults of `query::options` are used. Devices which didn't
+// respond within a shortened window widen the next one and are forgotten
+// after missing several rounds in a row.
+class response_history {
+public:
+    using duration = std::chrono::steady_clock::duration;
+
+    struct window {
+        std::chrono::seconds mx;
+        std::chrono::milliseconds timeout;
+    };
+
+    // Window to use for the next query.
+    window begin_round();
+
+    void record(const std::string& usn, duration latency);
+
+    // To be called once the query's window has passed. Not calling it
+    // (e.g. when the query was stopped early) is fine, the round is then
+    // not used to detect missing devices.
+    void end_round();
+
+    size_t size() const { return _devices.size(); }
+
+private:
+    struct device_stats {
+        // Latencies of the most recent responses
+        std::vector<duration> samples;
+        unsigned misses = 0;
+        bool seen = false;
+    };
+
+    std::map<std::string, device_stats> _devices;
+    optional<window> _round;
+    bool _reset = true;
+};
+
+// Announcement devices multicast when they join or leave the network, when
+// they renew their advertisement and when their description changes
+// (Section 1.2 in UDA 1.1).
+struct notify {
+    enum sub_type_t { alive, byebye, update };
+
+    // NTS header
+    sub_type_t sub_type = alive;
+    // NT header
+    std::string notification_type;
+    std::string usn;
+    std::string uuid;
+    // Not sent with ssdp:byebye
+    url_t location;
+    optional<std::chrono::seconds> max_age;
+    optional<uint32_t> boot_id;
+    optional<uint32_t> config_id;
+
+    static optional<notify> parse(string_view);
+
+    friend std::ostream& operator<<(std::ostream& os, const notify& n)
+    {
+        static const char* types[] = { "alive", "byebye", "update" };
+
+        return os << "(" << types[n.sub_type]
+                  << " nt:" << n.notification_type
+                  << " usn:" << n.usn
+                  << " location:" << n.location
+                  << ")";
+    }
+};
+
+// Passive counterpart of `query`. Listens on the SSDP port for NOTIFY
+// messages devices send on their own.
+class listener {
+public:
+    listener(const listener&)            = delete;
+    listener& operator=(const listener&) = delete;
+
+    listener(listener&&)            = default;
+    listener& operator=(listener&&) = default;
+
+    // Binds to UDP port 1900 and joins the SSDP multicast group on each of
+    // `interfaces`, or on the default interface if the list is empty.
+    static result<listener> start(net::any_io_executor, const std::vector<net::ip::address_v4>& interfaces);
+
+    // Waits for the next announcement. Datagrams which aren't valid NOTIFY
+    // messages (e.g. M-SEARCH requests of other control points) are
+    // skipped.
+    result<notify> next(net::yield_context);
+
+    void stop();
+
+    ~listener();
+
+private:
+    struct state_t;
+    listener(std::shared_ptr<state_t>);
+
 private:
     std::shared_ptr<state_t> _state;
 };
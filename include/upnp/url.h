@@ -2,6 +2,7 @@
 
 #include <upnp/third_party/optional.h>
 #include <upnp/third_party/string_view.h>
+#include <string>
 
 namespace upnp {
 
@@ -28,6 +29,11 @@ public:
         *this = std::move(other);
     }
 
+    url_t& operator=(const url_t& other)
+    {
+        return *this = url_t(other);
+    }
+
     url_t& operator=(url_t&& other)
     {
         auto old_ptr = other._buf.data();
@@ -59,6 +65,11 @@ public:
         return string_view(_host.data(), _port.end() - _host.begin());
     }
 
+    // Value for the HTTP Host header. Like `host_and_port`, but without the
+    // zone of an IPv6 literal (e.g. "%2" in "[fe80::1%2]:5000"), which is
+    // only meaningful on this host (RFC 6874, section 2).
+    std::string host_header() const;
+
     optional<uint16_t> numeric_port() const;
 
     void replace_path(string_view p) {
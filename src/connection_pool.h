@@ -0,0 +1,106 @@
+#pragma once
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/beast/core/tcp_stream.hpp>
+#include <upnp/third_party/error_code.h>
+#include <upnp/third_party/net.h>
+#include <upnp/third_party/optional.h>
+#include <chrono>
+#include <deque>
+
+namespace upnp {
+
+namespace beast = boost::beast;
+
+// Idle HTTP/1.1 connections to one device, kept open so that consecutive
+// SOAP requests don't each pay for a TCP handshake. Connections are handed
+// out most recently used first; those idle for longer than `idle_timeout`
+// or closed by the device in the meantime are dropped instead of reused.
+class connection_pool {
+public:
+    using clock = std::chrono::steady_clock;
+
+    connection_pool(size_t max_idle, clock::duration idle_timeout)
+        : _max_idle(max_idle)
+        , _idle_timeout(idle_timeout)
+    {}
+
+    optional<beast::tcp_stream> take(const net::ip::tcp::endpoint& ep)
+    {
+        expire();
+
+        while (!_idle.empty()) {
+            auto e = std::move(_idle.back());
+            _idle.pop_back();
+
+            if (e.remote != ep || is_closed(e.stream)) continue;
+
+            return optional<beast::tcp_stream>(std::move(e.stream));
+        }
+
+        return boost::none;
+    }
+
+    void give_back(beast::tcp_stream stream)
+    {
+        error_code ec;
+        auto ep = stream.socket().remote_endpoint(ec);
+        if (ec) return;
+
+        expire();
+
+        if (_idle.size() >= _max_idle) {
+            if (_max_idle == 0) return;
+            _idle.pop_front();
+        }
+
+        _idle.push_back(entry{std::move(stream), ep, clock::now()});
+    }
+
+    size_t idle() const { return _idle.size(); }
+
+    void clear() { _idle.clear(); }
+
+private:
+    struct entry {
+        beast::tcp_stream stream;
+        net::ip::tcp::endpoint remote;
+        clock::time_point idle_since;
+    };
+
+    void expire()
+    {
+        auto now = clock::now();
+
+        // Entries are ordered by `idle_since`
+        while (!_idle.empty() && now - _idle.front().idle_since >= _idle_timeout) {
+            _idle.pop_front();
+        }
+    }
+
+    // A device closing an idle connection leaves it readable at EOF, a
+    // healthy one has nothing to read. Anything else (unsolicited data,
+    // errors) makes the connection unusable too.
+    static bool is_closed(beast::tcp_stream& stream)
+    {
+        auto& s = stream.socket();
+        error_code ec;
+
+        s.non_blocking(true, ec);
+        if (ec) return true;
+
+        char c;
+        s.receive(net::buffer(&c, 1), net::socket_base::message_peek, ec);
+        bool closed = ec != net::error::would_block;
+
+        s.non_blocking(false, ec);
+        return closed || ec;
+    }
+
+private:
+    size_t _max_idle;
+    clock::duration _idle_timeout;
+    std::deque<entry> _idle;
+};
+
+} // namespace upnp
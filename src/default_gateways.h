@@ -0,0 +1,74 @@
+#pragma once
+
+#include <boost/asio/ip/address_v4.hpp>
+#include <upnp/third_party/net.h>
+#include <upnp/third_party/optional.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace upnp {
+
+// The next hop of a line of /proc/net/route if it's an IPv4 default route
+// which is up. Columns are "Iface Destination Gateway Flags ...", and the
+// kernel prints each address (a big endian `__be32`) as a hex integer in
+// host byte order.
+inline
+optional<net::ip::address_v4> parse_default_route(const std::string& line) {
+    std::istringstream ss(line);
+    std::string iface, dest_s, gw_s, flags_s;
+    if (!(ss >> iface >> dest_s >> gw_s >> flags_s)) return none;
+
+    unsigned long dest, gw, flags;
+
+    try {
+        dest  = std::stoul(dest_s,  nullptr, 16);
+        gw    = std::stoul(gw_s,    nullptr, 16);
+        flags = std::stoul(flags_s, nullptr, 16);
+    } catch (const std::exception&) {
+        return none;
+    }
+
+    const unsigned long rtf_up = 0x1, rtf_gateway = 0x2;
+
+    if (dest != 0) return none;
+    if ((flags & (rtf_up | rtf_gateway)) != (rtf_up | rtf_gateway)) return none;
+
+    // Back in memory the integer is in network byte order again
+    uint32_t gw_be = uint32_t(gw);
+    net::ip::address_v4::bytes_type bytes;
+    static_assert(sizeof(gw_be) == sizeof(bytes), "");
+    std::memcpy(bytes.data(), &gw_be, bytes.size());
+
+    return net::ip::address_v4(bytes);
+}
+
+// Next hops of the IPv4 default routes. Read from /proc/net/route, so this
+// is empty on systems other than Linux.
+inline
+std::vector<net::ip::address_v4> default_ipv4_gateways() {
+    std::vector<net::ip::address_v4> ret;
+
+    std::ifstream f("/proc/net/route");
+    if (!f) return ret;
+
+    std::string line;
+    std::getline(f, line); // Column names
+
+    while (std::getline(f, line)) {
+        auto addr = parse_default_route(line);
+        if (!addr) continue;
+
+        if (std::find(ret.begin(), ret.end(), *addr) == ret.end()) {
+            ret.push_back(*addr);
+        }
+    }
+
+    return ret;
+}
+
+} // namespace upnp
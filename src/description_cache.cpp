@@ -0,0 +1,231 @@
+#include <upnp/description_cache.h>
+#include "parse_device.h"
+#include <boost/system/error_code.hpp>
+#include <cstdio>
+#include <fstream>
+
+namespace upnp {
+
+namespace sys = boost::system;
+
+static const char* file_magic = "cpp-upnp-description-cache 1";
+
+// Descriptions are a few kilobytes, a larger size means a corrupt file.
+static const size_t max_xml_size = 1 << 20;
+
+// The "uuid:XXX" part of a USN such as "uuid:XXX::urn:...:InternetGatewayDevice:1"
+static string_view usn_uuid(string_view usn)
+{
+    return usn.substr(0, usn.find("::"));
+}
+
+const description_cache::entry*
+description_cache::find(string_view usn, const url_t& location) const
+{
+    auto now = clock::now();
+
+    auto matches = [&] (const entry& e) {
+        return e.expires > now
+            && string_view(e.location) == string_view(location);
+    };
+
+    auto i = _entries.find(usn);
+    if (i != _entries.end()) {
+        return matches(i->second) ? &i->second : nullptr;
+    }
+
+    // USNs of the same device differ in the search target suffix
+    auto uuid = usn_uuid(usn);
+
+    for (auto& p : _entries) {
+        auto& e = p.second;
+        if (usn_uuid(e.usn) != uuid) continue;
+        if (matches(e)) return &e;
+    }
+
+    return nullptr;
+}
+
+const description_cache::entry*
+description_cache::insert( std::string usn
+                         , std::string uuid
+                         , url_t location
+                         , optional<std::chrono::seconds> max_age
+                         , std::string xml)
+{
+    auto expires = clock::now() + (max_age ? *max_age : _default_max_age);
+
+    return emplace( std::move(usn)
+                  , std::move(uuid)
+                  , std::move(location)
+                  , expires
+                  , std::move(xml));
+}
+
+description_cache::entry*
+description_cache::emplace( std::string usn
+                          , std::string uuid
+                          , url_t location
+                          , clock::time_point expires
+                          , std::string xml)
+{
+    auto opt_root = device_parse_root(xml);
+    if (!opt_root) return nullptr;
+
+    auto key = usn;
+
+    auto& e = _entries[std::move(key)];
+
+    e.usn         = std::move(usn);
+    e.uuid        = std::move(uuid);
+    e.location    = std::move(location);
+    e.expires     = expires;
+    e.root_device = std::move(*opt_root);
+    e.xml         = std::move(xml);
+
+    return &e;
+}
+
+void description_cache::erase(string_view usn)
+{
+    auto i = _entries.find(usn);
+    if (i != _entries.end()) _entries.erase(i);
+}
+
+void description_cache::erase_uuid(string_view uuid)
+{
+    for (auto i = _entries.begin(); i != _entries.end();) {
+        if (i->second.uuid == uuid) i = _entries.erase(i);
+        else ++i;
+    }
+}
+
+void description_cache::erase_expired()
+{
+    auto now = clock::now();
+
+    for (auto i = _entries.begin(); i != _entries.end();) {
+        if (i->second.expires <= now) i = _entries.erase(i);
+        else ++i;
+    }
+}
+
+std::vector<const description_cache::entry*>
+description_cache::entries() const
+{
+    auto now = clock::now();
+    std::vector<const entry*> ret;
+
+    for (auto& p : _entries) {
+        if (p.second.expires > now) ret.push_back(&p.second);
+    }
+
+    return ret;
+}
+
+// File format:
+//
+//     <file_magic>\n
+//     then for each entry:
+//     <usn>\n<uuid>\n<location>\n<expiry, seconds since epoch>\n<xml size>\n<xml>\n
+result<void> description_cache::save(const std::string& path) const
+{
+    using namespace std::chrono;
+
+    // Write to a temporary file first so that a crash doesn't leave a
+    // truncated cache behind.
+    auto tmp_path = path + ".tmp";
+
+    {
+        std::ofstream f(tmp_path, std::ios::binary | std::ios::trunc);
+        if (!f) return sys::errc::io_error;
+
+        f << file_magic << "\n";
+
+        for (auto e : entries()) {
+            // It wouldn't load
+            if (e->xml.size() > max_xml_size) continue;
+
+            auto expires = duration_cast<seconds>(e->expires.time_since_epoch());
+
+            f << e->usn                  << "\n"
+              << e->uuid                 << "\n"
+              << e->location             << "\n"
+              << expires.count()         << "\n"
+              << e->xml.size()           << "\n";
+            f.write(e->xml.data(), e->xml.size());
+            f << "\n";
+        }
+
+        f.flush();
+        if (!f) return sys::errc::io_error;
+    }
+
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::remove(tmp_path.c_str());
+        return sys::errc::io_error;
+    }
+
+    return success();
+}
+
+result<void> description_cache::load(const std::string& path)
+{
+    std::ifstream f(path, std::ios::binary | std::ios::ate);
+    if (!f) return sys::errc::no_such_file_or_directory;
+
+    auto file_size = f.tellg();
+    f.seekg(0);
+
+    std::string line;
+    if (!std::getline(f, line) || line != file_magic) {
+        return sys::errc::illegal_byte_sequence;
+    }
+
+    auto now = clock::now();
+
+    while (true) {
+        std::string usn, uuid, location_s, expires_s, size_s;
+
+        if (!std::getline(f, usn))        break;
+        if (!std::getline(f, uuid))       return sys::errc::illegal_byte_sequence;
+        if (!std::getline(f, location_s)) return sys::errc::illegal_byte_sequence;
+        if (!std::getline(f, expires_s))  return sys::errc::illegal_byte_sequence;
+        if (!std::getline(f, size_s))     return sys::errc::illegal_byte_sequence;
+
+        long long expires_n;
+        size_t size;
+
+        try {
+            expires_n = std::stoll(expires_s);
+            size      = std::stoul(size_s);
+        } catch (const std::exception&) {
+            return sys::errc::illegal_byte_sequence;
+        }
+
+        // Checked before allocating, a corrupt size could be anything
+        if (size > max_xml_size || std::streamoff(size) > file_size - f.tellg()) {
+            return sys::errc::illegal_byte_sequence;
+        }
+
+        std::string xml(size, '\0');
+        f.read(&xml[0], size);
+        if (!f || f.get() != '\n') return sys::errc::illegal_byte_sequence;
+
+        clock::time_point expires{std::chrono::seconds(expires_n)};
+        if (expires <= now) continue;
+
+        auto location = url_t::parse(std::move(location_s));
+        if (!location) continue;
+
+        emplace( std::move(usn)
+               , std::move(uuid)
+               , std::move(*location)
+               , expires
+               , std::move(xml));
+    }
+
+    return success();
+}
+
+} // namespace upnp
@@ -4,13 +4,23 @@
 #include <boost/algorithm/string.hpp>
 #include <boost/beast.hpp>
 #include "local_address_to.h"
+#include "default_gateways.h"
+#include "local_interfaces.h"
 #include "str/consume_endpoint.h"
+#include "str/parse_address.h"
 #include <upnp/ssdp.h>
 #include <upnp/device.h>
 #include <upnp/config.h>
 #include <upnp/igd.h>
-#include "xml.h"
+#include <upnp/description_cache.h>
 #include "parse_device.h"
+#include "condition_variable.h"
+#include "connection_pool.h"
+#include "soap.h"
+#include "soap_fields.h"
+#include "soap_schema.h"
+#include <boost/asio/steady_timer.hpp>
+#include <random>
 #include <set>
 
 namespace upnp {
@@ -29,8 +39,30 @@ igd::igd( std::string          uuid
     , _url(std::move(url))
     , _urn(std::move(urn))
     , _exec(exec)
+    , _envelope(std::make_shared<soap::envelope>( _url.host_header()
+                                                , _url.path()
+                                                , _urn))
 {}
 
+igd igd::clone() const
+{
+    igd ret(_uuid, _upnp_device, _service_id, _url, _urn, _exec);
+    ret._cache    = _cache;
+    ret._verified = _verified;
+    ret._pool     = _pool;
+    ret._envelope = _envelope;
+    ret._local_address = _local_address;
+    ret._policy   = _policy;
+    return ret;
+}
+
+optional<net::ip::address>
+igd::local_address(const net::ip::tcp::endpoint& remote)
+{
+    if (!_local_address) _local_address = local_address_to(_exec, remote);
+    return _local_address;
+}
+
 result<void, igd::error::add_port_mapping>
 igd::add_port_mapping( protocol proto
                      , uint16_t external_port
@@ -44,175 +76,323 @@ igd::add_port_mapping( protocol proto
     if (!opt_remote_ep)
         return error::igd_host_parse_failed{_url};
 
-    auto opt_local_ip = local_address_to(*opt_remote_ep);
+    auto opt_local_ip = local_address(*opt_remote_ep);
     if (!opt_local_ip)
         return error::no_endpoint_to_igd{};
 
-    net::ip::address local_ip = *opt_local_ip;
-
-    std::stringstream body;
-    body << "<u:AddPortMapping xmlns:u=\""<< _urn <<"\">"
-            "<NewRemoteHost></NewRemoteHost>"
-            "<NewEnabled>1</NewEnabled>"
-            "<NewExternalPort>"           << external_port     << "</NewExternalPort>"
-            "<NewProtocol>"               << proto             << "</NewProtocol>"
-            "<NewInternalPort>"           << internal_port     << "</NewInternalPort>"
-            "<NewInternalClient>"         << local_ip          << "</NewInternalClient>"
-            "<NewPortMappingDescription>" << description       << "</NewPortMappingDescription>"
-            "<NewLeaseDuration>"          << duration.count()  << "</NewLeaseDuration>"
-            "</u:AddPortMapping>";
-
-    auto rs = soap_request("AddPortMapping", body.str(), yield);
+    return add_port_mapping( proto, external_port, internal_port
+                           , description, duration, *opt_local_ip, yield);
+}
+
+result<void, igd::error::add_port_mapping>
+igd::add_port_mapping( protocol proto
+                     , uint16_t external_port
+                     , uint16_t internal_port
+                     , string_view description
+                     , std::chrono::seconds duration
+                     , const net::ip::address& local_ip
+                     , net::yield_context yield) noexcept
+{
+    soap::args args;
+    args.add("NewRemoteHost", "")
+        .add("NewEnabled", 1)
+        .add("NewExternalPort", external_port)
+        .add("NewProtocol", proto == tcp ? "TCP" : "UDP")
+        .add("NewInternalPort", internal_port)
+        .add("NewInternalClient", local_ip)
+        .add("NewPortMappingDescription", description)
+        .add("NewLeaseDuration", duration.count());
+
+    auto rs = soap_request(soap::action::add_port_mapping, args.str(), nullptr, yield);
     if (!rs) return rs.error();
 
     return success();
 }
 
+// Response schemas, see soap_schema.h
+
+namespace {
+    struct external_address {
+        net::ip::address address;
+    };
+}
+
+static const auto external_address_schema = soap::make_schema(
+    "GetExternalIPAddressResponse",
+    soap::bind("NewExternalIPAddress", &external_address::address));
+
+static const auto generic_entry_schema = soap::make_schema(
+    "GetGenericPortMappingEntryResponse",
+    soap::bind("NewPortMappingDescription", &igd::map_entry::description),
+    soap::bind("NewExternalPort",           &igd::map_entry::ext_port),
+    soap::bind("NewInternalPort",           &igd::map_entry::int_port),
+    soap::bind("NewLeaseDuration",          &igd::map_entry::lease_duration),
+    soap::bind("NewProtocol",               &igd::map_entry::proto),
+    soap::bind("NewInternalClient",         &igd::map_entry::int_client),
+    soap::bind("NewEnabled",                &igd::map_entry::enabled));
+
+// An entry of the NewPortListing document of GetListOfPortMappings
+static const auto listing_entry_schema = soap::make_schema(
+    "PortMappingEntry",
+    soap::bind("NewExternalPort",   &igd::map_entry::ext_port),
+    soap::bind("NewInternalPort",   &igd::map_entry::int_port),
+    soap::bind("NewInternalClient", &igd::map_entry::int_client),
+    soap::bind("NewEnabled",        &igd::map_entry::enabled),
+    soap::bind("NewLeaseTime",      &igd::map_entry::lease_duration),
+    soap::bind("NewDescription",    &igd::map_entry::description),
+    soap::bind("NewProtocol",       &igd::map_entry::proto));
+
+// Detail of SOAP faults (UDA 1.1, section 3.2.2)
+static const auto upnp_error_schema = soap::make_schema(
+    "UPnPError",
+    soap::bind("errorCode",        &igd::error::upnp_fault::code),
+    soap::bind("errorDescription", &igd::error::upnp_fault::description));
+
+static igd::error::bad_field to_error(const soap::field_error& e)
+{
+    return {e.name.to_string(), e.missing};
+}
+
 result<net::ip::address, igd::error::get_external_address>
 igd::get_external_address(net::yield_context yield) noexcept
 {
-    std::string body = "<u:GetExternalIPAddress xmlns:u=\"" + _urn + "\"/>";
+    external_address ext;
+    soap::decoder<decltype(external_address_schema)> decoder(external_address_schema, ext);
+    soap::field_collector fields(external_address_schema.element(), decoder);
 
-    auto rs = soap_request("GetExternalIPAddress", body, yield);
+    auto rs = soap_request( soap::action::get_external_ip_address, ""
+                          , &fields, yield);
     if (!rs) return rs.error();
 
-    auto opt_xml = xml::parse(rs.value().body());
-    if (!opt_xml) return error::invalid_xml_body{};
-    auto& xml_rs = *opt_xml;
-
-    const char* path = "*:Envelope.*:Body.u:GetExternalIPAddressResponse."
-                       "NewExternalIPAddress";
+    if (fields.malformed()) return error::invalid_xml_body{};
 
-    auto opt_ip_s = xml::get<std::string>(xml_rs, path);
-    if (!opt_ip_s) return error::invalid_response{};
-    auto& ip_s = *opt_ip_s;
-
-    error_code ec;
-    auto addr = net::ip::make_address(ip_s, ec);
-    if (ec) return error::bad_address{};
+    if (auto e = decoder.error()) {
+        if (!e->missing) return error::bad_address{};
+        return to_error(*e);
+    }
 
-    return {std::move(addr)};
+    return {std::move(ext.address)};
 }
 
 result<igd::map_entry, igd::error::get_generic_port_mapping_entry>
 igd::get_generic_port_mapping_entry( uint16_t index
                                    , net::yield_context yield) noexcept
 {
-    std::stringstream body;
-    body <<
-        "<u:GetGenericPortMappingEntry xmlns:u=\"" << _urn << "\">"
-        "<NewPortMappingIndex>" << index << "</NewPortMappingIndex>"
-        "</u:GetGenericPortMappingEntry>";
+    soap::args args;
+    args.add("NewPortMappingIndex", index);
 
-    auto rs = soap_request("GetGenericPortMappingEntry", body.str(), yield);
-    if (!rs) return rs.error();
+    map_entry entry;
+    soap::decoder<decltype(generic_entry_schema)> decoder(generic_entry_schema, entry);
+    soap::field_collector fields(generic_entry_schema.element(), decoder);
 
-    auto b = std::move(rs.value().body());
-    auto opt_xml = xml::parse(b);
-    if (!opt_xml) return error::invalid_xml_body{};
-    auto& xml_rs = *opt_xml;
+    auto rs = soap_request( soap::action::get_generic_port_mapping_entry
+                          , args.str(), &fields, yield);
+    if (!rs) return rs.error();
 
-    const char* path = "*:Envelope.*:Body.u:GetGenericPortMappingEntryResponse";
-    auto o = xml::get_child(xml_rs, path);
+    if (fields.malformed()) return error::invalid_xml_body{};
+    if (auto e = decoder.error()) return to_error(*e);
 
-    auto odes = o->get_optional<std::string>("NewPortMappingDescription");
-    auto oext = xml::get_num<uint16_t>(*o, "NewExternalPort");
-    auto oint = xml::get_num<uint16_t>(*o, "NewInternalPort");
-    auto odur = xml::get_num<uint32_t>(*o, "NewLeaseDuration");
-    auto opro = o->get_optional<std::string>("NewProtocol");
-    auto ocli = xml::get_address      (*o, "NewInternalClient");
-    auto oena = xml::get_num<uint16_t>(*o, "NewEnabled");
+    return {std::move(entry)};
+}
 
-    if (!oext || !oint || !ocli || !oena || !odur || !odes || !opro)
-        return error::invalid_response{};
+result<std::vector<igd::map_entry>, igd::error::get_list_of_port_mappings>
+igd::get_list_of_port_mappings( protocol proto
+                              , uint16_t min_port
+                              , uint16_t max_port
+                              , uint16_t max_count
+                              , net::yield_context yield) noexcept
+{
+    std::vector<map_entry> entries;
 
-    protocol proto;
-    if (boost::iequals(*opro, "UDP")) {
-        proto = udp;
-    } else if (boost::iequals(*opro, "TCP")) {
-        proto = tcp;
-    } else {
-        return error::invalid_response{};
-    }
+    auto r = get_list_of_port_mappings( proto, min_port, max_port, max_count
+                                      , [&] (map_entry e) { entries.push_back(std::move(e)); }
+                                      , yield);
+    if (!r) return r.error();
 
-    return map_entry {
-        std::move(*odes),
-        *oext,
-        *oint,
-        std::chrono::seconds(*odur),
-        proto,
-        *ocli,
-        bool(*oena)
-    };
+    return {std::move(entries)};
 }
 
-result<std::vector<igd::map_entry>, igd::error::get_list_of_port_mappings>
+result<size_t, igd::error::get_list_of_port_mappings>
 igd::get_list_of_port_mappings( protocol proto
                               , uint16_t min_port
                               , uint16_t max_port
                               , uint16_t max_count
+                              , const std::function<void(map_entry)>& on_entry
                               , net::yield_context yield) noexcept
 {
-    std::stringstream body;
-    body <<
-        "<u:GetListOfPortMappings xmlns:u=\"" << _urn << "\">"
-        "<NewStartPort>" << min_port << "</NewStartPort>"
-        "<NewEndPort>" << max_port << "</NewEndPort>"
-        "<NewProtocol>" << proto << "</NewProtocol>"
-        "<NewNumberOfPorts>" << max_count << "</NewNumberOfPorts>"
-        "</u:GetListOfPortMappings>";
+    auto r = get_port_listing(proto, min_port, max_port, max_count, on_entry, yield);
+    if (!r) return r.error();
+    return r.value().delivered;
+}
 
-    auto rs = soap_request("GetListOfPortMappings", body.str(), yield);
+result<igd::listing_stats, igd::error::get_list_of_port_mappings>
+igd::get_port_listing( protocol proto
+                     , uint16_t min_port
+                     , uint16_t max_port
+                     , uint16_t max_count
+                     , const std::function<void(map_entry)>& on_entry
+                     , net::yield_context yield) noexcept
+{
+    soap::args args;
+    args.add("NewStartPort", min_port)
+        .add("NewEndPort", max_port)
+        .add("NewProtocol", proto == tcp ? "TCP" : "UDP")
+        .add("NewNumberOfPorts", max_count);
+
+    // NewPortListing is an escaped XML document of its own, which is
+    // unescaped and decoded in the same pass as the response is read.
+    soap::embedded_records< decltype(listing_entry_schema)
+                          , const std::function<void(map_entry)>&>
+        listing("NewPortListing", listing_entry_schema, on_entry);
+
+    soap::field_collector fields("GetListOfPortMappingsResponse", listing);
+
+    auto rs = soap_request( soap::action::get_list_of_port_mappings
+                          , args.str(), &fields, yield);
     if (!rs) return rs.error();
 
-    auto b = std::move(rs.value().body());
+    if (fields.malformed()) return error::invalid_xml_body{};
+    if (!listing.complete() || listing.malformed()) return error::invalid_response{};
 
-    auto opt_xml = xml::parse(b);
-    if (!opt_xml) return error::invalid_xml_body{};
-    auto& xml_rs = *opt_xml;
+    return listing_stats{listing.delivered(), listing.record_count()};
+}
 
-    const char* path = "s:Envelope.s:Body.u:GetListOfPortMappingsResponse.NewPortListing";
+struct igd::port_mapping_pager::state {
+    using page = result<std::vector<map_entry>, error>;
 
-    auto o1 = xml_rs.get_optional<std::string>(path);
-    if (!o1) return error::invalid_response{};
-    auto o2 = xml::parse(*o1);
-    if (!o2) return error::invalid_response{};
-    auto o3 = o2->get_child_optional("p:PortMappingList");
-    if (!o3) return error::invalid_response{};
+    igd device;
+    protocol proto;
+    listing_options opts;
+
+    ConditionVariable fetched_cv;
+    // A request for the next page is in flight
+    bool fetching = false;
+    optional<page> fetched;
+
+    std::vector<map_entry> current;
+    size_t pos = 0;
+
+    // Where the next page starts, none past the last one
+    optional<uint16_t> next_start;
+    size_t requests = 0;
+
+    state(igd device, protocol proto, listing_options opts)
+        : device(std::move(device))
+        , proto(proto)
+        , opts(opts)
+        , fetched_cv(this->device._exec)
+        , next_start(opts.min_port)
+    {}
+
+    page fetch(uint16_t start, net::yield_context yield)
+    {
+        std::vector<map_entry> entries;
+        entries.reserve(opts.page_size);
+
+        // The highest port seen, entries needn't be in order
+        uint16_t last = start;
+
+        auto r = device.get_port_listing(
+                proto, start, opts.max_port, opts.page_size,
+                [&] (map_entry e) {
+                    last = std::max(last, e.ext_port);
+                    entries.push_back(std::move(e));
+                },
+                yield);
+
+        ++requests;
+
+        if (!r) {
+            // PortMappingNotFound, there's nothing (more) in the range
+            if (igd::error::fault_code(r.error()) == uint16_t(730)) {
+                next_start = boost::none;
+                return {std::move(entries)};
+            }
+            return r.error();
+        }
 
-    std::vector<map_entry> entries;
+        // Devices may return fewer entries than asked for even though
+        // there are more, so only an empty page ends the listing. Without
+        // any valid entry there's nowhere to continue from either.
+        if (entries.empty() || last >= opts.max_port) {
+            next_start = boost::none;
+        } else {
+            next_start = last + 1;
+        }
 
-    for (auto& e : *o3) {
-        if (e.first != "p:PortMappingEntry") continue;
-        auto& child = e.second;
+        return {std::move(entries)};
+    }
 
-        auto oext = xml::get_num<uint16_t>(child, "p:NewExternalPort");
-        auto oint = xml::get_num<uint16_t>(child, "p:NewInternalPort");
-        auto ocli = xml::get_address      (child, "p:NewInternalClient");
-        auto oena = xml::get_num<uint16_t>(child, "p:NewEnabled");
-        auto olea = xml::get_num<uint32_t>(child, "p:NewLeaseTime");
-        auto odes = child.get_optional<std::string>("p:NewDescription");
-        auto opro = child.get_optional<std::string>("p:NewProtocol");
+    static void start_fetch(const std::shared_ptr<state>& self)
+    {
+        self->fetching = true;
+        uint16_t start = *self->next_start;
+
+        net::spawn(self->device._exec, [self, start] (net::yield_context yield) {
+            auto page = self->fetch(start, yield);
+            self->fetching = false;
+            self->fetched = std::move(page);
+            self->fetched_cv.notify();
+        });
+    }
+};
 
-        if (!oext || !oint || !ocli || !oena || !olea || !odes || !opro)
-            continue;
+igd::port_mapping_pager::port_mapping_pager(std::shared_ptr<state> s)
+    : _state(std::move(s))
+{}
 
-        protocol proto = tcp;
+igd::port_mapping_pager::~port_mapping_pager()
+{
+    // The state lives on until the request is done
+    if (_state) _state->device.stop();
+}
 
-        if      (*opro == "UDP") proto = udp;
-        else if (*opro == "TCP") proto = tcp;
-        else continue;
+size_t igd::port_mapping_pager::requests() const
+{
+    return _state->requests;
+}
 
-        entries.push_back({ std::move(*odes)
-                          , *oext
-                          , *oint
-                          , std::chrono::seconds(*olea)
-                          , proto
-                          , std::move(*ocli)
-                          , bool(*oena)});
+result<optional<igd::map_entry>, igd::port_mapping_pager::error>
+igd::port_mapping_pager::next(net::yield_context yield) noexcept
+{
+    auto& s = *_state;
+
+    while (s.pos == s.current.size()) {
+        if (!s.fetching && !s.fetched) {
+            if (!s.next_start) return optional<map_entry>();
+            state::start_fetch(_state);
+        }
+
+        while (!s.fetched) {
+            error_code ec;
+            s.fetched_cv.wait(yield[ec]);
+        }
+
+        auto page = std::move(*s.fetched);
+        s.fetched = boost::none;
+
+        // The page is requested again by the next call
+        if (!page) return page.error();
+
+        s.current = std::move(page.value());
+        s.pos = 0;
+
+        if (s.opts.prefetch && s.next_start) state::start_fetch(_state);
     }
 
-    return {std::move(entries)};
+    return optional<map_entry>(std::move(s.current[s.pos++]));
+}
+
+igd::port_mapping_pager igd::list_port_mappings(protocol proto) const
+{
+    return list_port_mappings(proto, listing_options{});
+}
+
+igd::port_mapping_pager
+igd::list_port_mappings(protocol proto, listing_options opts) const
+{
+    opts.page_size = std::max<uint16_t>(opts.page_size, 1);
+    return port_mapping_pager(std::make_shared<port_mapping_pager::state>(clone(), proto, opts));
 }
 
 result<void, igd::error::delete_port_mapping>
@@ -220,23 +400,380 @@ igd::delete_port_mapping( protocol proto
                         , uint16_t ext_port
                         , net::yield_context yield) noexcept
 {
-    std::stringstream body;
-    body <<
-        "<u:DeletePortMapping xmlns:u=\"" + _urn + "\"/>"
-        "<NewProtocol>" << proto << "</NewProtocol>"
-        "<NewExternalPort>" << ext_port << "</NewExternalPort>"
-        "<NewRemoteHost></NewRemoteHost>"
-        "</u:DeletePortMapping>";
+    soap::args args;
+    args.add("NewRemoteHost", "")
+        .add("NewExternalPort", ext_port)
+        .add("NewProtocol", proto == tcp ? "TCP" : "UDP");
 
-    auto rs = soap_request("DeletePortMapping", body.str(), yield);
+    auto rs = soap_request(soap::action::delete_port_mapping, args.str(), nullptr, yield);
     if (!rs) return rs.error();
     return success();
 }
 
+// Runs `job(i, yield)` for each `i` below `n`, at most `max_in_flight`
+// (which must not be zero) at a time, and returns once all of them are
+// done.
+static void run_batch( const net::any_io_executor& exec
+                     , size_t n
+                     , size_t max_in_flight
+                     , const std::function<void(size_t, net::yield_context)>& job
+                     , net::yield_context yield)
+{
+    ConditionVariable cv(exec);
+    size_t next = 0;
+    size_t running = std::min(max_in_flight, n);
+
+    for (size_t w = running; w != 0; --w) {
+        net::spawn(exec, [&] (net::yield_context y) {
+            while (next < n) job(next++, y);
+            --running;
+            cv.notify();
+        });
+    }
+
+    while (running) {
+        error_code ec;
+        cv.wait(yield[ec]);
+    }
+}
+
+std::vector<result<void, igd::error::add_port_mapping>>
+igd::add_port_mappings( const std::vector<mapping_spec>& mappings
+                      , size_t max_in_flight
+                      , net::yield_context yield) noexcept
+{
+    using E = error::add_port_mapping;
+    using R = result<void, E>;
+
+    auto host_port = _url.host_and_port();
+    auto opt_remote_ep = str::consume_endpoint<net::ip::tcp>(host_port);
+    if (!opt_remote_ep)
+        return std::vector<R>(mappings.size(), R{E{error::igd_host_parse_failed{_url}}});
+
+    auto opt_local_ip = local_address(*opt_remote_ep);
+    if (!opt_local_ip)
+        return std::vector<R>(mappings.size(), R{E{error::no_endpoint_to_igd{}}});
+
+    std::vector<R> ret(mappings.size(), R{success()});
+
+    max_in_flight = std::max<size_t>(max_in_flight, 1);
+
+    run_batch(_exec, mappings.size(), max_in_flight, [&] (size_t i, net::yield_context y) {
+        auto& m = mappings[i];
+        ret[i] = add_port_mapping( m.proto, m.external_port, m.internal_port
+                                 , m.description, m.duration, *opt_local_ip, y);
+    }, yield);
+
+    return ret;
+}
+
+std::vector<result<void, igd::error::delete_port_mapping>>
+igd::delete_port_mappings( const std::vector<mapping_key>& mappings
+                         , size_t max_in_flight
+                         , net::yield_context yield) noexcept
+{
+    using R = result<void, error::delete_port_mapping>;
+
+    std::vector<R> ret(mappings.size(), R{success()});
+
+    max_in_flight = std::max<size_t>(max_in_flight, 1);
+
+    run_batch(_exec, mappings.size(), max_in_flight, [&] (size_t i, net::yield_context y) {
+        ret[i] = delete_port_mapping(mappings[i].proto, mappings[i].external_port, y);
+    }, yield);
+
+    return ret;
+}
+
+// Past the last entry of the table, as far as GetGenericPortMappingEntry
+// goes. Devices differ in which of the two they report.
+static bool is_end_of_table(const igd::error::get_generic_port_mapping_entry& e)
+{
+    auto code = igd::error::fault_code(e);
+    return code == uint16_t(713)  // SpecifiedArrayIndexInvalid
+        || code == uint16_t(714); // NoSuchEntryInArray
+}
+
+// Whether `a` and `b` are the same mapping with the same settings. The
+// lease counts down, so it's left out.
+static bool same_entry(const igd::map_entry& a, const igd::map_entry& b)
+{
+    return a.proto       == b.proto
+        && a.ext_port    == b.ext_port
+        && a.int_port    == b.int_port
+        && a.int_client  == b.int_client
+        && a.description == b.description
+        && a.enabled     == b.enabled;
+}
+
+result<std::vector<igd::map_entry>, igd::error::get_port_mapping_table>
+igd::get_port_mapping_table(net::yield_context yield) noexcept
+{
+    return get_port_mapping_table(table_options{}, yield);
+}
+
+result<std::vector<igd::map_entry>, igd::error::get_port_mapping_table>
+igd::get_port_mapping_table(table_options opts, net::yield_context yield) noexcept
+{
+    using E = error::get_port_mapping_table;
+
+    auto to_error = [] (const error::get_generic_port_mapping_entry& e) {
+        return boost::apply_visitor([] (const auto& v) { return E{v}; }, e);
+    };
+
+    // With no requests in flight the end of the table is never found
+    size_t window = std::max<size_t>(opts.window, 1);
+    const size_t limit = size_t(std::numeric_limits<uint16_t>::max()) + 1;
+
+    std::vector<map_entry> entries;
+    std::set<std::pair<protocol, uint16_t>> seen;
+    // Last index of each window read so far
+    std::vector<size_t> lasts;
+    // Index of the first missing entry, i.e. the size of the table
+    size_t end = limit;
+    bool end_found = false;
+    unsigned retries = 0;
+
+    while (true) {
+        // Once the end is found, a last round only checks what was read
+        size_t a = entries.size();
+        size_t b = end_found ? a : std::min(a + window, limit);
+
+        // An entry moving down past the index being read gets skipped
+        // without a trace. The last entries of the two windows before are
+        // read again, and if nothing moved since, they're where they were.
+        std::vector<size_t> checks( lasts.end() - std::min<size_t>(lasts.size(), 2)
+                                  , lasts.end());
+        if (end_found && end < limit) checks.push_back(end);
+
+        std::vector<optional<map_entry>> slots(b - a);
+        size_t round_end = limit;
+        bool changed = false;
+        optional<error::get_generic_port_mapping_entry> fault, failure;
+
+        size_t n = slots.size() + checks.size();
+
+        run_batch(_exec, n, n, [&] (size_t k, net::yield_context y) {
+            bool check = k >= slots.size();
+            size_t i = check ? checks[k - slots.size()] : a + k;
+
+            auto r = get_generic_port_mapping_entry(uint16_t(i), y);
+
+            if (r) {
+                if (!check) {
+                    slots[k] = std::move(r.value());
+                } else if (i >= entries.size() || !same_entry(r.value(), entries[i])) {
+                    changed = true;
+                }
+            } else if (is_end_of_table(r.error())) {
+                if (!check) round_end = std::min(round_end, i);
+                else if (i < entries.size()) changed = true;
+            } else if (error::fault_code(r.error())) {
+                fault = r.error();
+            } else if (!failure) {
+                failure = r.error();
+            }
+        }, yield);
+
+        if (failure) return to_error(*failure);
+
+        size_t stop = std::min(b, round_end);
+
+        if (!changed && !fault) {
+            for (size_t k = 0; k != slots.size(); ++k) {
+                // An entry past the end means the end moved
+                if (bool(slots[k]) != (a + k < stop)) { changed = true; break; }
+                if (!slots[k]) continue;
+
+                // An entry at two indices means others moved up
+                if (!seen.insert({slots[k]->proto, slots[k]->ext_port}).second) {
+                    changed = true;
+                    break;
+                }
+
+                entries.push_back(std::move(*slots[k]));
+            }
+        }
+
+        if (!changed && !fault) {
+            if (end_found) return {std::move(entries)};
+
+            if (stop > a) lasts.push_back(stop - 1);
+
+            if (round_end < limit || b == limit) {
+                end = stop;
+                end_found = true;
+            }
+            continue;
+        }
+
+        if (retries++ == opts.max_restarts) {
+            if (changed) return error::table_changed{};
+            return to_error(*fault);
+        }
+
+        // A fault may pass, so only that window is read again. Entries
+        // which moved may have done so from any index, so the scan starts
+        // over.
+        if (changed) {
+            entries.clear();
+            seen.clear();
+            lasts.clear();
+            end = limit;
+            end_found = false;
+        }
+    }
+}
+
+// Actions which may be sent again after the device could have processed
+// them. Reads are safe, and so is a delete as long as NoSuchEntryInArray
+// on the repeated one is taken as success. A repeated AddPortMapping could
+// clobber a mapping someone else made in between, so it isn't repeated.
+static bool is_idempotent(soap::action action)
+{
+    return action == soap::action::delete_port_mapping
+        || action == soap::action::get_external_ip_address
+        || action == soap::action::get_generic_port_mapping_entry
+        || action == soap::action::get_list_of_port_mappings;
+}
+
+// Whether repeating a request which failed with `e` may succeed. A failed
+// connect never reached the device, while a lost request or response may
+// have been processed.
+static bool is_transient(const igd::error::soap_request& e, soap::action action)
+{
+    using err = igd::error;
+    if (boost::get<err::tcp_connect>(&e.inner)) return true;
+    if (boost::get<err::http_request>(&e.inner)
+     || boost::get<err::http_response>(&e.inner)) {
+        return is_idempotent(action);
+    }
+    return false;
+}
+
+// Waits before the retry number `n` (from 0) as `policy` says. Returns
+// false if cancelled.
+static bool backoff( const net::any_io_executor& exec
+                   , const igd::request_policy& policy
+                   , unsigned n
+                   , cancel_t& cancel
+                   , net::yield_context yield)
+{
+    if (cancel) return false;
+
+    thread_local std::minstd_rand rng(std::random_device{}());
+
+    auto d = policy.backoff;
+    for (unsigned i = 0; i < n && d < policy.max_backoff; ++i) d *= 2;
+    d = std::min(d, policy.max_backoff);
+
+    std::uniform_int_distribution<std::chrono::milliseconds::rep>
+        dist(d.count() / 2, d.count());
+
+    net::steady_timer timer(exec);
+    timer.expires_after(std::chrono::milliseconds(dist(rng)));
+
+    auto cancelled = cancel.connect([&] { timer.cancel(); });
+
+    error_code ec;
+    timer.async_wait(yield[ec]);
+
+    return !cancelled;
+}
+
 result<igd::soap_response, igd::error::soap_request>
-igd::soap_request( string_view command
-                 , string_view message
+igd::soap_request( soap::action action
+                 , string_view args
+                 , soap::field_collector* fields
                  , net::yield_context yield) noexcept
+{
+    // Whether the device may have processed an earlier copy of the request
+    bool resent = false;
+
+    auto rs = send_soap_request(action, args, fields, resent, yield);
+
+    for (unsigned retry = 0; !rs && retry < _policy.retries; ++retry) {
+        if (!is_transient(rs.error(), action)) break;
+        if (!backoff(_exec, _policy, retry, _cancel, yield)) break;
+        if (!boost::get<error::tcp_connect>(&rs.error().inner)) resent = true;
+        rs = send_soap_request(action, args, fields, resent, yield);
+    }
+
+    if (!_verified) verify_cached(rs);
+
+    // The mapping went away with the request whose response was lost
+    if (!rs && resent && action == soap::action::delete_port_mapping) {
+        error::upnp_fault* f = boost::get<error::upnp_fault>(&rs.error().inner);
+        if (f && f->code == 714) return soap_response{beast::http::status::ok, 11};
+    }
+
+    return rs;
+}
+
+void igd::verify_cached(const result<soap_response, error::soap_request>& rs)
+{
+    _verified = true;
+
+    if (rs) return;
+
+    // UPnP reports failed actions as SOAP faults with status 500, the
+    // device is still there in that case.
+    if (boost::get<error::upnp_fault>(&rs.error().inner)) return;
+    auto status = boost::get<error::http_status>(&rs.error().inner);
+    if (status && status->status == beast::http::status::internal_server_error) {
+        return;
+    }
+
+    if (auto cache = _cache.lock()) cache->erase_uuid(_uuid);
+}
+
+// Reads the response header into `rs` and feeds the body to `fields` until
+// they have what they need, or to `fault` if the action failed. If that
+// happens before the end of the body, `complete` is set to false.
+static error_code read_fields( beast::tcp_stream& stream
+                             , beast::flat_buffer& b
+                             , beast::http::response_header<>& rs
+                             , soap::field_collector& fields
+                             , soap::field_collector& fault
+                             , bool& complete
+                             , net::yield_context yield)
+{
+    namespace http = beast::http;
+
+    http::response_parser<http::buffer_body> p;
+
+    error_code ec;
+    http::async_read_header(stream, b, p, yield[ec]);
+    if (ec) return ec;
+
+    auto& sink = p.get().result() == http::status::ok ? fields : fault;
+
+    char buf[2048];
+
+    while (!p.is_done() && !sink.finished()) {
+        p.get().body().data = buf;
+        p.get().body().size = sizeof(buf);
+
+        http::async_read(stream, b, p, yield[ec]);
+        if (ec == http::error::need_buffer) ec = {};
+        if (ec) return ec;
+
+        sink.feed(string_view(buf, sizeof(buf) - p.get().body().size));
+    }
+
+    if (p.is_done()) sink.end();
+
+    complete = p.is_done();
+    rs = p.get().base();
+    return ec;
+}
+
+result<igd::soap_response, igd::error::soap_request>
+igd::send_soap_request( soap::action action
+                      , string_view args
+                      , soap::field_collector* fields
+                      , bool& resent
+                      , net::yield_context yield) noexcept
 {
     namespace http = beast::http;
     using E = error::soap_request;
@@ -246,69 +783,253 @@ igd::soap_request( string_view command
     if (!opt_remote_ep)
         return E{error::igd_host_parse_failed{_url}};
 
-    std::string body =
-        "<?xml version=\"1.0\"?>"
-        "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
-                    "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
-        "<s:Body>" + message.to_string() + "</s:Body>"
-        "</s:Envelope>";
+    // Only the Content-Length header and the arguments vary between
+    // requests, the rest is written straight from the envelope.
+    soap::envelope::scratch scratch;
+    auto rq = _envelope->request(action, args, bool(_pool), scratch);
 
-    http::request<http::string_body> rq{http::verb::post, _url.path(), 11};
-    rq.set(http::field::host, _url.host_and_port());
-    rq.set(http::field::user_agent, CPP_UPNP_HTTP_USER_AGENT);
-    rq.set(http::field::content_type, "text/xml; charset=\"utf-8\"");
-    rq.set(http::field::connection, "Close");
-    rq.set(http::field::cache_control, "no-cache");
-    rq.set(http::field::pragma, "no-cache");
-    rq.set("SOAPAction", "\"" + _urn + "#" + command.to_string() + "\"");
+    // Stays alive even if keep-alive is disabled while we're suspended
+    auto pool = _pool;
+    bool retried = false;
 
-    rq.body() = std::move(body);
-    rq.prepare_payload();
+    while (true) {
+        error_code ec;
 
-    //std::cerr << rq;
+        auto idle = pool ? pool->take(*opt_remote_ep)
+                         : optional<beast::tcp_stream>();
+        bool reused = bool(idle);
 
-    error_code ec;
+        beast::tcp_stream stream = reused ? std::move(*idle)
+                                          : beast::tcp_stream(_exec);
 
-    beast::tcp_stream stream(_exec);
-    stream.expires_after(std::chrono::seconds(5));
+        auto cancelled = _cancel.connect([&] { stream.close(); });
 
-    auto cancelled = _cancel.connect([&] { stream.close(); });
+        // The route to the device may have changed, so the local address
+        // is looked up again for the next mapping.
+        auto unreachable = [&] (E e) {
+            _local_address = boost::none;
+            return e;
+        };
 
-    stream.async_connect(*opt_remote_ep, yield[ec]);
-    if (ec) return E{error::tcp_connect{}};
+        if (!reused) {
+            stream.expires_after(_policy.connect_timeout);
+            stream.async_connect(*opt_remote_ep, yield[ec]);
+            if (ec) return unreachable(E{error::tcp_connect{}});
 
-    http::async_write(stream, rq, yield[ec]);
-    if (ec) return E{error::http_request{}};
+            // The address the device sees us at
+            auto local = stream.socket().local_endpoint(ec);
+            if (!ec) _local_address = local.address();
+        }
 
-    beast::flat_buffer b;
-    soap_response rs;
+        // The device may have closed a reused connection just before our
+        // request reached it, in which case it wasn't processed.
+        auto may_retry = [&] {
+            return reused && !retried && !cancelled;
+        };
+
+        stream.expires_after(_policy.write_timeout);
+        net::async_write(stream, rq, yield[ec]);
+        if (ec) {
+            if (may_retry()) { retried = true; continue; }
+            return unreachable(E{error::http_request{}});
+        }
 
-    http::async_read(stream, b, rs, yield[ec]);
-    if (ec) return E{error::http_response{}};
+        beast::flat_buffer b;
+        soap_response rs;
+        // Whether all of the response was read and the connection can
+        // take another request.
+        bool complete = true;
 
-    if (rs.result() != beast::http::status::ok) {
-        return E{error::http_status{rs.result()}};
-    }
+        error::upnp_fault fault_value;
+        soap::decoder<decltype(upnp_error_schema)> fault_decoder(upnp_error_schema, fault_value);
+        soap::field_collector fault(upnp_error_schema.element(), fault_decoder);
 
-    return {std::move(rs)};
+        stream.expires_after(_policy.read_timeout);
+        if (fields) {
+            fields->reset();
+            ec = read_fields(stream, b, rs, *fields, fault, complete, yield);
+        } else {
+            http::async_read(stream, b, rs, yield[ec]);
+            if (!ec && rs.result() != http::status::ok) {
+                fault.feed(rs.body());
+                fault.end();
+            }
+        }
+        if (ec) {
+            bool closed = ec == http::error::end_of_stream
+                       || ec == net::error::connection_reset;
+            // Though if the request got through and the connection broke
+            // afterwards, only actions which are safe to repeat can be.
+            if (closed && may_retry() && is_idempotent(action)) {
+                retried = resent = true;
+                continue;
+            }
+            return unreachable(E{error::http_response{}});
+        }
+
+        if (pool && !cancelled && complete && rs.keep_alive() && b.size() == 0) {
+            stream.expires_never();
+            pool->give_back(std::move(stream));
+        }
+
+        if (rs.result() != beast::http::status::ok) {
+            // Some devices leave out the description
+            auto e = fault_decoder.error();
+            if (rs.result() == http::status::internal_server_error
+                && (!e || (e->missing && e->name == "errorDescription"))) {
+                return E{std::move(fault_value)};
+            }
+            return E{error::http_status{rs.result()}};
+        }
+
+        return {std::move(rs)};
+    }
 }
 
 /* static */
-result<std::vector<igd>> igd::discover(net::any_io_executor exec
-                                       , const net::ip::address_v4& bind_ip
-                                       , net::yield_context yield)
+void igd::add_igds( const device& root_dev
+                  , const std::string& uuid
+                  , const url_t& location
+                  , std::set<std::string>& already_seen
+                  , net::any_io_executor exec
+                  , std::vector<igd>& igds)
 {
     using namespace std;
 
-    auto q = ssdp::query::start(exec, bind_ip, yield);
+    string v;
+
+    if (root_dev.type == "urn:schemas-upnp-org:device:InternetGatewayDevice:1") {
+        v = "1";
+    } else
+    if (root_dev.type == "urn:schemas-upnp-org:device:InternetGatewayDevice:2") {
+        v = "2";
+    } else {
+        return;
+    }
+
+    string device_urn     = "urn:schemas-upnp-org:device:WANDevice:"           + v;
+    string connection_urn = "urn:schemas-upnp-org:device:WANConnectionDevice:" + v;
+    string con_ip         = "urn:schemas-upnp-org:service:WANIPConnection:"    + v;
+    string con_ppp        = "urn:schemas-upnp-org:service:WANPPPConnection:"   + v;
+
+    for (const auto& device : root_dev.devices) {
+        // No duplicates
+        if (!already_seen.insert(device.udn).second) continue;
+
+        if (device.type != device_urn) continue;
+
+        for (const auto& connection : device.devices) {
+            if (connection.type != connection_urn) continue;
+
+            for (const auto& service : connection.services) {
+                if (service.type != con_ip && service.type != con_ppp)continue;
+
+                url_t url = location;
+                url.replace_path(service.control_url.path());
+
+                igds.push_back({
+                    uuid,
+                    device,
+                    service.id,
+                    url,
+                    service.type,
+                    exec
+                });
+            }
+        }
+    }
+}
+
+/* static */
+result<void> igd::discover( net::any_io_executor exec
+                          , const discover_options& opts
+                          , std::function<bool(igd)> on_igd
+                          , net::yield_context yield)
+{
+    ssdp::query::options query_opts = opts.query;
+
+    query_opts.interfaces    = opts.interfaces;
+    query_opts.interfaces_v6 = opts.interfaces_v6;
+
+    if (query_opts.interfaces.empty() && query_opts.interfaces_v6.empty()) {
+        query_opts.interfaces    = local_ipv4_interfaces(exec);
+        query_opts.interfaces_v6 = local_ipv6_interfaces();
+    }
+    if (query_opts.interfaces.empty() && query_opts.interfaces_v6.empty()) {
+        query_opts.interfaces.push_back(net::ip::address_v4::any());
+    }
+
+    query_opts.unicast_targets = opts.unicast_targets;
+
+    if (opts.search_default_gateway && !query_opts.interfaces.empty()) {
+        for (auto& gw : default_ipv4_gateways()) {
+            query_opts.unicast_targets.emplace_back(gw, 1900);
+        }
+    }
+
+    query_opts.unicast_linger = boost::none;
+
+    if (!query_opts.unicast_targets.empty()) {
+        query_opts.unicast_linger = opts.gateway_linger;
+    }
+
+    const auto& history = opts.history;
+
+    if (history) {
+        auto window = history->begin_round();
+        query_opts.mx      = window.mx;
+        query_opts.timeout = window.timeout;
+    }
+
+    auto q = ssdp::query::start(exec, query_opts, yield);
     if (!q) return q.error();
     auto& query = q.value();
 
+    const size_t max_fetches = std::max<size_t>(1, opts.max_concurrent_fetches);
+    const auto& cache = opts.cache;
+
+    ConditionVariable fetch_cv(exec);
+    size_t fetches_in_flight = 0;
+    bool fetch_failed = false;
+    cancel_t cancel_fetches;
+
+    // Multiple search targets usually resolve to the same description, so
+    // don't fetch the same location twice.
+    std::set<std::string> already_fetched;
     std::set<std::string> already_seen;
-    std::vector<igd> igds;
+    size_t found = 0;
+    bool done = false;
+
+    auto deliver = [&] (std::vector<igd>& igds, bool from_cache) {
+        for (auto& igd : igds) {
+            if (done) return;
+            if (from_cache) {
+                igd._cache = cache;
+                igd._verified = false;
+            }
+            igd._policy = opts.policy;
+            if (opts.keep_alive) igd.enable_keep_alive(*opts.keep_alive);
+            ++found;
+            if (!on_igd(std::move(igd))) {
+                done = true;
+                query.stop();
+                cancel_fetches();
+            }
+        }
+    };
 
-    while (true) {
+    auto wait_for_fetches = [&] (size_t max_in_flight) {
+        while (fetches_in_flight > max_in_flight) {
+            error_code ec;
+            fetch_cv.wait(yield[ec]);
+        }
+    };
+
+    error_code query_ec;
+
+    while (!done) {
         auto qr = query.get_response(yield);
+        if (done) break;
         if (!qr) {
             // For now, ignore responses which we failed to parse
             if (qr.error().is_parse_error()) continue;
@@ -316,116 +1037,222 @@ result<std::vector<igd>> igd::discover(net::any_io_executor exec
             auto ecp = qr.error().as_error_code();
             assert(ecp && "Should be either parse error or error_code");
 
-            if (*ecp == net::error::timed_out && !igds.empty()) {
-                break;
-            }
-
-            return *ecp;
+            query_ec = *ecp;
+            break;
         }
         auto& rsp = qr.value();
 
-        auto res_root_dev = query_root_device(exec, rsp.location, yield);
-        if (!res_root_dev) return sys::errc::io_error;
-        auto& root_dev = res_root_dev.value();
-
-        string v;
+        if (history) history->record(rsp.usn, rsp.latency);
 
-        if (root_dev.type == "urn:schemas-upnp-org:device:InternetGatewayDevice:1") {
-            v = "1";
-        } else
-        if (root_dev.type == "urn:schemas-upnp-org:device:InternetGatewayDevice:2") {
-            v = "2";
-        } else {
-            continue;
+        if (cache) {
+            if (auto e = cache->find(rsp.usn, rsp.location)) {
+                std::vector<igd> igds;
+                add_igds( e->root_device, rsp.uuid, rsp.location
+                        , already_seen, exec, igds);
+                deliver(igds, true);
+                continue;
+            }
         }
 
-        string device_urn     = "urn:schemas-upnp-org:device:WANDevice:"           + v;
-        string connection_urn = "urn:schemas-upnp-org:device:WANConnectionDevice:" + v;
-        string con_ip         = "urn:schemas-upnp-org:service:WANIPConnection:"    + v;
-        string con_ppp        = "urn:schemas-upnp-org:service:WANPPPConnection:"   + v;
+        auto location = string_view(rsp.location).to_string();
+        if (!already_fetched.insert(std::move(location)).second) continue;
+
+        wait_for_fetches(max_fetches - 1);
+        if (done) break;
+        ++fetches_in_flight;
+
+        net::spawn(exec, [&, rsp = std::move(rsp)] (net::yield_context y) {
+            auto res_xml = fetch_description( exec, rsp.location, opts.policy
+                                          , cancel_fetches, y);
+
+            optional<device> parsed;
+            const device* root_dev = nullptr;
+
+            if (res_xml && cache) {
+                auto e = cache->insert( rsp.usn
+                                      , rsp.uuid
+                                      , rsp.location
+                                      , rsp.max_age
+                                      , std::move(res_xml.value()));
+                if (e) root_dev = &e->root_device;
+            } else if (res_xml) {
+                parsed = device_parse_root(res_xml.value());
+                if (parsed) root_dev = &*parsed;
+            }
 
-        for (const auto& device : root_dev.devices) {
-            // No duplicates
-            if (!already_seen.insert(device.udn).second) continue;
+            if (root_dev) {
+                std::vector<igd> igds;
+                add_igds( *root_dev, rsp.uuid, rsp.location
+                        , already_seen, exec, igds);
+                deliver(igds, false);
+            } else if (!done) {
+                fetch_failed = true;
+            }
 
-            if (device.type != device_urn) continue;
+            --fetches_in_flight;
+            fetch_cv.notify();
+        });
+    }
 
-            for (const auto& connection : device.devices) {
-                if (connection.type != connection_urn) continue;
+    wait_for_fetches(0);
 
-                for (const auto& service : connection.services) {
-                    if (service.type != con_ip && service.type != con_ppp)continue;
+    if (done) return success();
 
-                    url_t url = rsp.location;
-                    url.replace_path(service.control_url.path());
+    if (history && query_ec == net::error::timed_out) history->end_round();
 
-                    igds.push_back({
-                        rsp.uuid,
-                        device,
-                        service.id,
-                        url,
-                        service.type,
-                        exec
-                    });
-                }
-            }
-        }
+    if (found) {
+        if (query_ec == net::error::timed_out) return success();
+        return query_ec;
     }
 
+    if (fetch_failed) return sys::errc::io_error;
+    return query_ec;
+}
+
+/* static */
+result<std::vector<igd>> igd::discover( net::any_io_executor exec
+                                      , const discover_options& opts
+                                      , net::yield_context yield)
+{
+    std::vector<igd> igds;
+
+    auto r = discover(exec, opts, [&] (igd igd) {
+        igds.push_back(std::move(igd));
+        return true;
+    }, yield);
+
+    if (!r) return r.error();
     return {std::move(igds)};
 }
 
+/* static */
+result<igd> igd::discover_first( net::any_io_executor exec
+                               , const discover_options& opts
+                               , net::yield_context yield)
+{
+    optional<igd> first;
+
+    auto r = discover(exec, opts, [&] (igd igd) {
+        first = std::move(igd);
+        return false;
+    }, yield);
+
+    if (!r) return r.error();
+    assert(first);
+    return {std::move(*first)};
+}
+
+/* static */
+result<std::vector<igd>> igd::discover( net::any_io_executor exec
+                                      , const net::ip::address_v4& bind_ip
+                                      , net::yield_context yield)
+{
+    discover_options opts;
+    opts.interfaces.push_back(bind_ip);
+    return discover(exec, opts, yield);
+}
+
+/* static */
+std::vector<igd> igd::from_cache( net::any_io_executor exec
+                                , std::shared_ptr<description_cache> cache)
+{
+    std::vector<igd> igds;
+    if (!cache) return igds;
+
+    std::set<std::string> already_seen;
+
+    for (auto e : cache->entries()) {
+        auto n = igds.size();
+        add_igds(e->root_device, e->uuid, e->location, already_seen, exec, igds);
+        for (auto i = n; i < igds.size(); ++i) {
+            igds[i]._cache = cache;
+            igds[i]._verified = false;
+        }
+    }
+
+    return igds;
+}
+
 result<std::vector<igd>> igd::discover(net::any_io_executor exec, net::yield_context yield)
 {
     return std::move(discover(exec, net::ip::address_v4::any(), yield));
 }
 
 /* static */
-result<device>
-igd::query_root_device( net::any_io_executor exec
+result<std::string>
+igd::fetch_description( net::any_io_executor exec
                       , const url_t& url
+                      , const request_policy& policy
+                      , cancel_t& cancel
                       , net::yield_context yield) noexcept
 {
     namespace http = beast::http;
     using request  = http::request<http::empty_body>;
     using response = http::response<http::string_body>;
 
-    error_code ec;
-    net::ip::tcp::resolver resolver(exec);
-
     auto hp = url.host_and_port();
     auto ep = str::consume_endpoint<net::ip::tcp>(hp);
 
     if (!ep) return sys::errc::invalid_argument;
 
-    beast::tcp_stream stream(exec);
-    stream.expires_after(std::chrono::seconds(5));
-
-    stream.async_connect(*ep, yield[ec]);
-    if (ec) return ec;
-
     request rq{http::verb::get, url.path(), 11};
 
-    rq.set(http::field::host, url.host_and_port());
+    rq.set(http::field::host, url.host_header());
     rq.set(http::field::user_agent, CPP_UPNP_HTTP_USER_AGENT);
 
-    http::async_write(stream, rq, yield[ec]);
-    if (ec) return ec;
+    for (unsigned retry = 0;; ++retry) {
+        if (cancel) return net::error::operation_aborted;
 
-    beast::flat_buffer b;
-    response rs;
+        error_code ec;
 
-    http::async_read(stream, b, rs, yield[ec]);
-    if (ec) return ec;
+        beast::tcp_stream stream(exec);
+
+        auto cancelled = cancel.connect([&] { stream.close(); });
+
+        stream.expires_after(policy.connect_timeout);
+        stream.async_connect(*ep, yield[ec]);
+
+        if (!ec) {
+            stream.expires_after(policy.write_timeout);
+            http::async_write(stream, rq, yield[ec]);
+        }
+
+        beast::flat_buffer b;
+        response rs;
+
+        if (!ec) {
+            stream.expires_after(policy.read_timeout);
+            http::async_read(stream, b, rs, yield[ec]);
+        }
+
+        if (ec) {
+            if (cancelled || retry >= policy.retries) return ec;
+            if (!backoff(exec, policy, retry, cancel, yield)) return ec;
+            continue;
+        }
+
+        if (rs.result() != beast::http::status::ok) {
+            return sys::errc::protocol_error;
+        }
 
-    if (rs.result() != beast::http::status::ok) {
-        return sys::errc::protocol_error;
+        return {std::move(rs.body())};
     }
+}
+
+void igd::enable_keep_alive()
+{
+    enable_keep_alive(keep_alive_options());
+}
 
-    auto opt_root_dev = device_parse_root(rs.body());
-    if (!opt_root_dev) return sys::errc::io_error;
+void igd::enable_keep_alive(keep_alive_options opts)
+{
+    _pool = std::make_shared<connection_pool>( opts.max_idle_connections
+                                             , opts.idle_timeout);
+}
 
-    return {std::move(*opt_root_dev)};
+void igd::disable_keep_alive()
+{
+    _pool = nullptr;
 }
 
 void igd::stop() {
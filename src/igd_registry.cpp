@@ -0,0 +1,274 @@
+#include <upnp/igd_registry.h>
+#include <upnp/ssdp.h>
+#include "local_interfaces.h"
+#include "parse_device.h"
+#include <algorithm>
+#include <map>
+
+namespace upnp {
+
+using clock = std::chrono::steady_clock;
+
+struct igd_registry::state_t : std::enable_shared_from_this<state_t> {
+    struct entry {
+        url_t location;
+        clock::time_point expires;
+        // Unset while the description is being fetched
+        optional<device> root_device;
+        // Results of fetches started before the latest one are ignored
+        size_t fetch_id = 0;
+    };
+
+    net::any_io_executor _exec;
+    options _options;
+    optional<ssdp::listener> _listener;
+    optional<ssdp::query> _query;
+    // Keyed by the uuid of the root device
+    std::map<std::string, entry> _entries;
+    size_t _next_fetch_id = 0;
+    bool _stopped = false;
+    cancel_t _cancel;
+
+    state_t(net::any_io_executor exec, options opts)
+        : _exec(std::move(exec))
+        , _options(std::move(opts))
+    {}
+
+    void on_alive( const std::string& uuid
+                 , const std::string& nt
+                 , const std::string& usn
+                 , const url_t& location
+                 , optional<std::chrono::seconds> max_age
+                 , bool changed);
+
+    void on_notify(const ssdp::notify&);
+    void on_response(const ssdp::query::response&);
+
+    void fetch( const std::string& uuid
+              , const std::string& usn
+              , optional<std::chrono::seconds> max_age
+              , entry&);
+
+    void prune();
+    void stop();
+};
+
+static bool is_igd(string_view nt)
+{
+    return nt.starts_with("urn:schemas-upnp-org:device:InternetGatewayDevice:");
+}
+
+void igd_registry::state_t::on_alive( const std::string& uuid
+                                    , const std::string& nt
+                                    , const std::string& usn
+                                    , const url_t& location
+                                    , optional<std::chrono::seconds> max_age
+                                    , bool changed)
+{
+    prune();
+
+    auto expires = clock::now() + (max_age ? *max_age : _options.default_max_age);
+
+    auto i = _entries.find(uuid);
+
+    if (i == _entries.end()) {
+        // Devices announce their embedded devices and services too, only
+        // start tracking once the root device says it is an IGD.
+        if (!is_igd(nt)) return;
+
+        auto& e = _entries[uuid];
+        e.location = location;
+        e.expires  = expires;
+        fetch(uuid, usn, max_age, e);
+        return;
+    }
+
+    auto& e = i->second;
+    e.expires = std::max(e.expires, expires);
+
+    if (changed || string_view(e.location) != string_view(location)) {
+        e.location = location;
+        fetch(uuid, usn, max_age, e);
+    }
+}
+
+void igd_registry::state_t::on_notify(const ssdp::notify& n)
+{
+    if (n.sub_type == ssdp::notify::byebye) {
+        _entries.erase(n.uuid);
+        return;
+    }
+
+    // ssdp:update means the description may have changed
+    on_alive( n.uuid
+            , n.notification_type
+            , n.usn
+            , n.location
+            , n.max_age
+            , n.sub_type == ssdp::notify::update);
+}
+
+void igd_registry::state_t::on_response(const ssdp::query::response& r)
+{
+    on_alive(r.uuid, r.service_type, r.usn, r.location, r.max_age, false);
+}
+
+void igd_registry::state_t::fetch( const std::string& uuid
+                                 , const std::string& usn
+                                 , optional<std::chrono::seconds> max_age
+                                 , entry& e)
+{
+    auto& cache = _options.cache;
+
+    e.fetch_id = ++_next_fetch_id;
+
+    if (cache) {
+        if (auto ce = cache->find(usn, e.location)) {
+            e.root_device = ce->root_device;
+            return;
+        }
+    }
+
+    net::spawn(_exec, [ self = shared_from_this()
+                      , uuid
+                      , usn
+                      , max_age
+                      , location = e.location
+                      , fetch_id = e.fetch_id
+                      ] (net::yield_context yield) {
+        auto xml = igd::fetch_description( self->_exec, location
+                                         , self->_options.policy
+                                         , self->_cancel, yield);
+
+        if (self->_stopped) return;
+
+        auto i = self->_entries.find(uuid);
+        if (i == self->_entries.end() || i->second.fetch_id != fetch_id) return;
+
+        optional<device> root_dev;
+
+        if (xml && self->_options.cache) {
+            auto ce = self->_options.cache->insert
+                (usn, uuid, location, max_age, std::move(xml.value()));
+            if (ce) root_dev = ce->root_device;
+        } else if (xml) {
+            root_dev = device_parse_root(xml.value());
+        }
+
+        // Forget the device, the next announcement will retry.
+        if (!root_dev) {
+            self->_entries.erase(i);
+            return;
+        }
+
+        i->second.root_device = std::move(root_dev);
+    });
+}
+
+void igd_registry::state_t::prune()
+{
+    auto now = clock::now();
+
+    for (auto i = _entries.begin(); i != _entries.end();) {
+        if (i->second.expires <= now) i = _entries.erase(i);
+        else ++i;
+    }
+}
+
+void igd_registry::state_t::stop()
+{
+    _stopped = true;
+    _cancel();
+    if (_listener) _listener->stop();
+    if (_query) _query->stop();
+}
+
+igd_registry::igd_registry(std::shared_ptr<state_t> state)
+    : _state(std::move(state))
+{}
+
+/* static */
+result<igd_registry> igd_registry::start(net::any_io_executor exec, options opts)
+{
+    auto interfaces = opts.interfaces;
+    if (interfaces.empty()) interfaces = local_ipv4_interfaces(exec);
+
+    auto l = ssdp::listener::start(exec, interfaces);
+    if (!l) return l.error();
+
+    if (interfaces.empty()) interfaces.push_back(net::ip::address_v4::any());
+
+    auto st = std::make_shared<state_t>(exec, std::move(opts));
+    st->_listener = std::move(l.value());
+
+    net::spawn(exec, [st] (net::yield_context yield) {
+        while (!st->_stopped) {
+            auto n = st->_listener->next(yield);
+            if (!n) break;
+            st->on_notify(n.value());
+        }
+    });
+
+    if (st->_options.initial_search) {
+        net::spawn(exec, [st, interfaces] (net::yield_context yield) {
+            auto q = ssdp::query::start(st->_exec, interfaces, yield);
+            if (!q || st->_stopped) return;
+            st->_query = std::move(q.value());
+
+            while (!st->_stopped) {
+                auto r = st->_query->get_response(yield);
+                if (!r) {
+                    if (r.error().is_parse_error()) continue;
+                    break;
+                }
+                st->on_response(r.value());
+            }
+
+            if (!st->_stopped) st->_query = none;
+        });
+    }
+
+    return igd_registry{std::move(st)};
+}
+
+std::vector<igd> igd_registry::igds() const
+{
+    std::vector<igd> ret;
+    std::set<std::string> already_seen;
+
+    auto now = clock::now();
+
+    for (auto& p : _state->_entries) {
+        auto& e = p.second;
+        if (e.expires <= now || !e.root_device) continue;
+        auto n = ret.size();
+        igd::add_igds( *e.root_device, p.first, e.location
+                     , already_seen, _state->_exec, ret);
+        for (auto i = n; i < ret.size(); ++i) {
+            ret[i]._policy = _state->_options.policy;
+        }
+    }
+
+    return ret;
+}
+
+size_t igd_registry::size() const
+{
+    auto now = clock::now();
+
+    return std::count_if(_state->_entries.begin(), _state->_entries.end(),
+        [&] (auto& p) { return p.second.expires > now; });
+}
+
+void igd_registry::stop()
+{
+    _state->stop();
+    _state = nullptr;
+}
+
+igd_registry::~igd_registry()
+{
+    if (_state) stop();
+}
+
+} // namespace upnp
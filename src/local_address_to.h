@@ -1,22 +1,29 @@
 #pragma once
 
 #include <boost/asio/ip/address.hpp>
+#include <boost/asio/ip/udp.hpp>
 #include <boost/optional.hpp>
 #include <upnp/third_party/error_code.h>
 #include <upnp/third_party/net.h>
 
 namespace upnp {
 
+// The local address the OS would use to reach `ep`. Connecting a UDP socket
+// only looks up the route, nothing is sent and nothing blocks.
 template<class Proto /* net::ip::{tcp,udp} */>
 inline
-boost::optional<net::ip::address> local_address_to(net::ip::basic_endpoint<Proto> ep) {
-    net::io_context ctx;
-    auto ipv = ep.address().is_v4() ? Proto::v4() : Proto::v6();
-    typename Proto::socket s(ctx, ipv);
+boost::optional<net::ip::address>
+local_address_to(net::any_io_executor exec, net::ip::basic_endpoint<Proto> ep) {
+    using udp = net::ip::udp;
+    udp::socket s(exec);
     error_code ec;
-    s.connect(ep, ec);
+    s.open(ep.address().is_v4() ? udp::v4() : udp::v6(), ec);
     if (ec) return boost::none;
-    return s.local_endpoint().address();
+    s.connect(udp::endpoint(ep.address(), ep.port()), ec);
+    if (ec) return boost::none;
+    auto local = s.local_endpoint(ec);
+    if (ec) return boost::none;
+    return local.address();
 }
 
 } // namespace
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <boost/asio/ip/address_v4.hpp>
+#include <boost/asio/ip/address_v6.hpp>
+#include <boost/asio/ip/udp.hpp>
+#include <upnp/third_party/net.h>
+#include <algorithm>
+#include <vector>
+
+#include "local_address_to.h"
+
+#if defined(__linux__)
+#  include <ifaddrs.h>
+#  include <net/if.h>
+#  include <netinet/in.h>
+#endif
+
+namespace upnp {
+
+// Addresses of the local IPv4 interfaces which are up, are not loopback and
+// support multicast. Where interfaces can't be listed, it's just the one
+// the OS routes SSDP multicast through.
+inline
+std::vector<net::ip::address_v4> local_ipv4_interfaces(net::any_io_executor exec) {
+    std::vector<net::ip::address_v4> ret;
+
+#if defined(__linux__)
+    (void) exec;
+
+    ifaddrs* ifs = nullptr;
+    if (getifaddrs(&ifs) != 0) return ret;
+
+    for (auto i = ifs; i; i = i->ifa_next) {
+        if (!i->ifa_addr || i->ifa_addr->sa_family != AF_INET) continue;
+        if (!(i->ifa_flags & IFF_UP))       continue;
+        if (!(i->ifa_flags & IFF_MULTICAST)) continue;
+        if (i->ifa_flags & IFF_LOOPBACK)    continue;
+
+        auto sin = reinterpret_cast<const sockaddr_in*>(i->ifa_addr);
+        net::ip::address_v4 addr(ntohl(sin->sin_addr.s_addr));
+
+        if (std::find(ret.begin(), ret.end(), addr) == ret.end()) {
+            ret.push_back(addr);
+        }
+    }
+
+    freeifaddrs(ifs);
+#else
+    net::ip::udp::endpoint ssdp(net::ip::make_address_v4("239.255.255.250"), 1900);
+
+    auto addr = local_address_to(exec, ssdp);
+    if (addr && addr->is_v4() && !addr->is_loopback() && !addr->is_unspecified()) {
+        ret.push_back(addr->to_v4());
+    }
+#endif
+
+    return ret;
+}
+
+// Link-local addresses of the local IPv6 interfaces which are up, are not
+// loopback and support multicast, one per interface. The scope id of each
+// is the interface index. Empty where interfaces can't be listed.
+inline
+std::vector<net::ip::address_v6> local_ipv6_interfaces() {
+    std::vector<net::ip::address_v6> ret;
+
+#if defined(__linux__)
+    ifaddrs* ifs = nullptr;
+    if (getifaddrs(&ifs) != 0) return ret;
+
+    for (auto i = ifs; i; i = i->ifa_next) {
+        if (!i->ifa_addr || i->ifa_addr->sa_family != AF_INET6) continue;
+        if (!(i->ifa_flags & IFF_UP))       continue;
+        if (!(i->ifa_flags & IFF_MULTICAST)) continue;
+        if (i->ifa_flags & IFF_LOOPBACK)    continue;
+
+        auto sin6 = reinterpret_cast<const sockaddr_in6*>(i->ifa_addr);
+
+        net::ip::address_v6::bytes_type bytes;
+        std::copy( sin6->sin6_addr.s6_addr
+                 , sin6->sin6_addr.s6_addr + bytes.size()
+                 , bytes.begin());
+
+        net::ip::address_v6 addr(bytes, if_nametoindex(i->ifa_name));
+
+        if (!addr.is_link_local() || addr.scope_id() == 0) continue;
+
+        auto same_if = [&] (auto& a) { return a.scope_id() == addr.scope_id(); };
+
+        if (std::find_if(ret.begin(), ret.end(), same_if) == ret.end()) {
+            ret.push_back(addr);
+        }
+    }
+
+    freeifaddrs(ifs);
+#endif
+
+    return ret;
+}
+
+} // namespace upnp
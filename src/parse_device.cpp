@@ -1,76 +1,84 @@
 #include "parse_device.h"
+#include "xml.h"
 
 namespace upnp {
 
-optional<service> service_parse(const xml::tree& tree) {
+// The reader is at the start of a <service> element, which is read up to
+// and including its end.
+static optional<service> service_parse(xml::reader& r) {
+    bool has_id = false, has_type = false, has_url = false;
     service ret;
 
-    auto opt_id = tree.get_optional<std::string>("serviceId");
-    if (!opt_id) return none;
-    ret.id = std::move(*opt_id);
-
-    auto opt_type = tree.get_optional<std::string>("serviceType");
-    if (!opt_type) return none;
-    ret.type = std::move(*opt_type);
+    int depth = r.depth();
+
+    while (r.next_child(depth)) {
+        auto name = r.local_name();
+
+        if (name == "serviceId") {
+            auto t = r.read_text();
+            if (t) { ret.id = t->to_string(); has_id = true; }
+        } else if (name == "serviceType") {
+            auto t = r.read_text();
+            if (t) { ret.type = t->to_string(); has_type = true; }
+        } else if (name == "controlURL") {
+            auto t = r.read_text();
+            auto url = t ? url_t::parse(t->to_string()) : none;
+            if (url) { ret.control_url = std::move(*url); has_url = true; }
+        }
+    }
 
-    auto opt_url_s = tree.get_optional<std::string>("controlURL");
-    if (!opt_url_s) return none;
-    auto opt_url = url_t::parse(*opt_url_s);
-    if (!opt_url) return none;
-    ret.control_url = std::move(*opt_url);
+    if (r.failed() || !has_id || !has_type || !has_url) return none;
 
     return ret;
 }
 
-optional<device> device_parse_root(const std::string& xml_str) {
-    auto tree = xml::parse(xml_str);
-    if (!tree) return none;
-    return device_parse_root(*tree);
-}
-
-optional<device> device_parse_root(const xml::tree& tree) {
+// Likewise for a <device> element.
+static optional<device> device_parse(xml::reader& r) {
+    bool has_type = false, has_udn = false, has_name = false;
     device ret;
-    auto opt_dev = tree.get_child_optional("root.device");
-    if (!opt_dev) return none;
-    return device_parse(*opt_dev);
-}
-
-optional<device> device_parse(const xml::tree& tree) {
-    device ret;
-
-    auto opt_type = tree.get_optional<std::string>("deviceType");
-    if (!opt_type) return none;
-    ret.type = std::move(*opt_type);
 
-    auto opt_udn = tree.get_optional<std::string>("UDN");
-    if (!opt_udn) return none;
-    ret.udn = std::move(*opt_udn);
-
-    auto opt_name = tree.get_optional<std::string>("friendlyName");
-    if (!opt_name) return none;
-    ret.friendly_name = std::move(*opt_name);
-
-    auto opt_services = tree.get_child_optional("serviceList");
-
-    if (opt_services) {
-        for (auto& v : *opt_services) {
-            auto opt = service_parse(v.second);
-            if (!opt) continue;
-            ret.services.push_back(std::move(*opt));
+    int depth = r.depth();
+
+    while (r.next_child(depth)) {
+        auto name = r.local_name();
+
+        if (name == "deviceType") {
+            auto t = r.read_text();
+            if (t) { ret.type = t->to_string(); has_type = true; }
+        } else if (name == "UDN") {
+            auto t = r.read_text();
+            if (t) { ret.udn = t->to_string(); has_udn = true; }
+        } else if (name == "friendlyName") {
+            auto t = r.read_text();
+            if (t) { ret.friendly_name = t->to_string(); has_name = true; }
+        } else if (name == "serviceList") {
+            int list_depth = r.depth();
+            while (r.next_child(list_depth)) {
+                if (r.local_name() != "service") continue;
+                auto opt = service_parse(r);
+                if (!opt) continue;
+                ret.services.push_back(std::move(*opt));
+            }
+        } else if (name == "deviceList") {
+            int list_depth = r.depth();
+            while (r.next_child(list_depth)) {
+                if (r.local_name() != "device") continue;
+                auto opt = device_parse(r);
+                if (!opt) continue;
+                ret.devices.push_back(std::move(*opt));
+            }
         }
     }
 
-    auto opt_devices = tree.get_child_optional("deviceList");
-
-    if (opt_devices) {
-        for (auto& v : *opt_devices) {
-            auto opt = device_parse(v.second);
-            if (!opt) continue;
-            ret.devices.push_back(std::move(*opt));
-        }
-    }
+    if (r.failed() || !has_type || !has_udn || !has_name) return none;
 
     return ret;
 }
 
+optional<device> device_parse_root(string_view xml_str) {
+    xml::reader r(xml_str);
+    if (!xml::find(r, "*:root.*:device")) return none;
+    return device_parse(r);
+}
+
 } // namespace upnp
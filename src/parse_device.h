@@ -1,12 +1,9 @@
 #include <upnp/device.h>
-#include "xml.h"
+#include <upnp/third_party/optional.h>
+#include <upnp/third_party/string_view.h>
 
 namespace upnp {
 
-optional<service> service_parse(const xml::tree& tree);
-
-optional<device> device_parse_root(const std::string& xml_str);
-optional<device> device_parse_root(const xml::tree& tree);
-optional<device> device_parse(const xml::tree& tree);
+optional<device> device_parse_root(string_view xml_str);
 
 } // namespace upnp
@@ -0,0 +1,87 @@
+#include <upnp/shared_discovery.h>
+#include <upnp/third_party/error_code.h>
+#include "condition_variable.h"
+
+namespace upnp {
+
+using clock = std::chrono::steady_clock;
+
+struct shared_discovery::state_t {
+    net::any_io_executor _exec;
+    options _options;
+    ConditionVariable _cv;
+    bool _in_flight = false;
+    // Incremented each time a round finishes
+    size_t _round = 0;
+    optional<result<std::vector<igd>>> _last;
+    clock::time_point _finished_at;
+
+    state_t(net::any_io_executor exec, options opts)
+        : _exec(std::move(exec))
+        , _options(std::move(opts))
+        , _cv(_exec)
+    {}
+
+    bool last_is_fresh() const {
+        return _last
+            && _options.result_ttl.count() > 0
+            && clock::now() - _finished_at < _options.result_ttl;
+    }
+
+    result<std::vector<igd>> copy_last() const {
+        auto& last = *_last;
+        if (!last) return last.error();
+
+        std::vector<igd> ret;
+        ret.reserve(last.value().size());
+        for (auto& i : last.value()) ret.push_back(i.clone());
+        return ret;
+    }
+};
+
+shared_discovery::shared_discovery(net::any_io_executor exec)
+    : shared_discovery(std::move(exec), options())
+{}
+
+shared_discovery::shared_discovery(net::any_io_executor exec, options opts)
+    : _state(std::make_shared<state_t>(std::move(exec), std::move(opts)))
+{}
+
+result<std::vector<igd>> shared_discovery::discover(net::yield_context yield)
+{
+    // Keep the state alive even if `this` is moved from or destroyed
+    // while waiting.
+    auto st = _state;
+
+    if (st->last_is_fresh()) return st->copy_last();
+
+    if (st->_in_flight) {
+        auto round = st->_round;
+
+        while (st->_round == round) {
+            error_code ec;
+            st->_cv.wait(yield[ec]);
+        }
+
+        return st->copy_last();
+    }
+
+    st->_in_flight = true;
+    auto r = igd::discover(st->_exec, st->_options.discover, yield);
+    st->_in_flight = false;
+
+    st->_last        = std::move(r);
+    st->_finished_at = clock::now();
+    ++st->_round;
+    st->_cv.notify();
+
+    return st->copy_last();
+}
+
+void shared_discovery::invalidate()
+{
+    // Callers of the last round may not have picked up their copy yet
+    _state->_finished_at = clock::time_point();
+}
+
+} // namespace upnp
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <upnp/config.h>
+#include <upnp/third_party/net.h>
+#include <upnp/third_party/string_view.h>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/ip/address.hpp>
+#include <boost/container/small_vector.hpp>
+#include <array>
+#include <cstdio>
+#include <string>
+
+namespace upnp { namespace soap {
+
+enum class action : uint8_t {
+    add_port_mapping,
+    delete_port_mapping,
+    get_external_ip_address,
+    get_generic_port_mapping_entry,
+    get_list_of_port_mappings,
+};
+
+static constexpr size_t action_count = 5;
+
+inline string_view name(action a)
+{
+    switch (a) {
+        case action::add_port_mapping:               return "AddPortMapping";
+        case action::delete_port_mapping:            return "DeletePortMapping";
+        case action::get_external_ip_address:        return "GetExternalIPAddress";
+        case action::get_generic_port_mapping_entry: return "GetGenericPortMappingEntry";
+        case action::get_list_of_port_mappings:      return "GetListOfPortMappings";
+    }
+    return "";
+}
+
+// Arguments of an action, `<Name>value</Name>` one after another. Formatted
+// by hand rather than through iostreams, into a buffer which only goes to
+// the heap for unusually long values.
+class args {
+public:
+    args& add(string_view name, string_view value)
+    {
+        open(name);
+        for (char c : value) {
+            switch (c) {
+                case '&':  append("&amp;");  break;
+                case '<':  append("&lt;");   break;
+                case '>':  append("&gt;");   break;
+                case '"':  append("&quot;"); break;
+                case '\'': append("&apos;"); break;
+                default:   _buf.push_back(c);
+            }
+        }
+        close(name);
+        return *this;
+    }
+
+    args& add(string_view name, uint64_t value)
+    {
+        char digits[20];
+        size_t n = 0;
+        do { digits[n++] = '0' + value % 10; value /= 10; } while (value);
+
+        open(name);
+        while (n) _buf.push_back(digits[--n]);
+        close(name);
+        return *this;
+    }
+
+    args& add(string_view name, const net::ip::address& addr)
+    {
+        if (!addr.is_v4()) return add(name, string_view(addr.to_string()));
+
+        open(name);
+        auto bytes = addr.to_v4().to_bytes();
+        for (size_t i = 0; i < bytes.size(); ++i) {
+            if (i) _buf.push_back('.');
+            append_number(bytes[i]);
+        }
+        close(name);
+        return *this;
+    }
+
+    string_view str() const { return string_view(_buf.data(), _buf.size()); }
+
+private:
+    void append(string_view s) { _buf.insert(_buf.end(), s.begin(), s.end()); }
+
+    void append_number(unsigned v)
+    {
+        if (v >= 100) _buf.push_back('0' + v / 100);
+        if (v >= 10)  _buf.push_back('0' + v / 10 % 10);
+        _buf.push_back('0' + v % 10);
+    }
+
+    void open(string_view name)  { append("<");  append(name); append(">"); }
+    void close(string_view name) { append("</"); append(name); append(">"); }
+
+private:
+    boost::container::small_vector<char, 512> _buf;
+};
+
+// Everything in a request to one service which doesn't change from one
+// action to the next: the request line with the headers, the SOAPAction
+// header and the element wrapping the arguments of each action.
+class envelope {
+public:
+    // Room for the Content-Length header
+    using scratch = std::array<char, 48>;
+
+    using buffers = std::array<net::const_buffer, 8>;
+
+    envelope(string_view host_and_port, string_view path, string_view urn)
+    {
+        std::string header = "POST " + path.to_string() + " HTTP/1.1\r\n"
+            "Host: " + host_and_port.to_string() + "\r\n"
+            "User-Agent: " CPP_UPNP_HTTP_USER_AGENT "\r\n"
+            "Content-Type: text/xml; charset=\"utf-8\"\r\n"
+            "Cache-Control: no-cache\r\n"
+            "Pragma: no-cache\r\n";
+
+        _header[0] = header + "Connection: close\r\n";
+        _header[1] = header + "Connection: keep-alive\r\n";
+
+        for (size_t i = 0; i < action_count; ++i) {
+            auto n = name(action(i)).to_string();
+            auto& a = _actions[i];
+            a.soap_action = "SOAPAction: \"" + urn.to_string() + "#" + n + "\"\r\n";
+            a.open  = "<u:" + n + " xmlns:u=\"" + urn.to_string() + "\">";
+            a.close = "</u:" + n + ">";
+        }
+    }
+
+    // The whole HTTP request for `a`. The buffers point into this
+    // envelope, `args` and `s`, all of which must outlive the write.
+    buffers request(action a, string_view args, bool keep_alive, scratch& s) const
+    {
+        static const string_view prefix =
+            "<?xml version=\"1.0\"?>"
+            "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+                        "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+            "<s:Body>";
+        static const string_view suffix = "</s:Body></s:Envelope>";
+
+        auto& act = _actions[size_t(a)];
+
+        size_t length = prefix.size() + act.open.size() + args.size()
+                      + act.close.size() + suffix.size();
+
+        int n = std::snprintf(s.data(), s.size(), "Content-Length: %zu\r\n\r\n", length);
+
+        return {{
+            net::buffer(_header[keep_alive]),
+            net::buffer(act.soap_action),
+            net::buffer(s.data(), size_t(n)),
+            net::buffer(prefix.data(), prefix.size()),
+            net::buffer(act.open),
+            net::buffer(args.data(), args.size()),
+            net::buffer(act.close),
+            net::buffer(suffix.data(), suffix.size()),
+        }};
+    }
+
+private:
+    struct per_action {
+        std::string soap_action;
+        std::string open;
+        std::string close;
+    };
+
+    std::string _header[2];
+    std::array<per_action, action_count> _actions;
+};
+
+}} // namespaces
@@ -0,0 +1,351 @@
+#include "soap_fields.h"
+#include "str/trim.h"
+#include "xml.h"
+
+namespace upnp { namespace soap {
+
+// Elements and values of SOAP responses are short, anything longer is
+// padding or an attempt to make us buffer it.
+static const size_t max_tag_size   = 256;
+static const size_t max_value_size = 64 * 1024;
+
+// Streamed text is handed over in pieces of about this size
+static const size_t stream_chunk_size = 4096;
+static const size_t max_entity_size   = 16;
+
+static string_view local_name(string_view name)
+{
+    auto colon = name.find(':');
+    if (colon != string_view::npos) name.remove_prefix(colon + 1);
+    return name;
+}
+
+// Anything which doesn't end an element name
+static bool is_name_char(char c)
+{
+    return c != '>' && c != '/' && !isspace((unsigned char) c);
+}
+
+field_collector::field_collector( string_view parent
+                                , field_sink& sink
+                                , bool repeated)
+    : _parent(parent)
+    , _sink(sink)
+    , _repeated(repeated)
+{}
+
+void field_collector::reset()
+{
+    _sink.reset();
+
+    _state = state::text;
+    _tag.clear();
+    _prev[0] = _prev[1] = 0;
+    _quote = 0;
+    _slash = false;
+    _depth = 0;
+    _parent_depth = -1;
+    _parent_done = false;
+    _malformed = false;
+    _capturing = false;
+    _streaming = false;
+    _value.clear();
+    _entity.clear();
+}
+
+void field_collector::feed(string_view chunk)
+{
+    while (!chunk.empty() && !finished()) {
+        if (_state == state::text) {
+            // Runs of text are taken in one go
+            auto lt = std::min(chunk.find('<'), chunk.size());
+            append_text(chunk.substr(0, lt));
+            chunk.remove_prefix(lt);
+            if (chunk.empty()) break;
+        } else if (_state == state::start_tag || _state == state::end_tag) {
+            // And so are names
+            size_t n = 0;
+            while (n < chunk.size() && is_name_char(chunk[n])) ++n;
+            if (_tag.size() + n > max_tag_size) { _malformed = true; break; }
+            _tag.append(chunk.data(), n);
+            chunk.remove_prefix(n);
+            if (chunk.empty()) break;
+        }
+        on_char(chunk[0]);
+        chunk.remove_prefix(1);
+    }
+
+    // Don't sit on what was read until more arrives
+    if (_streaming && !_malformed) flush_text(2);
+}
+
+void field_collector::end()
+{
+    if (finished()) return;
+    if (_state != state::text || _depth != 0) _malformed = true;
+}
+
+void field_collector::on_char(char c)
+{
+    auto shift = [&] { _prev[0] = _prev[1]; _prev[1] = c; };
+
+    switch (_state) {
+        case state::text:
+            if (c == '<') {
+                _state = state::markup;
+                _tag.clear();
+            } else {
+                append_text(c);
+            }
+            break;
+
+        case state::markup:
+            if      (c == '/') _state = state::end_tag;
+            else if (c == '!') _state = state::bang;
+            else if (c == '?') { _state = state::skip; _prev[0] = _prev[1] = 0; }
+            else {
+                _state = state::start_tag;
+                _slash = false;
+                on_char(c);
+            }
+            break;
+
+        case state::start_tag:
+            if (c == '>') {
+                open_element(false);
+            } else if (c == '/') {
+                _slash = true;
+                _state = state::attributes;
+            } else if (isspace((unsigned char) c)) {
+                _state = state::attributes;
+            } else if (_tag.size() < max_tag_size) {
+                _tag.push_back(c);
+            } else {
+                _malformed = true;
+            }
+            break;
+
+        case state::attributes:
+            if (c == '>') {
+                open_element(_slash);
+            } else if (c == '"' || c == '\'') {
+                _quote = c;
+                _state = state::quoted;
+                _slash = false;
+            } else if (!isspace((unsigned char) c)) {
+                _slash = (c == '/');
+            }
+            break;
+
+        case state::quoted:
+            if (c == _quote) _state = state::attributes;
+            break;
+
+        case state::end_tag:
+            if (c == '>') {
+                close_element();
+            } else if (isspace((unsigned char) c)) {
+                // Allowed before '>'
+            } else if (_tag.size() < max_tag_size) {
+                _tag.push_back(c);
+            } else {
+                _malformed = true;
+            }
+            break;
+
+        case state::bang:
+            _tag.push_back(c);
+            if (_tag == "--") {
+                _state = state::comment;
+                _prev[0] = _prev[1] = 0;
+            } else if (_tag == "[CDATA[") {
+                _state = state::cdata;
+                _prev[0] = _prev[1] = 0;
+            } else if (string_view("--").starts_with(_tag)
+                    || string_view("[CDATA[").starts_with(_tag)) {
+                // Not decided yet
+            } else {
+                // DOCTYPE or similar, none of which may contain our fields
+                _state = state::skip;
+                _prev[0] = _prev[1] = 0;
+                on_char(c);
+            }
+            break;
+
+        case state::comment:
+            if (c == '>' && _prev[0] == '-' && _prev[1] == '-') {
+                _state = state::text;
+            }
+            shift();
+            break;
+
+        case state::cdata:
+            if (c == '>' && _prev[0] == ']' && _prev[1] == ']') {
+                // Drop the "]]" which was captured as text
+                if (_capturing && _value.size() >= 2) {
+                    _value.resize(_value.size() - 2);
+                }
+                _state = state::text;
+            } else if (c == '&') {
+                // Captured text is decoded once complete, so escape what
+                // CDATA leaves verbatim.
+                for (char e : string_view("&amp;")) append_text(e);
+            } else {
+                append_text(c);
+            }
+            shift();
+            break;
+
+        case state::skip:
+            if (c == '>') _state = state::text;
+            break;
+    }
+}
+
+void field_collector::append_text(char c)
+{
+    if (!_capturing) return;
+    if (_streaming) return stream_text(c);
+    if (_value.size() >= max_value_size) { _malformed = true; return; }
+    _value.push_back(c);
+}
+
+void field_collector::append_text(string_view s)
+{
+    if (!_capturing) return;
+
+    if (!_streaming) {
+        if (_value.size() + s.size() > max_value_size) { _malformed = true; return; }
+        _value.append(s.data(), s.size());
+        return;
+    }
+
+    while (!s.empty() && !_malformed) {
+        if (_entity.empty()) {
+            auto amp = std::min(s.find('&'), s.size());
+            _value.append(s.data(), amp);
+            s.remove_prefix(amp);
+            if (_value.size() >= stream_chunk_size) flush_text(2);
+            if (s.empty()) break;
+
+            // Most of an escaped document is references, decode those
+            // which aren't split across chunks in place.
+            auto semi = s.substr(0, max_entity_size).find(';');
+            if (semi != string_view::npos) {
+                if (!decode_entity(s.substr(0, semi + 1))) _malformed = true;
+                s.remove_prefix(semi + 1);
+                continue;
+            }
+        }
+        stream_text(s[0]);
+        s.remove_prefix(1);
+    }
+}
+
+void field_collector::stream_text(char c)
+{
+    if (c == '&' || !_entity.empty()) {
+        _entity.push_back(c);
+        if (c == ';') {
+            if (!decode_entity(_entity)) _malformed = true;
+            _entity.clear();
+        } else if (_entity.size() > max_entity_size) {
+            _malformed = true;
+        }
+    } else {
+        _value.push_back(c);
+    }
+
+    // The "]]" ending a CDATA section is only recognized as such once
+    // the '>' arrives, so it must still be there to be dropped.
+    if (_value.size() >= stream_chunk_size) flush_text(2);
+}
+
+bool field_collector::decode_entity(string_view e)
+{
+    if      (e == "&lt;")   _value += '<';
+    else if (e == "&gt;")   _value += '>';
+    else if (e == "&amp;")  _value += '&';
+    else if (e == "&quot;") _value += '"';
+    else return xml::decode(e, _value);
+    return true;
+}
+
+void field_collector::flush_text(size_t keep)
+{
+    if (_value.size() <= keep) return;
+    auto n = _value.size() - keep;
+    _sink.on_text(string_view(_value.data(), n));
+    _value.erase(0, n);
+}
+
+void field_collector::parent_ended()
+{
+    _parent_depth = -1;
+    _sink.on_parent_end();
+    if (!_repeated) _parent_done = true;
+}
+
+void field_collector::open_element(bool self_closing)
+{
+    _state = state::text;
+
+    auto name = local_name(_tag);
+
+    if (_parent_depth < 0) {
+        if (name == _parent) {
+            if (_repeated) _sink.reset();
+            if (self_closing) { parent_ended(); return; }
+            _parent_depth = _depth;
+        }
+    } else if (_depth == _parent_depth + 1 && !_capturing && _sink.wants(name)) {
+        if (self_closing) {
+            _sink.on_field(name, string_view());
+        } else {
+            _capturing = true;
+            _streaming = _sink.streams(name);
+            _field.assign(name.data(), name.size());
+            _value.clear();
+            _entity.clear();
+        }
+    }
+
+    if (!self_closing) ++_depth;
+}
+
+void field_collector::close_element()
+{
+    _state = state::text;
+
+    if (--_depth < 0) { _malformed = true; return; }
+
+    if (_capturing && _depth == _parent_depth + 1) {
+        _capturing = false;
+
+        if (local_name(_tag) != _field) { _malformed = true; return; }
+
+        if (_streaming) {
+            _streaming = false;
+            if (!_entity.empty()) { _malformed = true; return; }
+            flush_text(0);
+            _sink.on_field(_field, string_view());
+            return;
+        }
+
+        string_view v(_value);
+        str::trim_space_prefix(v);
+        str::trim_space_suffix(v);
+
+        if (v.find('&') != string_view::npos) {
+            _decoded.clear();
+            if (!xml::decode(v, _decoded)) { _malformed = true; return; }
+            v = _decoded;
+        }
+
+        _sink.on_field(_field, v);
+    } else if (_depth == _parent_depth) {
+        parent_ended();
+    }
+}
+
+}} // namespaces
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <upnp/third_party/optional.h>
+#include <upnp/third_party/string_view.h>
+#include <string>
+
+namespace upnp { namespace soap {
+
+// Receives the fields picked out by a `field_collector`, see `decoder` in
+// soap_schema.h.
+class field_sink {
+public:
+    // Whether the element `name` should be captured.
+    virtual bool wants(string_view name) const = 0;
+
+    // Text of a wanted element with surrounding whitespace trimmed and
+    // entities decoded. Valid only for the duration of the call.
+    virtual void on_field(string_view name, string_view text) = 0;
+
+    // Nothing more is wanted.
+    virtual bool complete() const = 0;
+
+    virtual void reset() = 0;
+
+    // Wanted elements for which this is true have their text handed over
+    // in pieces to `on_text` as it's read, with entities decoded but
+    // whitespace kept, followed by `on_field` with empty text once they
+    // end. Nothing of them is buffered.
+    virtual bool streams(string_view) const { return false; }
+    virtual void on_text(string_view) {}
+
+    // The parent element ended.
+    virtual void on_parent_end() {}
+
+protected:
+    ~field_sink() = default;
+};
+
+// Picks the text of a few elements out of a SOAP response while its body
+// is being read, without building the document. The fields are the direct
+// children of the first element named `parent` (e.g.
+// GetExternalIPAddressResponse) which `sink` wants. Namespace prefixes are
+// ignored.
+//
+// Reading can stop as soon as `finished()`; whatever follows the parent
+// element (padding, the end of the envelope) is never looked at.
+//
+// If `repeated`, every element named `parent` is collected in turn instead,
+// with `sink` reset as each starts and told when each ends, until the end
+// of the input.
+//
+// This is a push scanner, not a user of `xml::reader`: the reader needs the
+// whole document in memory, while SOAP responses are decoded chunk by chunk
+// as they arrive so that a large NewPortListing is never buffered and the
+// read can stop early. Entity references are decoded by the same
+// `xml::decode` as the reader's.
+class field_collector {
+public:
+    field_collector(string_view parent, field_sink& sink, bool repeated = false);
+
+    void feed(string_view chunk);
+
+    // The body ended, anything left unterminated makes it malformed.
+    void end();
+
+    // The sink has all it wants.
+    bool complete() const { return _sink.complete(); }
+
+    // All fields were seen or the parent element ended without them.
+    bool finished() const
+    {
+        return (!_repeated && (complete() || _parent_done)) || _malformed;
+    }
+
+    bool malformed() const { return _malformed; }
+
+    // Forget everything fed so far, e.g. to start over with the response
+    // to a repeated request. Resets the sink as well.
+    void reset();
+
+private:
+    enum class state {
+        text,
+        markup,         // after '<'
+        start_tag,      // element name
+        attributes,
+        quoted,         // attribute value
+        end_tag,
+        bang,           // after "<!"
+        comment,
+        cdata,
+        skip,           // DOCTYPE and processing instructions
+    };
+
+    void on_char(char c);
+    void open_element(bool self_closing);
+    void close_element();
+    void append_text(char c);
+    void append_text(string_view);
+    void stream_text(char c);
+    bool decode_entity(string_view);
+    void flush_text(size_t keep);
+    void parent_ended();
+
+private:
+    string_view _parent;
+    field_sink& _sink;
+    bool _repeated;
+
+    state _state = state::text;
+    std::string _tag;
+    // Trailing characters of the current comment, CDATA section or tag
+    char _prev[2] = {0, 0};
+    char _quote = 0;
+    bool _slash = false;
+
+    int _depth = 0;
+    int _parent_depth = -1;
+    bool _parent_done = false;
+    bool _malformed = false;
+
+    // Whether the text of element `_field` is being captured
+    bool _capturing = false;
+    // Its text goes to `field_sink::on_text`
+    bool _streaming = false;
+    std::string _field;
+    std::string _value;
+    std::string _decoded;
+    // Entity reference split across streamed chunks
+    std::string _entity;
+};
+
+}} // namespaces
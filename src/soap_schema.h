@@ -0,0 +1,304 @@
+#pragma once
+
+#include <upnp/igd.h>
+#include "soap_fields.h"
+#include "str/consume_number.h"
+#include "str/iequals.h"
+#include "str/parse_address.h"
+#include <bitset>
+#include <tuple>
+#include <utility>
+
+namespace upnp { namespace soap {
+
+// Parsers of element text into the types of result members. Each returns
+// false if the text isn't a valid value.
+
+inline bool parse_value(string_view s, std::string& out)
+{
+    out.assign(s.data(), s.size());
+    return true;
+}
+
+template<class N>
+inline
+std::enable_if_t<std::is_unsigned<N>::value && !std::is_same<N, bool>::value, bool>
+parse_value(string_view s, N& out)
+{
+    auto n = str::consume_number<N>(s);
+    if (!n || !s.empty()) return false;
+    out = *n;
+    return true;
+}
+
+// UPnP booleans
+inline bool parse_value(string_view s, bool& out)
+{
+    if (s == "1" || str::iequals(s, "true")  || str::iequals(s, "yes")) { out = true;  return true; }
+    if (s == "0" || str::iequals(s, "false") || str::iequals(s, "no"))  { out = false; return true; }
+    return false;
+}
+
+inline bool parse_value(string_view s, std::chrono::seconds& out)
+{
+    uint32_t n;
+    if (!parse_value(s, n)) return false;
+    out = std::chrono::seconds(n);
+    return true;
+}
+
+inline bool parse_value(string_view s, net::ip::address& out)
+{
+    auto a = str::parse_address(s);
+    if (!a) return false;
+    out = *a;
+    return true;
+}
+
+inline bool parse_value(string_view s, igd::protocol& out)
+{
+    if (str::iequals(s, "TCP")) { out = igd::tcp; return true; }
+    if (str::iequals(s, "UDP")) { out = igd::udp; return true; }
+    return false;
+}
+
+// The child element `name` goes to `member` of T.
+template<class T, class M>
+struct field {
+    string_view name;
+    M T::* member;
+};
+
+template<class T, class M>
+field<T, M> bind(string_view name, M T::* member)
+{
+    return {name, member};
+}
+
+struct field_error {
+    string_view name;
+    // Otherwise its value didn't parse
+    bool missing;
+};
+
+// How the children of `element` map to the members of T. All of the
+// fields are required.
+template<class T, class... M>
+class schema {
+public:
+    using value_type = T;
+
+    static constexpr size_t field_count = sizeof...(M);
+
+    schema(string_view element, field<T, M>... fields)
+        : _element(element)
+        , _fields(fields...)
+    {}
+
+    string_view element() const { return _element; }
+
+    // Index of the field called `name`, `field_count` if there's none.
+    size_t find(string_view name) const
+    {
+        size_t ret = field_count, i = 0;
+        for_each([&] (auto& f) {
+            if (ret == field_count && f.name == name) ret = i;
+            ++i;
+        });
+        return ret;
+    }
+
+    string_view name(size_t i) const
+    {
+        string_view ret;
+        size_t j = 0;
+        for_each([&] (auto& f) { if (j++ == i) ret = f.name; });
+        return ret;
+    }
+
+    bool parse(size_t i, string_view text, T& out) const
+    {
+        bool ok = false;
+        size_t j = 0;
+        for_each([&] (auto& f) {
+            if (j++ == i) ok = parse_value(text, out.*(f.member));
+        });
+        return ok;
+    }
+
+private:
+    template<class F>
+    void for_each(F&& f) const
+    {
+        for_each(f, std::index_sequence_for<M...>());
+    }
+
+    template<class F, size_t... I>
+    void for_each(F& f, std::index_sequence<I...>) const
+    {
+        (void) std::initializer_list<int>{ (f(std::get<I>(_fields)), 0)... };
+    }
+
+private:
+    string_view _element;
+    std::tuple<field<T, M>...> _fields;
+};
+
+template<class T, class... M>
+schema<T, M...> make_schema(string_view element, field<T, M>... fields)
+{
+    return {element, fields...};
+}
+
+// Decodes one element described by `Schema` into `out` as its fields are
+// handed over by a `field_collector`.
+template<class Schema>
+class decoder final : public field_sink {
+public:
+    using T = typename Schema::value_type;
+
+    decoder(const Schema& schema, T& out)
+        : _schema(schema)
+        , _out(out)
+    {}
+
+    bool wants(string_view name) const override
+    {
+        auto i = _schema.find(name);
+        return i < Schema::field_count && !_seen[i];
+    }
+
+    void on_field(string_view name, string_view text) override
+    {
+        auto i = _schema.find(name);
+        if (i >= Schema::field_count || _seen[i]) return;
+        _seen[i] = true;
+        if (!_schema.parse(i, text, _out) && _invalid == Schema::field_count) {
+            _invalid = i;
+        }
+    }
+
+    bool complete() const override { return _seen.all(); }
+
+    void reset() override
+    {
+        _seen.reset();
+        _invalid = Schema::field_count;
+    }
+
+    // The first field whose value didn't parse, else the first one which
+    // wasn't there.
+    optional<field_error> error() const
+    {
+        if (_invalid < Schema::field_count) {
+            return field_error{_schema.name(_invalid), false};
+        }
+        for (size_t i = 0; i < Schema::field_count; ++i) {
+            if (!_seen[i]) return field_error{_schema.name(i), true};
+        }
+        return boost::none;
+    }
+
+private:
+    const Schema& _schema;
+    T& _out;
+    std::bitset<Schema::field_count> _seen;
+    size_t _invalid = Schema::field_count;
+};
+
+// Decodes every `Schema` element of an XML document which is itself the
+// escaped text of the field `name` (e.g. the NewPortListing of
+// GetListOfPortMappings) while that text is being streamed by a
+// `field_collector`. Each record is handed to `on_record` as soon as it
+// ends, so nothing of the document but the record being decoded is held.
+// Records with missing or invalid fields are skipped.
+//
+// Records handed over before a reset (i.e. a repeated request) aren't
+// handed over again.
+template<class Schema, class OnRecord>
+class embedded_records final : public field_sink {
+public:
+    using T = typename Schema::value_type;
+
+    embedded_records(string_view name, const Schema& schema, OnRecord on_record)
+        : _name(name)
+        , _on_record(std::move(on_record))
+        , _decoder(schema, _record)
+        , _records(*this)
+        , _inner(schema.element(), _records, true)
+    {}
+
+    embedded_records(const embedded_records&) = delete;
+    embedded_records& operator=(const embedded_records&) = delete;
+
+    bool wants(string_view name) const override { return !_done && name == _name; }
+    bool streams(string_view name) const override { return name == _name; }
+
+    void on_text(string_view chunk) override { _inner.feed(chunk); }
+
+    void on_field(string_view name, string_view) override
+    {
+        if (name != _name) return;
+        _done = true;
+        _inner.end();
+    }
+
+    bool complete() const override { return _done; }
+
+    void reset() override
+    {
+        _inner.reset();
+        _done = false;
+        _skip = _delivered;
+        _decoded = _records_seen = 0;
+    }
+
+    // The embedded document isn't well formed
+    bool malformed() const { return _inner.malformed(); }
+
+    size_t delivered() const { return _delivered; }
+
+    // Records in the document so far, including those which were skipped
+    size_t record_count() const { return _records_seen; }
+
+private:
+    void on_record_end()
+    {
+        ++_records_seen;
+        if (_decoder.error()) return;
+        if (_decoded++ < _skip) return;
+        ++_delivered;
+        _on_record(std::move(_record));
+    }
+
+    // Sink of the inner collector
+    struct records final : field_sink {
+        embedded_records& self;
+
+        explicit records(embedded_records& self) : self(self) {}
+
+        bool wants(string_view n) const override { return self._decoder.wants(n); }
+        void on_field(string_view n, string_view t) override { self._decoder.on_field(n, t); }
+        bool complete() const override { return self._decoder.complete(); }
+        void reset() override { self._decoder.reset(); }
+        void on_parent_end() override { self.on_record_end(); }
+    };
+
+private:
+    string_view _name;
+    OnRecord _on_record;
+    T _record;
+    decoder<Schema> _decoder;
+    records _records;
+    field_collector _inner;
+
+    bool _done = false;
+    // Records decoded since the last reset, and how many of them were
+    // handed over before it
+    size_t _decoded = 0;
+    size_t _skip = 0;
+    size_t _delivered = 0;
+    size_t _records_seen = 0;
+};
+
+}} // namespaces
@@ -1,15 +1,27 @@
 #include <upnp/ssdp.h>
 #include <boost/asio/ip/multicast.hpp>
+#include <boost/asio/ip/v6_only.hpp>
 #include <boost/asio/steady_timer.hpp>
 #include <boost/asio/ip/udp.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/circular_buffer.hpp>
+#include <boost/functional/hash.hpp>
+#include <algorithm>
 #include <chrono>
-#include <queue>
-#include <set>
+#include <list>
+#include <map>
+#include <random>
+#include <sstream>
+#include <unordered_map>
 
 #include "condition_variable.h"
+#include "udp_rx_batch.h"
+#include "udp_tx_batch.h"
 #include "str/consume_until.h"
 #include "str/consume_endpoint.h"
+#include "str/parse_address.h"
+#include "str/consume_number.h"
+#include "str/iequals.h"
 #include "str/istarts_with.h"
 #include "str/trim.h"
 
@@ -17,53 +29,372 @@ namespace upnp { namespace ssdp {
 
 namespace sys = boost::system;
 
+// Header values SSDP messages may carry, pointing into the datagram.
+struct headers {
+    string_view st;
+    string_view nt;
+    string_view nts;
+    string_view usn;
+    string_view location;
+    string_view server;
+    string_view cache_control;
+    string_view boot_id;
+    string_view config_id;
+};
+
+static size_t offset_in(string_view whole, string_view part)
+{
+    return part.data() - whole.data();
+}
+
+// Splits off the next line, accepting both "\r\n" and "\n" line breaks.
+static bool next_line(string_view& lines, string_view& line)
+{
+    if (lines.empty()) return false;
+
+    auto pos = lines.find('\n');
+
+    if (pos == string_view::npos) {
+        line = lines;
+        lines = string_view();
+    } else {
+        line = lines.substr(0, pos);
+        lines.remove_prefix(pos + 1);
+    }
+
+    if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+    return true;
+}
+
+static void set_header(headers& h, string_view key, string_view val)
+{
+    using str::iequals;
+
+    // Switch on the length first so each line is compared against at most
+    // a single header name.
+    switch (key.size()) {
+        case 2:
+            if      (iequals(key, "ST")) h.st = val;
+            else if (iequals(key, "NT")) h.nt = val;
+            break;
+        case 3:
+            if      (iequals(key, "USN")) h.usn = val;
+            else if (iequals(key, "NTS")) h.nts = val;
+            break;
+        case 6:
+            if (iequals(key, "SERVER")) h.server = val;
+            break;
+        case 8:
+            if (iequals(key, "LOCATION")) h.location = val;
+            break;
+        case 13:
+            if (iequals(key, "CACHE-CONTROL")) h.cache_control = val;
+            break;
+        case 15:
+            if (iequals(key, "BOOTID.UPNP.ORG")) h.boot_id = val;
+            break;
+        case 17:
+            if (iequals(key, "CONFIGID.UPNP.ORG")) h.config_id = val;
+            break;
+    }
+}
+
+// Parses header lines up to the empty line which ends them.
+static void parse_headers(string_view lines, headers& h)
+{
+    string_view line;
+
+    while (next_line(lines, line)) {
+        auto colon = line.find(':');
+        if (colon == string_view::npos) break;
+
+        auto key = line.substr(0, colon);
+        auto val = line.substr(colon + 1);
+
+        str::trim_space_prefix(val);
+        str::trim_space_suffix(val);
+
+        set_header(h, key, val);
+    }
+}
+
+// USN: Unique Service Name
+// https://tools.ietf.org/html/draft-cai-ssdp-v1-03#section-2.2.2
+static string_view uuid_from_usn(string_view usn)
+{
+    string_view uuid;
+
+    while (auto opt_token = str::consume_until(usn, ":")) {
+        if (str::iequals(*opt_token, "uuid")) {
+            auto opt_uuid = str::consume_until(usn, "::");
+            if (opt_uuid) {
+                uuid = *opt_uuid;
+            } else {
+                uuid = usn;
+            }
+        }
+    }
+
+    return uuid;
+}
+
+// CACHE-CONTROL header value, e.g. "max-age=1800", possibly among other
+// directives.
+static optional<std::chrono::seconds> parse_max_age(string_view val)
+{
+    optional<std::chrono::seconds> ret;
+
+    while (!val.empty()) {
+        auto opt_directive = str::consume_until(val, ",");
+        string_view directive = opt_directive ? *opt_directive : val;
+        if (!opt_directive) val = "";
+
+        str::trim_space_prefix(directive);
+        if (!str::istarts_with(directive, "max-age")) continue;
+        directive.remove_prefix(sizeof("max-age") - 1);
+        str::trim_space_prefix(directive);
+        if (!directive.starts_with('=')) continue;
+        directive.remove_prefix(1);
+        str::trim_space_prefix(directive);
+
+        auto opt_secs = str::consume_number<uint32_t>(directive);
+        if (opt_secs) ret = std::chrono::seconds(*opt_secs);
+    }
+
+    return ret;
+}
+
+static optional<uint32_t> parse_u32(string_view val)
+{
+    if (val.empty()) return none;
+    return str::consume_number<uint32_t>(val);
+}
+
+// SSDP messages fit into a single Ethernet frame, larger datagrams aren't
+// valid responses.
+static const size_t rx_buffer_size = 8*1024;
+// Maximum number of datagrams read from a socket at once.
+static const size_t rx_batch_size = 16;
+
+// Sources tracked at once by the rate limiter.
+static const size_t max_rate_limited_sources = 256;
+
 struct query::state_t : std::enable_shared_from_this<state_t> {
+    using clock = std::chrono::steady_clock;
+
+    // A serialized M-SEARCH, built once and sent as many times as needed.
+    struct search {
+        string_view target;
+        net::ip::udp::endpoint to;
+        std::string packet;
+        // Set once a response for `target` arrives on the channel (from
+        // `to` itself if it's unicast), it is then no longer retransmitted.
+        bool answered = false;
+    };
+
+    // One socket per local interface we search on.
+    struct channel {
+        net::ip::address bind_ip;
+        net::ip::udp::socket socket;
+        // Multicast groups the M-SEARCH is sent to
+        std::vector<net::ip::udp::endpoint> groups;
+        // One per group and search target
+        std::vector<search> searches;
+    };
+
+    struct source {
+        double tokens;
+        clock::time_point refilled_at;
+        bool parse_error_reported = false;
+    };
+
     net::any_io_executor _exec;
-    net::ip::udp::socket _socket;
+    std::list<channel> _channels;
     net::steady_timer _timer;
+    net::steady_timer _tx_timer;
     ConditionVariable _cv;
-    const net::ip::udp::endpoint _multicast_ep;
-    std::queue<result<query::response, error::parse>> _responses;
-    std::set<std::string> _already_seen_usns;
+    // Notified when there is room in `_responses` again.
+    ConditionVariable _space_cv;
+    boost::circular_buffer<result<query::response, error::parse>> _responses;
+    // USNs seen, keyed by their hash so that duplicates can be detected
+    // from the datagram without copying the USN.
+    std::unordered_multimap<size_t, std::string> _already_seen_usns;
+    std::map<net::ip::address, source> _sources;
+    counters _counters;
 
     bool _stopped = false;
     optional<error_code> _rx_ec;
+    size_t _receivers = 0;
+    error_code _last_receive_ec;
 
     state_t(net::any_io_executor exec)
         : _exec(std::move(exec))
-        , _socket(_exec, net::ip::udp::v4())
         , _timer(_exec)
+        , _tx_timer(_exec)
         , _cv(_exec)
-        // https://www.grc.com/port_1900.htm
-        , _multicast_ep(net::ip::address_v4({239, 255, 255, 250}), 1900)
+        , _space_cv(_exec)
     {}
 
     result<query::response, query::error::get_response>
     get_response(net::yield_context yield);
 
-    result<void> start(const net::ip::address_v4 &bind_ip, net::yield_context);
+    clock::time_point _sent_at;
+    clock::time_point _deadline;
+    options _options;
+
+    result<void> start(const query::options&, net::yield_context);
+    void arm_timer(clock::time_point deadline);
+    bool is_unicast_target(const net::ip::address&) const;
 
+    result<void> open(channel&);
+    result<void> open_v4(channel&);
+    result<void> open_v6(channel&);
+    void prepare_searches(channel&, std::chrono::seconds mx);
+    result<void> transmit(channel&, net::yield_context);
+    void retransmit(net::yield_context);
+    void receive(channel&, net::yield_context);
+    void on_datagram(channel&, const net::ip::udp::endpoint&, string_view);
+    source* find_source(const net::ip::address&, clock::time_point);
+    bool rate_limit(source*, clock::time_point);
+
+    void close_sockets();
     void stop();
 };
 
-result<void> query::state_t::start(const net::ip::address_v4 &bind_ip, net::yield_context yield)
+// https://www.grc.com/port_1900.htm
+static const net::ip::udp::endpoint multicast_ep_v4
+    (net::ip::address_v4({239, 255, 255, 250}), 1900);
+
+// Link-local and site-local scoped SSDP groups (UDA 1.1, section 1.1.2)
+static const net::ip::address_v6 link_local_group_v6
+    = net::ip::make_address_v6("ff02::c");
+static const net::ip::address_v6 site_local_group_v6
+    = net::ip::make_address_v6("ff05::c");
+
+result<void> query::state_t::open(channel& ch)
 {
     using udp = net::ip::udp;
-    using namespace std::chrono;
 
-    _socket.set_option(udp::socket::reuse_address(true));
-    _socket.set_option(net::ip::multicast::join_group(_multicast_ep.address()));
+    error_code ec;
+
+    ch.socket.open(ch.bind_ip.is_v4() ? udp::v4() : udp::v6(), ec);
+    if (ec) return ec;
+
+    ch.socket.set_option(udp::socket::reuse_address(true), ec);
+    if (ec) return ec;
+
+    if (_options.receive_buffer_size) {
+        ch.socket.set_option(udp::socket::receive_buffer_size(_options.receive_buffer_size), ec);
+        if (ec) return ec;
+    }
+
+    ch.socket.non_blocking(true, ec);
+    if (ec) return ec;
+
+    return ch.bind_ip.is_v4() ? open_v4(ch) : open_v6(ch);
+}
+
+result<void> query::state_t::open_v4(channel& ch)
+{
+    using udp = net::ip::udp;
+    namespace mc = net::ip::multicast;
 
     error_code ec;
-    _socket.bind(udp::endpoint(bind_ip, 0), ec);
 
+    auto bind_ip = ch.bind_ip.to_v4();
+    auto group   = multicast_ep_v4.address().to_v4();
+
+    if (bind_ip.is_unspecified()) {
+        ch.socket.set_option(mc::join_group(group), ec);
+    } else {
+        ch.socket.set_option(mc::join_group(group, bind_ip), ec);
+        if (ec) return ec;
+        ch.socket.set_option(mc::outbound_interface(bind_ip), ec);
+    }
+    if (ec) return ec;
+
+    ch.socket.bind(udp::endpoint(bind_ip, 0), ec);
+    if (ec) return ec;
+
+    ch.groups.push_back(multicast_ep_v4);
+
+    return success();
+}
+
+result<void> query::state_t::open_v6(channel& ch)
+{
+    using udp = net::ip::udp;
+    namespace mc = net::ip::multicast;
+
+    error_code ec;
+
+    auto if_index = ch.bind_ip.to_v6().scope_id();
+
+    ch.socket.set_option(net::ip::v6_only(true), ec);
+    if (ec) return ec;
+
+    ch.socket.set_option(mc::outbound_interface(if_index), ec);
+    if (ec) return ec;
+
+    for (auto group : { link_local_group_v6, site_local_group_v6 }) {
+        ch.socket.set_option(mc::join_group(group, if_index), ec);
+        // Site-local multicast may not be routed on this interface, the
+        // other group is still worth searching.
+        if (ec) continue;
+        if (group.is_multicast_link_local()) group.scope_id(if_index);
+        ch.groups.push_back(udp::endpoint(group, 1900));
+    }
+
+    if (ch.groups.empty()) return ec;
+
+    // Unicast responses come back to the address the M-SEARCH was sent
+    // from, which for the site-local group may not be the link-local one.
+    ch.socket.bind(udp::endpoint(net::ip::address_v6::any(), 0), ec);
     if (ec) return ec;
 
-    std::stringstream ss;
+    return success();
+}
+
+// Value of the HOST header, e.g. "239.255.255.250:1900" or "[ff02::c]:1900"
+static std::string host_header(const net::ip::udp::endpoint& ep)
+{
+    auto addr = ep.address();
+
+    if (addr.is_v4()) {
+        return addr.to_string() + ":" + std::to_string(ep.port());
+    }
+
+    // Without the zone, it's local to the sender
+    auto addr6 = addr.to_v6();
+    addr6.scope_id(0);
+    return "[" + addr6.to_string() + "]:" + std::to_string(ep.port());
+}
+
+// Devices advertise link-local IPv6 locations without the zone, but
+// connecting to them needs the interface the response came from. It's
+// left out of the Host header again (see `url_t::host_header`).
+static void add_zone(url_t& location, unsigned long if_index)
+{
+    auto host = location.host();
+    if (!host.starts_with("[") || host.find('%') != string_view::npos) return;
+
+    auto addr = str::parse_address(host.substr(1, host.size() - 2));
+    if (!addr || !addr->is_v6() || !addr->to_v6().is_link_local()) return;
+
+    string_view url = location;
+    auto zone_pos = (host.data() - url.data()) + host.size() - 1;
+
+    auto s = url.to_string();
+    s.insert(zone_pos, "%" + std::to_string(if_index));
 
-    seconds timeout(2);
+    if (auto with_zone = url_t::parse(std::move(s))) {
+        location = std::move(*with_zone);
+    }
+}
 
-    std::array<const char*, 2> search_targets
+void query::state_t::prepare_searches(channel& ch, std::chrono::seconds mx)
+{
+    static const std::array<string_view, 2> search_targets
         = { "urn:schemas-upnp-org:device:InternetGatewayDevice:1"
           , "urn:schemas-upnp-org:device:InternetGatewayDevice:2"
           //, "urn:schemas-upnp-org:service:WANIPConnection:1"
@@ -73,64 +404,353 @@ result<void> query::state_t::start(const net::ip::address_v4 &bind_ip, net::yiel
           //, "upnp:rootdevice"
           };
 
-    for (auto target : search_targets) {
-        // Section 1.3.2 in
-        // http://upnp.org/specs/arch/UPnP-arch-DeviceArchitecture-v1.1.pdf
-        ss << "M-SEARCH * HTTP/1.1\r\n"
-           << "HOST: " << _multicast_ep << "\r\n"
-           << "ST: " << target << "\r\n"
-           << "MAN: \"ssdp:discover\"\r\n"
-           << "MX: " << timeout.count() << "\r\n"
-           << "USER-AGENT: asio-upnp/1.0\r\n"
-           << "\r\n";
+    for (auto& group : ch.groups) {
+        for (auto target : search_targets) {
+            std::stringstream ss;
+
+            // Section 1.3.2 in
+            // http://upnp.org/specs/arch/UPnP-arch-DeviceArchitecture-v1.1.pdf
+            ss << "M-SEARCH * HTTP/1.1\r\n"
+               << "HOST: " << host_header(group) << "\r\n"
+               << "ST: " << target << "\r\n"
+               << "MAN: \"ssdp:discover\"\r\n"
+               << "MX: " << mx.count() << "\r\n"
+               << "USER-AGENT: asio-upnp/1.0\r\n"
+               << "\r\n";
+
+            ch.searches.push_back(search{target, group, ss.str()});
+        }
+    }
+
+    for (auto& to : _options.unicast_targets) {
+        if (to.address().is_v4() != ch.bind_ip.is_v4()) continue;
+
+        for (auto target : search_targets) {
+            std::stringstream ss;
 
-        auto sss = ss.str();
+            // Unicast M-SEARCH (section 1.3.2 of UDA 1.1) has no MX, the
+            // device responds right away.
+            ss << "M-SEARCH * HTTP/1.1\r\n"
+               << "HOST: " << host_header(to) << "\r\n"
+               << "ST: " << target << "\r\n"
+               << "MAN: \"ssdp:discover\"\r\n"
+               << "USER-AGENT: asio-upnp/1.0\r\n"
+               << "\r\n";
 
-        _socket.async_send_to( net::buffer(sss.data(), sss.size())
-                             , _multicast_ep
-                             , yield[ec]);
+            ch.searches.push_back(search{target, to, ss.str()});
+        }
+    }
+}
+
+bool query::state_t::is_unicast_target(const net::ip::address& addr) const
+{
+    for (auto& ep : _options.unicast_targets) {
+        if (ep.address() == addr) return true;
+    }
+    return false;
+}
+
+// Sends the searches which haven't been answered yet, all at once.
+result<void> query::state_t::transmit(channel& ch, net::yield_context yield)
+{
+    udp_tx_batch batch;
+
+    for (auto& s : ch.searches) {
+        if (!s.answered) batch.push(s.packet, s.to);
+    }
+
+    if (batch.size() == 0) return success();
 
+    error_code ec;
+
+    while (true) {
+        batch.send(ch.socket, ec);
+        if (ec != net::error::would_block) break;
+        ch.socket.async_wait(net::socket_base::wait_write, yield[ec]);
         if (ec) return ec;
     }
 
+    // E.g. site-local multicast may not be routable while link-local is
+    if (ec && batch.failures() == batch.size()) return ec;
+    return success();
+}
 
-    net::spawn(_exec, [&, self = shared_from_this()] (auto y) {
-        _timer.expires_after(timeout + milliseconds(200));
-        _timer.async_wait([&, self] (error_code) {
-            if (_rx_ec) return;
-            _rx_ec = net::error::timed_out;
-            error_code ignored_ec;
-            _socket.close(ignored_ec);
-        });
+// UDP is unreliable (multicast over Wi-Fi especially) so UDA 1.1 advises
+// sending each M-SEARCH more than once. Retransmits are spread over the
+// first half of the window, leaving devices time to answer the last one.
+void query::state_t::retransmit(net::yield_context yield)
+{
+    using namespace std::chrono;
+
+    auto count = _options.retransmits;
+    if (count == 0) return;
 
-        while (true) {
-            std::array<char, 32*1024> rx;
-            net::ip::udp::endpoint ep;
-            net::mutable_buffer b(rx.data(), rx.size());
-            error_code ec;
-            size_t size = _socket.async_receive_from(b, ep, y[ec]);
+    auto spacing = duration_cast<milliseconds>(_options.timeout) / (2 * count);
 
-            if (!_rx_ec) {
-                if (_stopped) _rx_ec = net::error::operation_aborted;
-                else if (ec)  _rx_ec = ec;
+    std::minstd_rand rng(std::random_device{}());
+    // Up to a quarter of the spacing either way, so that control points
+    // started at the same time don't keep sending in lockstep.
+    std::uniform_int_distribution<milliseconds::rep> jitter(-spacing.count() / 4, spacing.count() / 4);
+
+    for (unsigned i = 1; i <= count; ++i) {
+        _tx_timer.expires_at(_sent_at + spacing * i + milliseconds(jitter(rng)));
+
+        error_code ec;
+        _tx_timer.async_wait(yield[ec]);
+        if (_rx_ec || _stopped) return;
+
+        for (auto& ch : _channels) {
+            // Errors are left for the receivers to notice
+            (void) transmit(ch, yield);
+            if (_rx_ec || _stopped) return;
+        }
+    }
+}
+
+query::state_t::source*
+query::state_t::find_source(const net::ip::address& addr, clock::time_point now)
+{
+    auto i = _sources.find(addr);
+    if (i != _sources.end()) return &i->second;
+
+    if (_sources.size() >= max_rate_limited_sources) {
+        // Make room by forgetting sources whose bucket has refilled, they
+        // would start from a full one anyway.
+        for (auto j = _sources.begin(); j != _sources.end();) {
+            auto& s = j->second;
+            std::chrono::duration<double> idle = now - s.refilled_at;
+            if (s.tokens + idle.count() * _options.source_rate >= _options.source_burst) {
+                j = _sources.erase(j);
+            } else {
+                ++j;
             }
-            if (_rx_ec) break;
+        }
+        // Too many sources are busy at once. Rejecting newcomers would let
+        // a flood from spoofed addresses lock the gateway out, so the one
+        // which was heard from least recently is forgotten instead.
+        if (_sources.size() >= max_rate_limited_sources) {
+            auto oldest = std::min_element(_sources.begin(), _sources.end(),
+                    [] (auto& a, auto& b) {
+                        return a.second.refilled_at < b.second.refilled_at;
+                    });
+            _sources.erase(oldest);
+        }
+    }
+
+    auto& s = _sources[addr];
+    s.tokens = _options.source_burst;
+    s.refilled_at = now;
+    return &s;
+}
+
+// Returns true if the datagram is to be dropped.
+bool query::state_t::rate_limit(source* s, clock::time_point now)
+{
+    std::chrono::duration<double> elapsed = now - s->refilled_at;
+    s->tokens = std::min<double>( _options.source_burst
+                                , s->tokens + elapsed.count() * _options.source_rate);
+    s->refilled_at = now;
+
+    if (s->tokens < 1) return true;
+    s->tokens -= 1;
+    return false;
+}
+
+void query::state_t::on_datagram( channel& ch
+                                , const net::ip::udp::endpoint& sender
+                                , string_view datagram)
+{
+    ++_counters.received;
+
+    auto now = clock::now();
+    auto src = find_source(sender.address(), now);
+
+    if (rate_limit(src, now)) {
+        ++_counters.rate_limited;
+        return;
+    }
+
+    auto rv = response_view::parse(datagram);
+
+    if (!rv) {
+        ++_counters.parse_errors;
+        // Report only the first bad datagram of each source
+        if (src->parse_error_reported) return;
+        src->parse_error_reported = true;
+    }
 
-            auto sv = string_view(rx.data(), size);
-            auto&& r = response::parse(sv);
-            if (r) {
-                // Don't add duplicates
-                if (!_already_seen_usns.insert(r.value().usn).second) continue;
+    size_t usn_hash = 0;
+
+    if (rv) {
+        // Even duplicates show the search got through on this interface
+        for (auto& s : ch.searches) {
+            if (s.target != rv.value().service_type) continue;
+            if (s.to.address().is_multicast() || s.to.address() == sender.address()) {
+                s.answered = true;
             }
-            _responses.push(r);
-            _cv.notify();
         }
+
+        // The same device may have already answered over multicast, the
+        // window is shortened either way.
+        if (_options.unicast_linger && is_unicast_target(sender.address())) {
+            auto deadline = now + *_options.unicast_linger;
+            if (deadline < _deadline) arm_timer(deadline);
+        }
+
+        auto usn = rv.value().usn;
+        usn_hash = boost::hash_range(usn.begin(), usn.end());
+
+        auto seen = _already_seen_usns.equal_range(usn_hash);
+        bool duplicate = std::any_of(seen.first, seen.second, [&] (auto& e) {
+            return e.second == usn;
+        });
+
+        if (duplicate) {
+            ++_counters.duplicates;
+            return;
+        }
+
+        if (_already_seen_usns.size() >= _options.max_unique_responses) {
+            ++_counters.overflow;
+            return;
+        }
+    }
+
+    if (_responses.full()) {
+        ++_counters.overflow;
+        return;
+    }
+
+    if (!rv) {
+        _responses.push_back(rv.error());
+        return;
+    }
+
+    // Remembered only now that it's queued, so that it isn't taken for a
+    // duplicate if it had to be dropped and is sent again
+    auto usn = rv.value().usn;
+    _already_seen_usns.emplace(usn_hash, std::string(usn.data(), usn.size()));
+
+    auto r = response::parse(rv.value());
+
+    if (r) {
+        r.value().interface_address = ch.bind_ip;
+        if (ch.bind_ip.is_v6()) {
+            add_zone(r.value().location, ch.bind_ip.to_v6().scope_id());
+        }
+        r.value().latency = now - _sent_at;
+    }
+    _responses.push_back(std::move(r));
+}
+
+void query::state_t::receive(channel& ch, net::yield_context y)
+{
+    udp_rx_batch batch(rx_batch_size, rx_buffer_size);
+
+    while (true) {
+        error_code ec;
+
+        // Backpressure: leave datagrams in the socket's buffer until the
+        // consumer catches up.
+        while (_responses.full() && !_rx_ec && !_stopped) {
+            _space_cv.wait(y[ec]);
+        }
+
+        if (!_rx_ec && !_stopped) {
+            ch.socket.async_wait(net::socket_base::wait_read, y[ec]);
+        }
+
+        if (!_rx_ec && _stopped) _rx_ec = net::error::operation_aborted;
+        if (_rx_ec) break;
+        if (ec) { _last_receive_ec = ec; break; }
+
+        // Drain whatever is queued on the socket before waiting again. No
+        // more is taken than the queue has room for, the rest is left on
+        // the socket rather than dropped.
+        do {
+            size_t n = batch.receive(ch.socket, _responses.reserve(), ec);
+            for (size_t i = 0; i < n; ++i) {
+                if (batch.data(i).empty()) continue;
+                on_datagram(ch, batch.sender(i), batch.data(i));
+            }
+        } while (!ec && !_responses.full());
+
         _cv.notify();
+
+        if (ec && ec != net::error::would_block) { _last_receive_ec = ec; break; }
+    }
+
+    // The query only fails on its own once none of the sockets is usable.
+    if (--_receivers == 0 && !_rx_ec) {
+        _rx_ec = _last_receive_ec;
+    }
+
+    _cv.notify();
+}
+
+result<void> query::state_t::start( const query::options& opts
+                                  , net::yield_context yield)
+{
+    error_code last_ec = make_error_code(sys::errc::address_not_available);
+
+    _sent_at = clock::now();
+    _options = opts;
+    _responses.set_capacity(std::max<size_t>(opts.max_queued_responses, 1));
+
+    std::vector<net::ip::address> bind_ips( opts.interfaces.begin()
+                                          , opts.interfaces.end());
+    bind_ips.insert( bind_ips.end()
+                   , opts.interfaces_v6.begin()
+                   , opts.interfaces_v6.end());
+
+    for (auto& bind_ip : bind_ips) {
+        _channels.push_back(channel{bind_ip, net::ip::udp::socket(_exec), {}, {}});
+        auto& ch = _channels.back();
+
+        auto r = open(ch);
+        if (r) {
+            prepare_searches(ch, opts.mx);
+            r = transmit(ch, yield);
+        }
+
+        if (!r) {
+            last_ec = r.error();
+            _channels.pop_back();
+        }
+    }
+
+    if (_channels.empty()) return last_ec;
+
+    arm_timer(_sent_at + opts.timeout);
+
+    net::spawn(_exec, [&, self = shared_from_this()] (auto y) {
+        retransmit(y);
     });
 
+    for (auto& ch : _channels) {
+        ++_receivers;
+        net::spawn(_exec, [&, self = shared_from_this()] (auto y) {
+            receive(ch, y);
+        });
+    }
+
     return success();
 }
 
+void query::state_t::arm_timer(clock::time_point deadline)
+{
+    _deadline = deadline;
+    _timer.expires_at(deadline);
+    _timer.async_wait([&, self = shared_from_this()] (error_code ec) {
+        // Stopped, or re-armed with an earlier deadline
+        if (ec == net::error::operation_aborted) return;
+        if (_rx_ec) return;
+        _rx_ec = net::error::timed_out;
+        _tx_timer.cancel();
+        close_sockets();
+    });
+}
+
 result<query::response, query::error::get_response>
 query::state_t::get_response(net::yield_context yield)
 {
@@ -149,82 +769,153 @@ query::state_t::get_response(net::yield_context yield)
     }
 
     auto r = std::move(_responses.front());
-    _responses.pop();
+    _responses.pop_front();
+    _space_cv.notify();
+
+    if (!r) return E{std::move(r.error())};
     return {std::move(r.value())};
 }
 
 /* static */
-result<query::response, query::error::parse>
-query::response::parse(string_view lines)
+result<query::response_view, query::error::parse>
+query::response_view::parse(string_view datagram)
 {
     using E = query::error::parse;
 
-    size_t line_n = 0;
+    auto lines = datagram;
+    string_view line;
 
-    response ret;
+    // Parse first line (e.g. "HTTP/1.x 200 OK")
+    if (!next_line(lines, line) || !str::istarts_with(line, "http")) {
+        return E{error::http_status_line{0}};
+    }
 
-    while (auto opt_line = str::consume_until(lines, {"\r\n", "\n"})) {
-        auto line = *opt_line;
+    auto space = line.find(' ');
+    if (space == string_view::npos) {
+        return E{error::http_status_line{line.size()}};
+    }
+    line.remove_prefix(space);
+    str::trim_space_prefix(line);
 
-        if (line_n++ == 0) {
-            // Parse first line (e.g. "HTTP/1.x 200 OK")
-            if (!str::istarts_with(line, "http")) {
-                return E{error::http_status_line{lines.to_string()}};
-            }
-            str::consume_until(line, " ");
-            str::trim_space_prefix(line);
-            auto result = str::consume_until(line, " ");
-            if (!result || *result != "200") {
-                return E{error::http_result{lines.to_string()}};
-            }
-            continue;
-        }
+    auto result = line.substr(0, line.find(' '));
+    if (result != "200") {
+        return E{error::http_result{offset_in(datagram, result)}};
+    }
 
-        auto opt_key = str::consume_until(line, ":");
-        if (!opt_key) break;
+    headers h;
+    parse_headers(lines, h);
 
-        auto key = *opt_key;
-        auto val = line;
-    
-        str::trim_space_prefix(val);
-        str::trim_space_suffix(val);
+    response_view ret;
 
-        if (boost::iequals(key, "USN")) {
-            ret.usn = val.to_string();
-            // USN: Unique Service Name
-            // https://tools.ietf.org/html/draft-cai-ssdp-v1-03#section-2.2.2
-            while (auto opt_token = str::consume_until(val, ":")) {
-                if (boost::iequals(*opt_token, "uuid")) {
-                    auto opt_uuid = str::consume_until(val, "::");
-                    if (opt_uuid) {
-                        ret.uuid = opt_uuid->to_string();
-                    } else {
-                        ret.uuid = val.to_string();
-                    }
-                }
-            }
-        } 
-        if (boost::iequals(key, "LOCATION")) {
-            auto location = url_t::parse(val.to_string());
-            if (!location) {
-                return E{error::location_url{lines.to_string()}};
-            }
-            ret.location = std::move(*location);
-        }
-        if (boost::iequals(key, "ST")) {
-            // Service Type
-            ret.service_type = val.to_string();
+    ret.datagram     = datagram;
+    ret.service_type = h.st;
+    ret.usn          = h.usn;
+    ret.uuid         = uuid_from_usn(h.usn);
+    ret.location     = h.location;
+    ret.server       = h.server;
+    ret.boot_id      = parse_u32(h.boot_id);
+    ret.config_id    = parse_u32(h.config_id);
+
+    if (!h.cache_control.empty()) {
+        ret.max_age = parse_max_age(h.cache_control);
+    }
+
+    return ret;
+}
+
+/* static */
+result<query::response, query::error::parse>
+query::response::parse(const response_view& v)
+{
+    using E = query::error::parse;
+
+    response ret;
+
+    if (!v.location.empty()) {
+        auto location = url_t::parse(v.location.to_string());
+        if (!location) {
+            return E{error::location_url{offset_in(v.datagram, v.location)}};
         }
+        ret.location = std::move(*location);
     }
 
+    ret.service_type = v.service_type.to_string();
+    ret.usn          = v.usn.to_string();
+    ret.uuid         = v.uuid.to_string();
+    ret.server       = v.server.to_string();
+    ret.max_age      = v.max_age;
+    ret.boot_id      = v.boot_id;
+    ret.config_id    = v.config_id;
+
     return {std::move(ret)};
 }
 
+/* static */
+result<query::response, query::error::parse>
+query::response::parse(string_view datagram)
+{
+    auto v = response_view::parse(datagram);
+    if (!v) return v.error();
+    return parse(v.value());
+}
+
+/* static */
+optional<notify> notify::parse(string_view datagram)
+{
+    string_view line;
+
+    // "NOTIFY * HTTP/1.1"
+    if (!next_line(datagram, line) || !str::istarts_with(line, "NOTIFY ")) {
+        return none;
+    }
+
+    headers h;
+    parse_headers(datagram, h);
+
+    notify ret;
+
+    if      (str::iequals(h.nts, "ssdp:alive"))  ret.sub_type = alive;
+    else if (str::iequals(h.nts, "ssdp:byebye")) ret.sub_type = byebye;
+    else if (str::iequals(h.nts, "ssdp:update")) ret.sub_type = update;
+    else return none;
+
+    auto uuid = uuid_from_usn(h.usn);
+    if (uuid.empty()) return none;
+
+    if (ret.sub_type != byebye) {
+        if (h.location.empty()) return none;
+        auto location = url_t::parse(h.location.to_string());
+        if (!location) return none;
+        ret.location = std::move(*location);
+    }
+
+    ret.notification_type = h.nt.to_string();
+    ret.usn               = h.usn.to_string();
+    ret.uuid              = uuid.to_string();
+    ret.boot_id           = parse_u32(h.boot_id);
+    ret.config_id         = parse_u32(h.config_id);
+
+    if (!h.cache_control.empty()) {
+        ret.max_age = parse_max_age(h.cache_control);
+    }
+
+    return ret;
+}
+
+void query::state_t::close_sockets() {
+    for (auto& ch : _channels) {
+        error_code ignored_ec;
+        ch.socket.close(ignored_ec);
+    }
+    // Wake receivers blocked on a full queue
+    _space_cv.notify();
+}
+
 void query::state_t::stop() {
     _stopped = true;
-    error_code ignored_ec;
-    _socket.close(ignored_ec);
+    close_sockets();
     _timer.cancel();
+    _tx_timer.cancel();
 }
 
 query::query(std::shared_ptr<state_t> state)
@@ -233,9 +924,27 @@ query::query(std::shared_ptr<state_t> state)
 
 /* static */
 result<query> query::start(net::any_io_executor exec, const net::ip::address_v4& bind_ip, net::yield_context yield)
+{
+    return start(exec, std::vector<net::ip::address_v4>{bind_ip}, yield);
+}
+
+/* static */
+result<query> query::start( net::any_io_executor exec
+                          , const std::vector<net::ip::address_v4>& bind_ips
+                          , net::yield_context yield)
+{
+    options opts;
+    opts.interfaces = bind_ips;
+    return start(exec, opts, yield);
+}
+
+/* static */
+result<query> query::start( net::any_io_executor exec
+                          , const options& opts
+                          , net::yield_context yield)
 {
     auto st = std::make_shared<state_t>(exec);
-    auto r = st->start(bind_ip, yield);
+    auto r = st->start(opts, yield);
     if (!r) return r.error();
     return query{std::move(st)};
 }
@@ -246,7 +955,15 @@ query::get_response(net::yield_context yield)
     return _state->get_response(yield);
 }
 
+query::counters query::stats() const
+{
+    if (!_state) return _stopped_stats;
+    return _state->_counters;
+}
+
 void query::stop() {
+    if (!_state) return;
+    _stopped_stats = _state->_counters;
     _state->stop();
     _state = nullptr;
 }
@@ -255,4 +972,181 @@ query::~query() {
     if (_state) stop();
 }
 
+//--------------------------------------------------------------------
+// Number of most recent latencies remembered per device
+static const size_t history_samples = 8;
+// Devices which miss this many rounds in a row are forgotten
+static const unsigned history_max_misses = 3;
+
+response_history::window response_history::begin_round()
+{
+    using namespace std::chrono;
+
+    const query::options defaults;
+    const window conservative{defaults.mx, defaults.timeout};
+
+    for (auto& d : _devices) d.second.seen = false;
+
+    if (_reset || _devices.empty()) {
+        _round = conservative;
+        return *_round;
+    }
+
+    duration worst{};
+
+    for (auto& d : _devices) {
+        for (auto s : d.second.samples) worst = std::max(worst, s);
+    }
+
+    // Twice the worst latency seen, plus some slack for scheduling.
+    auto timeout = duration_cast<milliseconds>(2 * worst) + milliseconds(50);
+    timeout = std::max(timeout, milliseconds(100));
+    timeout = std::min(timeout, conservative.timeout);
+
+    // UDA 1.1 requires MX to be at least 1
+    auto mx = duration_cast<seconds>(timeout + milliseconds(999));
+    mx = std::max(mx, seconds(1));
+    mx = std::min(mx, conservative.mx);
+
+    _round = window{mx, timeout};
+    return *_round;
+}
+
+void response_history::record(const std::string& usn, duration latency)
+{
+    auto& d = _devices[usn];
+
+    if (d.samples.size() == history_samples) {
+        d.samples.erase(d.samples.begin());
+    }
+
+    d.samples.push_back(latency);
+    d.misses = 0;
+    d.seen = true;
+}
+
+void response_history::end_round()
+{
+    if (!_round) return;
+
+    auto timeout = _round->timeout;
+    _round = none;
+
+    bool any_seen = false;
+
+    for (auto i = _devices.begin(); i != _devices.end();) {
+        auto& d = i->second;
+
+        if (d.seen) {
+            any_seen = true;
+            ++i;
+            continue;
+        }
+
+        if (++d.misses >= history_max_misses) {
+            i = _devices.erase(i);
+            continue;
+        }
+
+        // The device may just be slower than we've seen so far, its
+        // latency is at least the timeout which widens the next window.
+        if (d.samples.size() == history_samples) {
+            d.samples.erase(d.samples.begin());
+        }
+        d.samples.push_back(timeout);
+        ++i;
+    }
+
+    // Nothing answered, we may be on a different network now.
+    _reset = !any_seen;
+}
+
+//--------------------------------------------------------------------
+struct listener::state_t {
+    net::ip::udp::socket _socket;
+    std::vector<char> _rx;
+    bool _stopped = false;
+
+    state_t(net::any_io_executor exec)
+        : _socket(exec)
+        , _rx(32*1024)
+    {}
+};
+
+listener::listener(std::shared_ptr<state_t> state)
+    : _state(std::move(state))
+{}
+
+/* static */
+result<listener> listener::start( net::any_io_executor exec
+                                , const std::vector<net::ip::address_v4>& interfaces)
+{
+    using udp = net::ip::udp;
+    namespace mc = net::ip::multicast;
+
+    const net::ip::address_v4 group({239, 255, 255, 250});
+
+    auto st = std::make_shared<state_t>(exec);
+    auto& socket = st->_socket;
+
+    error_code ec;
+
+    socket.open(udp::v4(), ec);
+    if (ec) return ec;
+
+    socket.set_option(udp::socket::reuse_address(true), ec);
+    if (ec) return ec;
+
+    socket.bind(udp::endpoint(net::ip::address_v4::any(), 1900), ec);
+    if (ec) return ec;
+
+    if (interfaces.empty()) {
+        socket.set_option(mc::join_group(group), ec);
+        if (ec) return ec;
+    } else {
+        size_t joined = 0;
+
+        for (auto& iface : interfaces) {
+            socket.set_option(mc::join_group(group, iface), ec);
+            if (!ec) ++joined;
+        }
+
+        if (joined == 0) return ec;
+    }
+
+    return listener{std::move(st)};
+}
+
+result<notify> listener::next(net::yield_context yield)
+{
+    auto self = _state;
+
+    while (true) {
+        if (self->_stopped) return net::error::operation_aborted;
+
+        net::ip::udp::endpoint ep;
+        error_code ec;
+
+        size_t size = self->_socket.async_receive_from
+            (net::buffer(self->_rx), ep, yield[ec]);
+
+        if (self->_stopped) return net::error::operation_aborted;
+        if (ec) return ec;
+
+        auto n = notify::parse(string_view(self->_rx.data(), size));
+        if (n) return std::move(*n);
+    }
+}
+
+void listener::stop() {
+    _state->_stopped = true;
+    error_code ignored_ec;
+    _state->_socket.close(ignored_ec);
+    _state = nullptr;
+}
+
+listener::~listener() {
+    if (_state) stop();
+}
+
 }} // namespaces upnp::ssdp
@@ -20,7 +20,14 @@ consume_endpoint(string_view& s)
         return none;
     }
 
-    auto addr = parse_address(s.substr(0, pos));
+    auto host = s.substr(0, pos);
+
+    // IPv6 literals are enclosed in brackets (e.g. "[fe80::1%2]:5000")
+    if (host.starts_with("[") && host.ends_with("]")) {
+        host = host.substr(1, host.size() - 2);
+    }
+
+    auto addr = parse_address(host);
 
     if (!addr) return none;
 
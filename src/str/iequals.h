@@ -0,0 +1,27 @@
+#pragma once
+
+#include <upnp/third_party/string_view.h>
+
+namespace upnp { namespace str {
+
+inline
+char ascii_to_lower(char c) {
+    return ('A' <= c && c <= 'Z') ? char(c - 'A' + 'a') : c;
+}
+
+// Case insensitive comparison of ASCII strings. Unlike boost::iequals it
+// doesn't consult the locale, which makes it cheap enough for matching
+// protocol tokens such as header names.
+inline
+bool iequals(string_view a, string_view b)
+{
+    if (a.size() != b.size()) return false;
+
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (ascii_to_lower(a[i]) != ascii_to_lower(b[i])) return false;
+    }
+
+    return true;
+}
+
+}} // namespaces
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <boost/asio/ip/udp.hpp>
+#include <upnp/third_party/error_code.h>
+#include <upnp/third_party/net.h>
+#include <upnp/third_party/string_view.h>
+#include <algorithm>
+#include <vector>
+
+#if defined(__linux__)
+#  include <sys/socket.h>
+#  include <cerrno>
+#endif
+
+namespace upnp {
+
+// A fixed set of receive buffers which get filled with as many datagrams as
+// are queued on a non-blocking UDP socket. On Linux a single `recvmmsg`
+// call drains up to `count` datagrams, elsewhere they are read one by one.
+// The buffers are reused by each call, so views returned by `data` are
+// only valid until the next `receive`.
+class udp_rx_batch {
+public:
+    udp_rx_batch(size_t count, size_t buffer_size)
+        : _buffer_size(buffer_size)
+        , _storage(count * buffer_size)
+        , _sizes(count)
+        , _senders(count)
+#if defined(__linux__)
+        , _msgs(count)
+        , _iovs(count)
+#endif
+    {}
+
+    udp_rx_batch(const udp_rx_batch&)            = delete;
+    udp_rx_batch& operator=(const udp_rx_batch&) = delete;
+
+    size_t capacity() const { return _sizes.size(); }
+
+    // Receives up to `max` datagrams (and no more than `capacity()`), and
+    // returns how many. The rest stay queued on the socket. Once the socket
+    // has nothing more to read, `ec` is set to `net::error::would_block`.
+    // Datagrams which didn't fit into a buffer are returned empty.
+    size_t receive(net::ip::udp::socket& socket, size_t max, error_code& ec)
+    {
+        ec = error_code();
+
+        max = std::min(max, capacity());
+
+#if defined(__linux__)
+        for (size_t i = 0; i < max; ++i) {
+            _iovs[i].iov_base = buffer(i);
+            _iovs[i].iov_len  = _buffer_size;
+
+            auto& hdr = _msgs[i].msg_hdr;
+            hdr = msghdr();
+            hdr.msg_name    = _senders[i].data();
+            hdr.msg_namelen = _senders[i].capacity();
+            hdr.msg_iov     = &_iovs[i];
+            hdr.msg_iovlen  = 1;
+        }
+
+        int n = ::recvmmsg( socket.native_handle()
+                          , _msgs.data()
+                          , max
+                          , MSG_DONTWAIT
+                          , nullptr);
+
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                ec = net::error::would_block;
+            } else {
+                ec = error_code(errno, boost::system::system_category());
+            }
+            return 0;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            auto& hdr = _msgs[i].msg_hdr;
+            _senders[i].resize(hdr.msg_namelen);
+            _sizes[i] = (hdr.msg_flags & MSG_TRUNC) ? 0 : _msgs[i].msg_len;
+        }
+
+        return n;
+#else
+        size_t n = 0;
+
+        for (; n < max; ++n) {
+            net::mutable_buffer b(buffer(n), _buffer_size);
+            _sizes[n] = socket.receive_from(b, _senders[n], 0, ec);
+            if (ec == net::error::message_size) {
+                _sizes[n] = 0;
+                ec = error_code();
+            }
+            if (ec) break;
+        }
+
+        if (n == max) ec = error_code();
+        return n;
+#endif
+    }
+
+    string_view data(size_t i) const {
+        return string_view(_storage.data() + i * _buffer_size, _sizes[i]);
+    }
+
+    const net::ip::udp::endpoint& sender(size_t i) const {
+        return _senders[i];
+    }
+
+private:
+    char* buffer(size_t i) {
+        return _storage.data() + i * _buffer_size;
+    }
+
+private:
+    size_t _buffer_size;
+    std::vector<char> _storage;
+    std::vector<size_t> _sizes;
+    std::vector<net::ip::udp::endpoint> _senders;
+#if defined(__linux__)
+    std::vector<mmsghdr> _msgs;
+    std::vector<iovec> _iovs;
+#endif
+};
+
+} // namespace upnp
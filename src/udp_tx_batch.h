@@ -0,0 +1,109 @@
+#pragma once
+
+#include <boost/asio/ip/udp.hpp>
+#include <upnp/third_party/error_code.h>
+#include <upnp/third_party/net.h>
+#include <upnp/third_party/string_view.h>
+#include <vector>
+
+#if defined(__linux__)
+#  include <sys/socket.h>
+#  include <cerrno>
+#endif
+
+namespace upnp {
+
+// Datagrams queued up to be sent from a non-blocking UDP socket at once. On
+// Linux they go out with as few `sendmmsg` calls as the socket's buffer
+// allows, elsewhere one by one. The queued data isn't copied and must stay
+// alive until `send` returns.
+class udp_tx_batch {
+public:
+    void push(string_view data, const net::ip::udp::endpoint& to) {
+        _datagrams.push_back({data, to});
+    }
+
+    size_t size() const { return _datagrams.size(); }
+
+    // Number of datagrams which failed with an error other than
+    // `would_block`.
+    size_t failures() const { return _failures; }
+
+    void clear() { _datagrams.clear(); _sent = 0; _failures = 0; }
+
+    // Sends the queued datagrams which haven't been sent yet. Returns once
+    // all are sent or when the socket can't take more, in which case `ec`
+    // is set to `net::error::would_block` and the next call continues
+    // where this one stopped. A datagram which fails for any other reason
+    // is skipped and the error is reported once the rest has been sent.
+    void send(net::ip::udp::socket& socket, error_code& ec)
+    {
+        ec = error_code();
+        error_code last_ec;
+
+        while (_sent < _datagrams.size()) {
+#if defined(__linux__)
+            size_t count = _datagrams.size() - _sent;
+
+            _msgs.resize(count);
+            _iovs.resize(count);
+
+            for (size_t i = 0; i < count; ++i) {
+                auto& d = _datagrams[_sent + i];
+
+                _iovs[i].iov_base = const_cast<char*>(d.data.data());
+                _iovs[i].iov_len  = d.data.size();
+
+                auto& hdr = _msgs[i].msg_hdr;
+                hdr = msghdr();
+                hdr.msg_name    = const_cast<void*>(static_cast<const void*>(d.to.data()));
+                hdr.msg_namelen = d.to.size();
+                hdr.msg_iov     = &_iovs[i];
+                hdr.msg_iovlen  = 1;
+            }
+
+            int n = ::sendmmsg( socket.native_handle()
+                              , _msgs.data()
+                              , _msgs.size()
+                              , MSG_DONTWAIT);
+
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    ec = net::error::would_block;
+                    return;
+                }
+                // Only the first datagram of the batch failed
+                last_ec = error_code(errno, boost::system::system_category());
+                ++_failures;
+                n = 1;
+            }
+
+            _sent += n;
+#else
+            auto& d = _datagrams[_sent];
+            socket.send_to(net::buffer(d.data.data(), d.data.size()), d.to, 0, ec);
+            if (ec == net::error::would_block) return;
+            if (ec) { last_ec = ec; ++_failures; }
+            ++_sent;
+#endif
+        }
+
+        ec = last_ec;
+    }
+
+private:
+    struct datagram {
+        string_view data;
+        net::ip::udp::endpoint to;
+    };
+
+    std::vector<datagram> _datagrams;
+    size_t _sent = 0;
+    size_t _failures = 0;
+#if defined(__linux__)
+    std::vector<mmsghdr> _msgs;
+    std::vector<iovec> _iovs;
+#endif
+};
+
+} // namespace upnp
@@ -23,7 +23,27 @@ optional<url_t> url_t::parse(std::string url_) {
         ret._userinfo = *userinfo;
     }
 
-    if (auto host = consume_until(state, ":")) {
+    if (state.starts_with("[")) {
+        // IPv6 literal, e.g. "http://[fe80::1]:5000/". The brackets are
+        // kept as part of the host so that `host_and_port` stays valid
+        // for the HTTP Host header.
+        auto end = state.find(']');
+        if (end == string_view::npos) return none;
+
+        ret._host = state.substr(0, end + 1);
+        state.remove_prefix(end + 1);
+
+        if (state.starts_with(":")) {
+            state.remove_prefix(1);
+
+            if (auto port = consume_until(state, "/", false)) {
+                ret._port = *port;
+            } else {
+                ret._port = state;
+                state = state.substr(state.size());
+            }
+        }
+    } else if (auto host = consume_until(state, ":")) {
         ret._host = *host;
 
         if (auto port = consume_until(state, "/", false)) {
@@ -57,6 +77,14 @@ optional<url_t> url_t::parse(std::string url_) {
     return ret;
 }
 
+std::string url_t::host_header() const {
+    auto hp = host_and_port();
+    auto zone = _host.find('%');
+    if (!_host.starts_with("[") || zone == string_view::npos) return hp.to_string();
+    return _host.substr(0, zone).to_string()
+         + hp.substr(_host.size() - 1).to_string();
+}
+
 optional<uint16_t> url_t::numeric_port() const {
     if (_port.empty()) return none;
     auto p = _port;
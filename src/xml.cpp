@@ -1,91 +1,382 @@
 #include "xml.h"
-#include "str/parse_address.h"
-#include "str/consume_until.h"
+#include "str/trim.h"
 
 namespace upnp { namespace xml {
 
-using tree = boost::property_tree::ptree;
-
-optional<tree> parse(const std::string& xml_str) {
-    try {
-        namespace ios = boost::iostreams;
-        namespace pt = boost::property_tree;
-        // https://stackoverflow.com/a/37712933/273348
-        ios::stream<ios::array_source> stream(xml_str.c_str(), xml_str.size());
-        pt::ptree tree;
-        pt::read_xml(stream, tree);
-        return tree;
-    } catch (std::exception& e) {
-        return none;
+static void append_utf8(unsigned long cp, std::string& out)
+{
+    if (cp < 0x80) {
+        out += char(cp);
+    } else if (cp < 0x800) {
+        out += char(0xC0 | (cp >> 6));
+        out += char(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        out += char(0xE0 | (cp >> 12));
+        out += char(0x80 | ((cp >> 6) & 0x3F));
+        out += char(0x80 | (cp & 0x3F));
+    } else {
+        out += char(0xF0 | (cp >> 18));
+        out += char(0x80 | ((cp >> 12) & 0x3F));
+        out += char(0x80 | ((cp >> 6) & 0x3F));
+        out += char(0x80 | (cp & 0x3F));
+    }
+}
+
+bool decode(string_view in, std::string& out)
+{
+    while (!in.empty()) {
+        auto amp = in.find('&');
+        out.append(in.data(), std::min(amp, in.size()));
+        if (amp == string_view::npos) break;
+        in.remove_prefix(amp + 1);
+
+        auto semi = in.find(';');
+        if (semi == string_view::npos) return false;
+        auto e = in.substr(0, semi);
+        in.remove_prefix(semi + 1);
+
+        if      (e == "amp")  out += '&';
+        else if (e == "lt")   out += '<';
+        else if (e == "gt")   out += '>';
+        else if (e == "quot") out += '"';
+        else if (e == "apos") out += '\'';
+        else if (e.size() > 1 && e[0] == '#') {
+            bool hex = e[1] == 'x' || e[1] == 'X';
+            auto digits = e.substr(hex ? 2 : 1);
+            if (digits.empty() || digits.size() > 8) return false;
+
+            unsigned long cp = 0;
+            for (char c : digits) {
+                int d;
+                if      (c >= '0' && c <= '9')        d = c - '0';
+                else if (hex && c >= 'a' && c <= 'f') d = c - 'a' + 10;
+                else if (hex && c >= 'A' && c <= 'F') d = c - 'A' + 10;
+                else return false;
+                cp = cp * (hex ? 16 : 10) + d;
+            }
+            if (cp > 0x10FFFF) return false;
+            append_utf8(cp, out);
+        }
+        else return false;
+    }
+
+    return true;
+}
+
+static string_view local_part(string_view qname)
+{
+    auto colon = qname.find(':');
+    if (colon == string_view::npos) return qname;
+    return qname.substr(colon + 1);
+}
+
+bool name_matches(string_view pattern, string_view qname)
+{
+    if (pattern.starts_with("*:")) {
+        return local_part(qname) == pattern.substr(2);
+    }
+    return pattern == qname;
+}
+
+static bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+reader::reader(string_view document)
+    : _doc(document)
+{}
+
+string_view reader::prefix() const
+{
+    auto colon = _name.find(':');
+    if (colon == string_view::npos) return {};
+    return _name.substr(0, colon);
+}
+
+string_view reader::local_name() const
+{
+    return local_part(_name);
+}
+
+string_view reader::namespace_uri() const
+{
+    auto p = prefix();
+    for (auto i = _namespaces.rbegin(); i != _namespaces.rend(); ++i) {
+        if (i->prefix == p) return i->uri;
     }
+    return {};
 }
 
-optional<net::ip::address>
-get_address(tree t, const char* tag) {
-    auto s = t.get_optional<std::string>(tag);
-    if (!s) return none;
-    return str::parse_address(*s);
+bool reader::skip_past(string_view terminator)
+{
+    auto e = _doc.find(terminator, _pos);
+    if (e == string_view::npos) return false;
+    _pos = e + terminator.size();
+    return true;
+}
+
+reader::event reader::next()
+{
+    if (_failed) return event::error;
+
+    if (_pop_pending) {
+        _namespaces.resize(_namespaces.size() - _open.back().namespaces);
+        _open.pop_back();
+        _pop_pending = false;
+    }
+
+    if (_pending_end) {
+        _pending_end = false;
+        _name = _open.back().name;
+        _event_depth = int(_open.size());
+        _pop_pending = true;
+        return event::end;
+    }
+
+    while (true) {
+        if (_pos >= _doc.size()) {
+            if (!_open.empty()) return fail();
+            return event::done;
+        }
+
+        if (_doc[_pos] != '<') {
+            auto lt = std::min(_doc.find('<', _pos), _doc.size());
+            auto raw = _doc.substr(_pos, lt - _pos);
+            _pos = lt;
+
+            // Whitespace around the root element
+            if (_open.empty()) continue;
+
+            if (raw.find('&') != string_view::npos) {
+                _decoded.clear();
+                if (!decode(raw, _decoded)) return fail();
+                _text = _decoded;
+            } else {
+                _text = raw;
+            }
+
+            _event_depth = int(_open.size());
+            return event::text;
+        }
+
+        auto rest = _doc.substr(_pos);
+
+        if (rest.starts_with("<!--")) {
+            _pos += 4;
+            if (!skip_past("-->")) return fail();
+            continue;
+        }
+
+        if (rest.starts_with("<![CDATA[")) {
+            _pos += 9;
+            auto e = _doc.find("]]>", _pos);
+            if (e == string_view::npos || _open.empty()) return fail();
+            _text = _doc.substr(_pos, e - _pos);
+            _pos = e + 3;
+            _event_depth = int(_open.size());
+            return event::text;
+        }
+
+        if (rest.starts_with("<?")) {
+            _pos += 2;
+            if (!skip_past("?>")) return fail();
+            continue;
+        }
+
+        if (rest.starts_with("<!")) {
+            // DOCTYPE, possibly with an internal subset in brackets
+            int brackets = 0;
+            for (_pos += 2; _pos < _doc.size(); ++_pos) {
+                char c = _doc[_pos];
+                if      (c == '[') ++brackets;
+                else if (c == ']') --brackets;
+                else if (c == '>' && brackets <= 0) break;
+            }
+            if (_pos == _doc.size()) return fail();
+            ++_pos;
+            continue;
+        }
+
+        if (rest.starts_with("</")) return end_tag();
+
+        return start_tag();
+    }
 }
 
-// This does the same as ptree::get_child_optional, but allows us to ignore
-// the XML namespace prefix (e.g. the 's' in <s:Envelope/>) by using
-// '*' in the query instead of the namespace name. e.g.:
-//
-// optional<string> os = get<string>(tree, "*:Envelope.*:Body");
-const tree*
-get_child(const tree& tr, string_view path)
+reader::event reader::start_tag()
 {
-    const tree* t = &tr;
-
-    static const auto name_split = [] (string_view s)
-        -> std::pair<string_view, string_view>
-    {
-        auto o = str::consume_until(s, ":");
-        if (!o) return std::make_pair("", s);
-        return std::make_pair(*o, s);
+    auto size = _doc.size();
+
+    auto skip_space = [&] {
+        while (_pos < size && is_space(_doc[_pos])) ++_pos;
     };
 
-    while (t) {
-        if (path.empty()) return t;
+    auto name_end = [&] (char c) {
+        return is_space(c) || c == '>' || c == '/' || c == '=';
+    };
+
+    size_t b = ++_pos;
+    while (_pos < size && !name_end(_doc[_pos])) ++_pos;
+    if (_pos == b) return fail();
+
+    _name = _doc.substr(b, _pos - b);
+
+    size_t namespaces = 0;
+    bool self_closing = false;
+
+    while (true) {
+        skip_space();
+        if (_pos >= size) return fail();
+
+        char c = _doc[_pos];
+
+        if (c == '>') { ++_pos; break; }
+
+        if (c == '/') {
+            if (_pos + 1 >= size || _doc[_pos + 1] != '>') return fail();
+            _pos += 2;
+            self_closing = true;
+            break;
+        }
+
+        size_t nb = _pos;
+        while (_pos < size && !name_end(_doc[_pos])) ++_pos;
+        auto attr = _doc.substr(nb, _pos - nb);
+        if (attr.empty()) return fail();
+
+        skip_space();
+        if (_pos >= size || _doc[_pos] != '=') return fail();
+        ++_pos;
+        skip_space();
+        if (_pos >= size) return fail();
+
+        char quote = _doc[_pos];
+        if (quote != '"' && quote != '\'') return fail();
+
+        auto e = _doc.find(quote, ++_pos);
+        if (e == string_view::npos) return fail();
+        auto value = _doc.substr(_pos, e - _pos);
+        _pos = e + 1;
+
+        if (attr == "xmlns") {
+            _namespaces.push_back({string_view(), value});
+            ++namespaces;
+        } else if (attr.starts_with("xmlns:")) {
+            _namespaces.push_back({attr.substr(6), value});
+            ++namespaces;
+        }
+    }
+
+    _open.push_back({_name, namespaces});
+    _event_depth = int(_open.size());
+    _pending_end = self_closing;
+    return event::start;
+}
+
+reader::event reader::end_tag()
+{
+    auto size = _doc.size();
+
+    size_t b = _pos += 2;
+    while (_pos < size && !is_space(_doc[_pos]) && _doc[_pos] != '>') ++_pos;
+    auto name = _doc.substr(b, _pos - b);
+
+    while (_pos < size && is_space(_doc[_pos])) ++_pos;
+    if (_pos >= size || _doc[_pos] != '>') return fail();
+    ++_pos;
+
+    if (_open.empty() || _open.back().name != name) return fail();
+
+    _name = name;
+    _event_depth = int(_open.size());
+    _pop_pending = true;
+    return event::end;
+}
+
+bool reader::next_child(int parent_depth)
+{
+    while (true) {
+        switch (next()) {
+            case event::start:
+                if (_event_depth == parent_depth + 1) return true;
+                break;
+            case event::end:
+                if (_event_depth == parent_depth) return false;
+                break;
+            case event::text:
+                break;
+            case event::done:
+            case event::error:
+                return false;
+        }
+    }
+}
+
+optional<string_view> reader::read_text()
+{
+    int d = _event_depth;
 
-        auto op = str::consume_until(path, ".");
-        string_view p;
-        if (op) { p = *op; } else { p = path; path = ""; }
-        auto ns = name_split(p);
+    // A single piece of text is returned without copying it
+    string_view first;
+    size_t pieces = 0;
 
-        auto t_ = t;
-        t = nullptr;
+    while (true) {
+        auto e = next();
 
-        if (ns.first == "*") {
-            for (auto& e : *t_) {
-                auto name = e.first;
-                auto ns_ = name_split(name);
-                if (ns.second == ns_.second) {
-                    t = &e.second;
-                    break;
+        if (e == event::text && _event_depth == d) {
+            if (pieces == 0) {
+                if (_text.data() == _decoded.data()) {
+                    _collected.assign(_text.data(), _text.size());
+                    first = _collected;
+                } else {
+                    first = _text;
                 }
-            }
-        } else {
-            for (auto& e : *t_) {
-                if (e.first == p) {
-                    t = &e.second;
-                    break;
+            } else {
+                if (pieces == 1 && first.data() != _collected.data()) {
+                    _collected.assign(first.data(), first.size());
                 }
+                _collected.append(_text.data(), _text.size());
             }
+            ++pieces;
+        }
+        else if (e == event::end && _event_depth == d) {
+            break;
+        }
+        else if (e == event::done || e == event::error) {
+            return boost::none;
         }
     }
 
-    return t;
+    string_view ret = pieces > 1 ? string_view(_collected) : first;
+    str::trim_space_prefix(ret);
+    str::trim_space_suffix(ret);
+    return ret;
 }
 
-}} // namespace upnp::xml
+bool find(reader& r, string_view path)
+{
+    int depth = r.depth();
 
-namespace boost { namespace property_tree {
+    while (!path.empty()) {
+        auto dot = path.find('.');
+        auto component = path.substr(0, dot);
+        path = dot == string_view::npos ? string_view() : path.substr(dot + 1);
+
+        bool found = false;
+
+        while (r.next_child(depth)) {
+            if (name_matches(component, r.name())) {
+                found = true;
+                break;
+            }
+        }
+
+        if (!found) return false;
+        depth = r.depth();
+    }
 
-inline
-std::ostream& operator<<(std::ostream& os, const ptree& xml) {
-    write_xml(os, xml);
-    return os;
+    return true;
 }
 
-}} // boost::property_tree namespace
+}} // upnp::xml namespace
@@ -2,62 +2,117 @@
 
 #include <upnp/third_party/optional.h>
 #include <upnp/third_party/string_view.h>
-#include <upnp/third_party/net.h>
-#include <boost/asio/ip/address.hpp>
-
-#if defined(BOOST_PROPERTY_TREE_RAPIDXML_STATIC_POOL_SIZE) \
-    && BOOST_PROPERTY_TREE_RAPIDXML_STATIC_POOL_SIZE > 512
-#  error "The xml parser in Boost.PropertyTree reserves too big static pool "
-         "size causing problems when used with coroutines in Boost.Asio. "
-         "For more information have a look at this SO post "
-         "https://stackoverflow.com/a/45473980/273348"
-#else
-#  define BOOST_PROPERTY_TREE_RAPIDXML_STATIC_POOL_SIZE 512
-#endif
-
-#include <boost/property_tree/ptree.hpp>
-#include <boost/property_tree/xml_parser.hpp>
-#include <boost/iostreams/stream.hpp>
-#include "str/consume_number.h"
+#include <boost/container/small_vector.hpp>
+#include <string>
 
 namespace upnp { namespace xml {
 
-using tree = boost::property_tree::ptree;
+// Decodes the predefined entities and character references in `in` and
+// appends the result to `out`. Returns false on unknown or malformed
+// references.
+bool decode(string_view in, std::string& out);
 
-optional<tree> parse(const std::string& xml_str);
+// "*:Body" matches "Body" with any or no namespace prefix, anything else
+// must equal the qualified name.
+bool name_matches(string_view pattern, string_view qname);
 
-template<class Num>
-inline
-optional<Num> get_num(tree t, const char* tag) {
-    auto s = t.get_optional<std::string>(tag);
-    if (!s) return none;
-    string_view sv(*s);
-    return str::consume_number<Num>(sv);
-}
+// A non-validating pull parser over a whole document held in memory. It
+// doesn't allocate per node: names and text are views into the document,
+// only text with entity references is decoded into a buffer owned by the
+// reader. Comments, processing instructions and the DOCTYPE are skipped.
+//
+// Malformed input (mismatched or unterminated tags, bad references, ...)
+// ends the parse with `event::error` rather than throwing.
+//
+// Used for device descriptions, which are fetched whole. SOAP responses
+// are scanned as they stream in by `soap::field_collector` instead.
+class reader {
+public:
+    enum class event { start, end, text, done, error };
 
-optional<net::ip::address> get_address(tree t, const char* tag);
+    explicit reader(string_view document);
 
-// This does the same as ptree::get_child_optional, but allows us to ignore
-// the XML namespace prefix (e.g. the 's' in <s:Envelope/>) by using
-// '*' in the query instead of the namespace name. e.g.:
-//
-// optional<string> os = get<string>(tree, "*:Envelope.*:Body");
-const tree* get_child(const tree& tr, string_view path);
+    reader(const reader&) = delete;
+    reader& operator=(const reader&) = delete;
 
-template<class T>
-inline
-optional<T> get(const tree& tr, string_view path)
-{
-    auto t = get_child(tr, path);
-    if (!t) return boost::none;
-    return t->get_value_optional<T>();
-}
+    event next();
 
+    // Qualified name of the element started or ended by the last event and
+    // its parts.
+    string_view name()       const { return _name; }
+    string_view prefix()     const;
+    string_view local_name() const;
 
-}} // upnp::xml namespace
+    // Namespace URI of the element started or ended by the last event, as
+    // declared by the xmlns attributes in scope. Empty if none.
+    string_view namespace_uri() const;
+
+    // Text of the last `event::text`, with entities decoded. CDATA sections
+    // are reported verbatim. Valid until the next call to `next`.
+    string_view text() const { return _text; }
+
+    // Nesting level of the element started or ended by the last event, the
+    // root being at 1. For text, that of the element it's in.
+    int depth() const { return _event_depth; }
+
+    bool failed() const { return _failed; }
+
+    // Moves to the start of the next child of the element at `parent_depth`
+    // which must be open. Children which weren't fully read are skipped.
+    // Returns false once the parent ends or on error.
+    bool next_child(int parent_depth);
+
+    // Text of the element just started, up to and including its end, with
+    // surrounding whitespace trimmed. Text of nested elements is skipped.
+    // Valid until the next call to `next`.
+    optional<string_view> read_text();
+
+private:
+    event fail() { _failed = true; return event::error; }
 
-namespace boost { namespace property_tree {
+    event start_tag();
+    event end_tag();
+    bool skip_past(string_view terminator);
 
-std::ostream& operator<<(std::ostream& os, const ptree& xml);
+    struct open_element {
+        string_view name;
+        // Number of `_namespaces` entries declared by this element
+        size_t namespaces;
+    };
 
-}} // boost::property_tree namespace
+    struct ns_decl {
+        string_view prefix;
+        string_view uri;
+    };
+
+private:
+    string_view _doc;
+    size_t _pos = 0;
+
+    string_view _name;
+    string_view _text;
+    std::string _decoded;
+    std::string _collected;
+
+    boost::container::small_vector<open_element, 16> _open;
+    boost::container::small_vector<ns_decl, 8> _namespaces;
+
+    // Closing a self-closing element is reported on the next call
+    bool _pending_end = false;
+    // The element whose end was just reported is still in `_open`, so
+    // that its namespace declarations are in scope for `namespace_uri`.
+    bool _pop_pending = false;
+    int _event_depth = 0;
+    bool _failed = false;
+};
+
+// Moves `r` to the start of the element at `path`, relative to the element
+// just started or to the document if nothing was read yet. Components are
+// separated by '.' and matched with `name_matches`, e.g.
+//
+//     find(r, "*:Envelope.*:Body.*:GetListOfPortMappingsResponse")
+//
+// Returns false if there is no such element or on error.
+bool find(reader& r, string_view path);
+
+}} // upnp::xml namespace
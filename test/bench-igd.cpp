@@ -0,0 +1,309 @@
+// Drives many concurrent `igd` operations against a `fake_igd` on loopback
+// and reports throughput and latency percentiles.
+//
+//     bench-igd [--action get-external|get-generic|list|list-all|table|add-delete|batch]
+//               [--ops N] [--concurrency N] [--discoveries N]
+//               [--latency MS] [--jitter MS] [--drop P] [--table-size N]
+//               [--keep-alive MAX_IDLE] [--batch N] [--in-flight N]
+//               [--page-size N] [--prefetch 0|1] [--process-ms MS]
+//               [--churn-ms MS]
+//
+// With `--action batch` each op adds `--batch` mappings with
+// `add_port_mappings` and deletes them again. With `--action list-all` each
+// op pages through the whole table with `list_port_mappings`, spending
+// `--process-ms` on each page worth of entries as if handling them. With
+// `--action table` each op reads the whole table with
+// `get_port_mapping_table`, keeping `--in-flight` requests in flight.
+//
+// With `--churn-ms` a mapping is added or removed that often while the ops
+// run, so that reads of the whole table see it change.
+//
+// Exits with a non-zero status if any discovery or op failed.
+
+#include "fake_igd.h"
+#include <upnp.h>
+#include <boost/asio/steady_timer.hpp>
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <string>
+
+using namespace std;
+using namespace std::chrono;
+namespace net = upnp::net;
+
+struct config {
+    string action = "get-external";
+    size_t ops = 10000;
+    size_t concurrency = 64;
+    size_t discoveries = 20;
+    // Idle connections kept per IGD, zero disables keep-alive
+    size_t keep_alive = 0;
+    size_t batch = 32;
+    size_t in_flight = 8;
+    upnp::igd::listing_options listing;
+    milliseconds process = milliseconds(0);
+    milliseconds churn = milliseconds(0);
+    upnp::test::fake_igd::options igd;
+};
+
+static bool parse_args(int argc, char** argv, config& cfg)
+{
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (i + 1 == argc) return false;
+        string v = argv[++i];
+
+        try {
+            if      (arg == "--action")      cfg.action = v;
+            else if (arg == "--ops")         cfg.ops = stoul(v);
+            else if (arg == "--concurrency") cfg.concurrency = stoul(v);
+            else if (arg == "--discoveries") cfg.discoveries = stoul(v);
+            else if (arg == "--latency")     cfg.igd.latency = milliseconds(stoul(v));
+            else if (arg == "--jitter")      cfg.igd.jitter = milliseconds(stoul(v));
+            else if (arg == "--drop")        cfg.igd.drop_probability = stod(v);
+            else if (arg == "--table-size")  cfg.igd.table_size = stoul(v);
+            else if (arg == "--keep-alive")  cfg.keep_alive = stoul(v);
+            else if (arg == "--batch")       cfg.batch = stoul(v);
+            else if (arg == "--in-flight")   cfg.in_flight = stoul(v);
+            else if (arg == "--page-size") {
+                auto n = stoul(v);
+                if (n == 0 || n > numeric_limits<uint16_t>::max()) return false;
+                cfg.listing.page_size = uint16_t(n);
+            }
+            else if (arg == "--prefetch")    cfg.listing.prefetch = stoul(v) != 0;
+            else if (arg == "--process-ms")  cfg.process = milliseconds(stoul(v));
+            else if (arg == "--churn-ms")    cfg.churn = milliseconds(stoul(v));
+            else return false;
+        } catch (const exception&) {
+            return false;
+        }
+    }
+
+    return cfg.concurrency > 0;
+}
+
+static void report( const string& name
+                  , vector<steady_clock::duration> latencies
+                  , size_t errors
+                  , steady_clock::duration elapsed)
+{
+    auto ms = [] (steady_clock::duration d) {
+        return duration_cast<microseconds>(d).count() / 1000.;
+    };
+
+    sort(latencies.begin(), latencies.end());
+
+    auto percentile = [&] (double p) {
+        if (latencies.empty()) return 0.;
+        size_t i = size_t(ceil(p * latencies.size()));
+        return ms(latencies[min(max<size_t>(i, 1), latencies.size()) - 1]);
+    };
+
+    double secs = duration_cast<microseconds>(elapsed).count() / 1e6;
+
+    cout << fixed << setprecision(2)
+         << name << ": " << latencies.size() << " ops"
+         << " (" << errors << " errors)"
+         << " in " << secs << "s, "
+         << (secs > 0 ? latencies.size() / secs : 0) << " ops/s,"
+         << " p50 " << percentile(.5) << "ms"
+         << " p99 " << percentile(.99) << "ms"
+         << " p999 " << percentile(.999) << "ms"
+         << "\n";
+}
+
+static bool run_op( const config& cfg
+                  , const net::any_io_executor& exec
+                  , upnp::igd& igd
+                  , size_t worker
+                  , size_t op
+                  , net::yield_context yield)
+{
+    if (cfg.action == "get-external") {
+        return bool(igd.get_external_address(yield));
+    }
+    if (cfg.action == "get-generic") {
+        auto size = max<size_t>(cfg.igd.table_size, 1);
+        return bool(igd.get_generic_port_mapping_entry(op % size, yield));
+    }
+    if (cfg.action == "list") {
+        return bool(igd.get_list_of_port_mappings(upnp::igd::tcp, 0, 65535, 100, yield));
+    }
+    if (cfg.action == "list-all") {
+        auto pager = igd.list_port_mappings(upnp::igd::tcp, cfg.listing);
+        size_t n = 0;
+        while (true) {
+            auto r = pager.next(yield);
+            if (!r) return false;
+            if (!r.value()) break;
+            if (++n % cfg.listing.page_size == 0 && cfg.process.count()) {
+                net::steady_timer t(exec);
+                t.expires_after(cfg.process);
+                upnp::error_code ec;
+                t.async_wait(yield[ec]);
+            }
+        }
+        // Nothing lost or repeated between pages
+        return n == cfg.igd.table_size;
+    }
+    if (cfg.action == "table") {
+        upnp::igd::table_options opts;
+        opts.window = cfg.in_flight;
+        auto r = igd.get_port_mapping_table(opts, yield);
+        if (!r) return false;
+        // Churn adds at most one mapping
+        auto n = r.value().size();
+        return n == cfg.igd.table_size || (cfg.churn.count() && n == cfg.igd.table_size + 1);
+    }
+    if (cfg.action == "add-delete") {
+        // Each worker owns a port, adding on even ops and deleting on odd
+        uint16_t port = 20000 + worker;
+        if (op % 2 == 0) {
+            return bool(igd.add_port_mapping( upnp::igd::udp, port, port
+                                            , "bench-igd", seconds(60), yield));
+        }
+        return bool(igd.delete_port_mapping(upnp::igd::udp, port, yield));
+    }
+    if (cfg.action == "batch") {
+        vector<upnp::igd::mapping_spec> add;
+        vector<upnp::igd::mapping_key> del;
+
+        for (size_t i = 0; i < cfg.batch; ++i) {
+            uint16_t port = 20000 + worker * cfg.batch + i;
+            add.push_back({upnp::igd::tcp, port, port, "bench-igd", seconds(60)});
+            del.push_back({upnp::igd::tcp, port});
+        }
+
+        auto ok = [] (const auto& rs) {
+            return all_of(rs.begin(), rs.end(), [] (const auto& r) { return bool(r); });
+        };
+
+        return ok(igd.add_port_mappings(add, cfg.in_flight, yield))
+            && ok(igd.delete_port_mappings(del, cfg.in_flight, yield));
+    }
+    return false;
+}
+
+int main(int argc, char** argv)
+{
+    config cfg;
+
+    if (!parse_args(argc, argv, cfg)) {
+        cerr << "Usage: " << argv[0]
+             << " [--action get-external|get-generic|list|list-all|table|add-delete|batch]"
+                " [--ops N] [--concurrency N] [--discoveries N]"
+                " [--latency MS] [--jitter MS] [--drop P] [--table-size N]"
+                " [--keep-alive MAX_IDLE] [--batch N] [--in-flight N]"
+                " [--page-size N] [--prefetch 0|1] [--process-ms MS]"
+                " [--churn-ms MS]\n";
+        return 1;
+    }
+
+    net::io_context ctx;
+
+    auto fake = upnp::test::fake_igd::start(ctx.get_executor(), cfg.igd);
+    if (!fake) {
+        cerr << "Failed to start fake IGD: " << fake.error().message() << "\n";
+        return 1;
+    }
+
+    int exit_code = 0;
+
+    net::spawn(ctx, [&] (net::yield_context yield) {
+        vector<upnp::igd> igds;
+        vector<steady_clock::duration> latencies;
+        size_t errors = 0;
+
+        auto start = steady_clock::now();
+
+        for (size_t i = 0; i < max<size_t>(cfg.discoveries, 1); ++i) {
+            auto t = steady_clock::now();
+            auto found = upnp::test::discover_fake(ctx.get_executor(), fake.value(), yield);
+
+            if (found.empty()) {
+                ++errors;
+                continue;
+            }
+
+            latencies.push_back(steady_clock::now() - t);
+            igds = move(found);
+        }
+
+        report("discover", latencies, errors, steady_clock::now() - start);
+        if (errors) exit_code = 1;
+
+        if (igds.empty()) {
+            cerr << "Fake IGD wasn't discovered\n";
+            exit_code = 1;
+            fake.value().stop();
+            return;
+        }
+
+        auto& igd = igds.front();
+
+        if (cfg.keep_alive) {
+            upnp::igd::keep_alive_options ka;
+            ka.max_idle_connections = cfg.keep_alive;
+            igd.enable_keep_alive(ka);
+        }
+
+        latencies.clear();
+        latencies.reserve(cfg.ops);
+        errors = 0;
+
+        size_t next_op = 0;
+        // Workers, and the churning coroutine if any
+        size_t running = cfg.concurrency + (cfg.churn.count() ? 1 : 0);
+
+        // Keeps this coroutine, and so everything the workers refer to,
+        // alive until the last of them is done.
+        net::steady_timer done(ctx);
+        done.expires_at(steady_clock::time_point::max());
+
+        if (cfg.churn.count()) {
+            net::spawn(ctx, [&] (net::yield_context y) {
+                upnp::test::churn_table( ctx.get_executor(), igd, cfg.churn
+                                       , [&] { return running > 1; }, y);
+                if (--running == 0) done.cancel();
+            });
+        }
+
+        start = steady_clock::now();
+
+        for (size_t w = 0; w < cfg.concurrency; ++w) {
+            net::spawn(ctx, [&, w] (net::yield_context y) {
+                for (size_t op = 0; next_op < cfg.ops; ++op) {
+                    ++next_op;
+                    auto t = steady_clock::now();
+                    if (run_op(cfg, ctx.get_executor(), igd, w, op, y)) {
+                        latencies.push_back(steady_clock::now() - t);
+                    } else {
+                        ++errors;
+                    }
+                }
+                if (--running == 0) done.cancel();
+            });
+        }
+
+        upnp::error_code ec;
+        done.async_wait(yield[ec]);
+
+        report(cfg.action, latencies, errors, steady_clock::now() - start);
+        if (errors) exit_code = 1;
+
+        auto st = fake.value().stats();
+        cout << "fake igd: " << st.connections << " connections, "
+             << st.requests << " requests, "
+             << st.dropped << " dropped, "
+             << st.faults << " faults\n";
+
+        fake.value().stop();
+    });
+
+    ctx.run();
+
+    return exit_code;
+}
@@ -0,0 +1,723 @@
+#include "fake_igd.h"
+#include <boost/asio/steady_timer.hpp>
+#include <boost/beast/core/flat_buffer.hpp>
+#include <boost/beast/core/tcp_stream.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/range/begin.hpp> // needed by spawn
+#include <boost/range/end.hpp> // needed by spawn
+#include <boost/asio/spawn.hpp>
+#include <map>
+#include <random>
+#include <set>
+#include <cstring>
+#include <sstream>
+
+namespace upnp { namespace test {
+
+namespace beast = boost::beast;
+namespace http  = beast::http;
+using tcp = net::ip::tcp;
+using udp = net::ip::udp;
+
+static const char* igd_urn = "urn:schemas-upnp-org:device:InternetGatewayDevice:2";
+static const char* ip_conn_urn = "urn:schemas-upnp-org:service:WANIPConnection:2";
+static const char* description_path = "/rootDesc.xml";
+static const char* control_path = "/ctl/IPConn";
+
+static std::string xml_escape(const std::string& s)
+{
+    std::string ret;
+    ret.reserve(s.size());
+
+    for (char c : s) {
+        switch (c) {
+            case '&':  ret += "&amp;";  break;
+            case '<':  ret += "&lt;";   break;
+            case '>':  ret += "&gt;";   break;
+            case '"':  ret += "&quot;"; break;
+            case '\'': ret += "&apos;"; break;
+            default:   ret += c;
+        }
+    }
+
+    return ret;
+}
+
+// Only the predefined entities, which is all clients send.
+static std::string xml_unescape(const std::string& s)
+{
+    static const std::pair<const char*, char> entities[] = {
+        {"&amp;", '&'}, {"&lt;", '<'}, {"&gt;", '>'}, {"&quot;", '"'}, {"&apos;", '\''}
+    };
+
+    std::string ret;
+    ret.reserve(s.size());
+
+    for (size_t i = 0; i < s.size(); ++i) {
+        if (s[i] == '&') {
+            bool found = false;
+            for (auto& e : entities) {
+                if (s.compare(i, strlen(e.first), e.first) != 0) continue;
+                ret += e.second;
+                i += strlen(e.first) - 1;
+                found = true;
+                break;
+            }
+            if (found) continue;
+        }
+        ret += s[i];
+    }
+
+    return ret;
+}
+
+// Text of the first <name>...</name> element in `body`. Enough for the
+// flat argument lists of SOAP requests.
+static std::string argument(const std::string& body, const std::string& name)
+{
+    auto open = "<" + name + ">";
+    auto b = body.find(open);
+    if (b == std::string::npos) return {};
+    b += open.size();
+    auto e = body.find("</" + name + ">", b);
+    if (e == std::string::npos) return {};
+    return xml_unescape(body.substr(b, e - b));
+}
+
+// Content of the `action` element in a SOAP request body, where its
+// arguments are. False if there is no such element or it's empty.
+static bool action_arguments( const std::string& body
+                            , const std::string& action
+                            , std::string& args)
+{
+    auto open = "<u:" + action;
+    auto b = body.find(open);
+    if (b == std::string::npos) return false;
+    b = body.find('>', b + open.size());
+    if (b == std::string::npos || body[b - 1] == '/') return false;
+    auto e = body.find("</u:" + action + ">", ++b);
+    if (e == std::string::npos) return false;
+    args = body.substr(b, e - b);
+    return true;
+}
+
+static unsigned long numeric_argument(const std::string& body, const std::string& name)
+{
+    try {
+        return std::stoul(argument(body, name));
+    } catch (const std::exception&) {
+        return 0;
+    }
+}
+
+// Value of a header in a SSDP datagram, matched case insensitively.
+static std::string ssdp_header(const std::string& datagram, const std::string& name)
+{
+    std::istringstream ss(datagram);
+    std::string line;
+
+    while (std::getline(ss, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        auto colon = line.find(':');
+        if (colon != name.size()) continue;
+
+        bool same = std::equal(name.begin(), name.end(), line.begin(),
+            [] (char a, char b) { return std::tolower(a) == std::tolower(b); });
+        if (!same) continue;
+
+        auto v = line.substr(colon + 1);
+        v.erase(0, v.find_first_not_of(' '));
+        return v;
+    }
+
+    return {};
+}
+
+struct fake_igd::state_t : std::enable_shared_from_this<state_t> {
+    struct mapping {
+        uint16_t int_port;
+        std::string int_client;
+        std::string description;
+        uint32_t lease_duration;
+        bool enabled;
+    };
+
+    // Keyed by protocol and external port
+    using table = std::map<std::pair<std::string, uint16_t>, mapping>;
+
+    net::any_io_executor _exec;
+    options _options;
+    udp::socket _ssdp;
+    tcp::acceptor _acceptor;
+    table _table;
+    std::set<beast::tcp_stream*> _connections;
+    std::minstd_rand _rng;
+    counters _counters;
+    bool _stopped = false;
+
+    state_t(net::any_io_executor exec, options opts)
+        : _exec(exec)
+        , _options(std::move(opts))
+        , _ssdp(exec)
+        , _acceptor(exec)
+        , _rng(std::random_device{}())
+    {}
+
+    result<void> start();
+
+    std::string location() const;
+    std::string description() const;
+
+    size_t _lose_responses = 0;
+    size_t _fail_requests = 0;
+
+    bool roll(double probability);
+    bool roll_drop() { return roll(_options.drop_probability); }
+    bool roll_lost_response();
+    void wait_delay(net::yield_context);
+
+    void ssdp_loop(net::yield_context);
+    void accept_loop(net::yield_context);
+    void serve(tcp::socket, net::yield_context);
+
+    http::response<http::string_body>
+    handle(const http::request<http::string_body>&);
+
+    http::response<http::string_body>
+    handle_action(const std::string& action, const std::string& request);
+
+    void stop();
+};
+
+result<void> fake_igd::state_t::start()
+{
+    error_code ec;
+    auto loopback = net::ip::address_v4::loopback();
+
+    _ssdp.open(udp::v4(), ec);
+    if (!ec) _ssdp.bind(udp::endpoint(loopback, 0), ec);
+    if (ec) return ec;
+
+    _acceptor.open(tcp::v4(), ec);
+    if (!ec) _acceptor.set_option(tcp::acceptor::reuse_address(true), ec);
+    if (!ec) _acceptor.bind(tcp::endpoint(loopback, 0), ec);
+    if (!ec) _acceptor.listen(net::socket_base::max_listen_connections, ec);
+    if (ec) return ec;
+
+    for (size_t i = 0; i < _options.table_size; ++i) {
+        uint16_t port = 10000 + i;
+        _table[{"TCP", port}] = mapping{ port
+                                       , "192.168.1.100"
+                                       , "fake mapping " + std::to_string(i)
+                                       , 3600
+                                       , true };
+    }
+
+    return success();
+}
+
+std::string fake_igd::state_t::location() const
+{
+    error_code ec;
+    auto ep = _acceptor.local_endpoint(ec);
+    return "http://" + ep.address().to_string() + ":"
+        + std::to_string(ep.port()) + description_path;
+}
+
+std::string fake_igd::state_t::description() const
+{
+    auto& uuid = _options.uuid;
+
+    std::stringstream ss;
+    ss << "<?xml version=\"1.0\"?>"
+          "<root xmlns=\"urn:schemas-upnp-org:device-1-0\">"
+          "<specVersion><major>1</major><minor>1</minor></specVersion>"
+          "<device>"
+          "<deviceType>" << igd_urn << "</deviceType>"
+          "<friendlyName>" << xml_escape(_options.friendly_name) << "</friendlyName>"
+          "<UDN>uuid:" << uuid << "</UDN>"
+          "<deviceList><device>"
+          "<deviceType>urn:schemas-upnp-org:device:WANDevice:2</deviceType>"
+          "<friendlyName>" << xml_escape(_options.friendly_name) << "</friendlyName>"
+          "<UDN>uuid:" << uuid << "-wan</UDN>"
+          "<deviceList><device>"
+          "<deviceType>urn:schemas-upnp-org:device:WANConnectionDevice:2</deviceType>"
+          "<friendlyName>WANConnectionDevice</friendlyName>"
+          "<UDN>uuid:" << uuid << "-wanconn</UDN>"
+          "<serviceList><service>"
+          "<serviceType>" << ip_conn_urn << "</serviceType>"
+          "<serviceId>urn:upnp-org:serviceId:WANIPConn1</serviceId>"
+          "<controlURL>" << control_path << "</controlURL>"
+          "<eventSubURL>/evt/IPConn</eventSubURL>"
+          "<SCPDURL>/WANIPCn.xml</SCPDURL>"
+          "</service></serviceList>"
+          "</device></deviceList>"
+          "</device></deviceList>"
+          "</device>"
+          "</root>";
+    return ss.str();
+}
+
+bool fake_igd::state_t::roll(double probability)
+{
+    if (probability <= 0) return false;
+    std::uniform_real_distribution<double> d(0, 1);
+    return d(_rng) < probability;
+}
+
+bool fake_igd::state_t::roll_lost_response()
+{
+    if (_lose_responses) {
+        --_lose_responses;
+        return true;
+    }
+    return roll(_options.lost_response_probability);
+}
+
+void fake_igd::state_t::wait_delay(net::yield_context yield)
+{
+    auto delay = _options.latency;
+
+    if (_options.jitter.count() > 0) {
+        std::uniform_int_distribution<long> d(0, _options.jitter.count());
+        delay += std::chrono::milliseconds(d(_rng));
+    }
+
+    if (delay.count() == 0) return;
+
+    net::steady_timer timer(_exec);
+    timer.expires_after(delay);
+    error_code ec;
+    timer.async_wait(yield[ec]);
+}
+
+void fake_igd::state_t::ssdp_loop(net::yield_context yield)
+{
+    std::vector<char> rx(8 * 1024);
+
+    while (!_stopped) {
+        udp::endpoint from;
+        error_code ec;
+        auto size = _ssdp.async_receive_from(net::buffer(rx), from, yield[ec]);
+        if (ec || _stopped) break;
+
+        std::string datagram(rx.data(), size);
+        if (datagram.compare(0, 8, "M-SEARCH") != 0) continue;
+
+        auto st = ssdp_header(datagram, "ST");
+
+        if (st == "ssdp:all" || st == "upnp:rootdevice") {
+            st = igd_urn;
+        } else if (st.compare(0, 44, "urn:schemas-upnp-org:device:InternetGatewayD") != 0) {
+            continue;
+        }
+
+        ++_counters.searches;
+
+        if (roll_drop()) {
+            ++_counters.dropped;
+            continue;
+        }
+
+        net::spawn(_exec, [self = shared_from_this(), st, from] (net::yield_context y) {
+            self->wait_delay(y);
+            if (self->_stopped) return;
+
+            std::string rs = "HTTP/1.1 200 OK\r\n"
+                             "CACHE-CONTROL: max-age=1800\r\n"
+                             "EXT:\r\n"
+                             "LOCATION: " + self->location() + "\r\n"
+                             "SERVER: cpp-upnp/1.0 UPnP/1.1 fake-igd/1.0\r\n"
+                             "ST: " + st + "\r\n"
+                             "USN: uuid:" + self->_options.uuid + "::" + st + "\r\n"
+                             "\r\n";
+
+            error_code ec;
+            self->_ssdp.async_send_to(net::buffer(rs), from, y[ec]);
+        });
+    }
+}
+
+void fake_igd::state_t::accept_loop(net::yield_context yield)
+{
+    while (!_stopped) {
+        tcp::socket socket(_exec);
+        error_code ec;
+        _acceptor.async_accept(socket, yield[ec]);
+        if (_stopped) break;
+        if (ec) continue;
+
+        ++_counters.connections;
+
+        net::spawn(_exec, [ self = shared_from_this()
+                          , s = std::make_shared<tcp::socket>(std::move(socket))
+                          ] (net::yield_context y) {
+            self->serve(std::move(*s), y);
+        });
+    }
+}
+
+void fake_igd::state_t::serve(tcp::socket socket, net::yield_context yield)
+{
+    beast::tcp_stream stream(std::move(socket));
+    beast::flat_buffer buffer;
+
+    _connections.insert(&stream);
+
+    while (!_stopped) {
+        http::request<http::string_body> rq;
+        error_code ec;
+
+        http::async_read(stream, buffer, rq, yield[ec]);
+        if (ec || _stopped) break;
+
+        ++_counters.requests;
+
+        if (roll_drop()) {
+            ++_counters.dropped;
+            break;
+        }
+
+        wait_delay(yield);
+        if (_stopped) break;
+
+        auto rs = handle(rq);
+
+        if (roll_lost_response()) {
+            ++_counters.dropped;
+            break;
+        }
+
+        rs.keep_alive(rq.keep_alive());
+        rs.prepare_payload();
+
+        http::async_write(stream, rs, yield[ec]);
+        if (ec || !rq.keep_alive()) break;
+    }
+
+    _connections.erase(&stream);
+
+    error_code ignored_ec;
+    stream.socket().shutdown(tcp::socket::shutdown_both, ignored_ec);
+    stream.socket().close(ignored_ec);
+}
+
+http::response<http::string_body>
+fake_igd::state_t::handle(const http::request<http::string_body>& rq)
+{
+    http::response<http::string_body> rs{http::status::ok, rq.version()};
+    rs.set(http::field::server, "cpp-upnp/1.0 UPnP/1.1 fake-igd/1.0");
+    rs.set(http::field::content_type, "text/xml; charset=\"utf-8\"");
+
+    if (rq.method() == http::verb::get && rq.target() == description_path) {
+        rs.body() = description();
+        return rs;
+    }
+
+    if (rq.method() == http::verb::post && rq.target() == control_path) {
+        // SOAPAction: "urn:schemas-upnp-org:service:WANIPConnection:2#AddPortMapping"
+        auto action = rq["SOAPAction"].to_string();
+        auto hash = action.find('#');
+        action = hash == std::string::npos ? "" : action.substr(hash + 1);
+        if (!action.empty() && action.back() == '"') action.pop_back();
+
+        auto ars = handle_action(action, rq.body());
+        ars.version(rq.version());
+        ars.set(http::field::server, "cpp-upnp/1.0 UPnP/1.1 fake-igd/1.0");
+        ars.set(http::field::content_type, "text/xml; charset=\"utf-8\"");
+        return ars;
+    }
+
+    rs.result(http::status::not_found);
+    return rs;
+}
+
+static std::string envelope(const std::string& body)
+{
+    return "<?xml version=\"1.0\"?>"
+           "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+                       "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+           "<s:Body>" + body + "</s:Body>"
+           "</s:Envelope>";
+}
+
+static http::response<http::string_body>
+action_response(const std::string& action, const std::string& arguments)
+{
+    http::response<http::string_body> rs{http::status::ok, 11};
+    rs.body() = envelope( "<u:" + action + "Response xmlns:u=\"" + ip_conn_urn + "\">"
+                        + arguments
+                        + "</u:" + action + "Response>");
+    return rs;
+}
+
+// UPnP errors are reported as SOAP faults (UDA 1.1, section 3.2.2)
+static http::response<http::string_body>
+fault(unsigned code, const std::string& description)
+{
+    http::response<http::string_body> rs{http::status::internal_server_error, 11};
+    rs.body() = envelope(
+        "<s:Fault>"
+        "<faultcode>s:Client</faultcode>"
+        "<faultstring>UPnPError</faultstring>"
+        "<detail>"
+        "<UPnPError xmlns=\"urn:schemas-upnp-org:control-1-0\">"
+        "<errorCode>" + std::to_string(code) + "</errorCode>"
+        "<errorDescription>" + description + "</errorDescription>"
+        "</UPnPError>"
+        "</detail>"
+        "</s:Fault>");
+    return rs;
+}
+
+http::response<http::string_body>
+fake_igd::state_t::handle_action(const std::string& action, const std::string& request)
+{
+    std::string body;
+
+    if (!action_arguments(request, action, body)) {
+        ++_counters.faults;
+        return fault(402, "Invalid Args");
+    }
+
+    auto proto = argument(body, "NewProtocol");
+    uint16_t ext_port = numeric_argument(body, "NewExternalPort");
+
+    if (_fail_requests) {
+        --_fail_requests;
+        ++_counters.faults;
+        return fault(501, "ActionFailed");
+    }
+
+    if (action == "GetExternalIPAddress") {
+        return action_response(action,
+            "<NewExternalIPAddress>" + _options.external_address.to_string()
+            + "</NewExternalIPAddress>");
+    }
+
+    if (action == "AddPortMapping") {
+        auto key = std::make_pair(proto, ext_port);
+
+        if (proto != "TCP" && proto != "UDP") {
+            ++_counters.faults;
+            return fault(402, "Invalid Args");
+        }
+
+        if (!_table.count(key) && _table.size() >= _options.max_table_size) {
+            ++_counters.faults;
+            return fault(728, "NoPortMapsAvailable");
+        }
+
+        _table[key] = mapping{ uint16_t(numeric_argument(body, "NewInternalPort"))
+                             , argument(body, "NewInternalClient")
+                             , argument(body, "NewPortMappingDescription")
+                             , uint32_t(numeric_argument(body, "NewLeaseDuration"))
+                             , argument(body, "NewEnabled") != "0" };
+
+        return action_response(action, "");
+    }
+
+    if (action == "DeletePortMapping") {
+        if (_table.erase(std::make_pair(proto, ext_port)) == 0) {
+            ++_counters.faults;
+            return fault(714, "NoSuchEntryInArray");
+        }
+        return action_response(action, "");
+    }
+
+    if (action == "GetGenericPortMappingEntry") {
+        auto index = numeric_argument(body, "NewPortMappingIndex");
+
+        if (index >= _table.size()) {
+            ++_counters.faults;
+            return fault(713, "SpecifiedArrayIndexInvalid");
+        }
+
+        auto i = std::next(_table.begin(), index);
+        auto& m = i->second;
+
+        std::stringstream ss;
+        ss << "<NewRemoteHost></NewRemoteHost>"
+              "<NewExternalPort>" << i->first.second << "</NewExternalPort>"
+              "<NewProtocol>" << i->first.first << "</NewProtocol>"
+              "<NewInternalPort>" << m.int_port << "</NewInternalPort>"
+              "<NewInternalClient>" << xml_escape(m.int_client) << "</NewInternalClient>"
+              "<NewEnabled>" << (m.enabled ? 1 : 0) << "</NewEnabled>"
+              "<NewPortMappingDescription>" << xml_escape(m.description) << "</NewPortMappingDescription>"
+              "<NewLeaseDuration>" << m.lease_duration << "</NewLeaseDuration>";
+
+        return action_response(action, ss.str());
+    }
+
+    if (action == "GetListOfPortMappings") {
+        auto start = numeric_argument(body, "NewStartPort");
+        auto end   = numeric_argument(body, "NewEndPort");
+        auto count = numeric_argument(body, "NewNumberOfPorts");
+
+        std::stringstream ss;
+        ss << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+              "<p:PortMappingList xmlns:p=\"urn:schemas-upnp-org:gw:WANIPConnection\">";
+
+        size_t n = 0;
+
+        for (auto i = _table.lower_bound({proto, start}); i != _table.end(); ++i) {
+            if (i->first.first != proto || i->first.second > end) break;
+            if (count && n == count) break;
+            if (n == _options.max_listing_size) break;
+            ++n;
+
+            auto& m = i->second;
+
+            ss << "<p:PortMappingEntry>"
+                  "<p:NewRemoteHost></p:NewRemoteHost>"
+                  "<p:NewExternalPort>" << i->first.second << "</p:NewExternalPort>"
+                  "<p:NewProtocol>" << i->first.first << "</p:NewProtocol>"
+                  "<p:NewInternalPort>" << m.int_port << "</p:NewInternalPort>"
+                  "<p:NewInternalClient>" << xml_escape(m.int_client) << "</p:NewInternalClient>"
+                  "<p:NewEnabled>" << (m.enabled ? 1 : 0) << "</p:NewEnabled>"
+                  "<p:NewDescription>" << xml_escape(m.description) << "</p:NewDescription>"
+                  "<p:NewLeaseTime>" << m.lease_duration << "</p:NewLeaseTime>"
+                  "</p:PortMappingEntry>";
+        }
+
+        ss << "</p:PortMappingList>";
+
+        if (n == 0) {
+            ++_counters.faults;
+            return fault(730, "PortMappingNotFound");
+        }
+
+        return action_response(action,
+            "<NewPortListing>" + xml_escape(ss.str()) + "</NewPortListing>");
+    }
+
+    ++_counters.faults;
+    return fault(401, "Invalid Action");
+}
+
+void fake_igd::state_t::stop()
+{
+    _stopped = true;
+
+    error_code ignored_ec;
+    _ssdp.close(ignored_ec);
+    _acceptor.close(ignored_ec);
+
+    for (auto c : _connections) c->socket().close(ignored_ec);
+}
+
+fake_igd::fake_igd(std::shared_ptr<state_t> state)
+    : _state(std::move(state))
+{}
+
+/* static */
+result<fake_igd> fake_igd::start(net::any_io_executor exec, options opts)
+{
+    auto st = std::make_shared<state_t>(exec, std::move(opts));
+
+    auto r = st->start();
+    if (!r) return r.error();
+
+    net::spawn(exec, [st] (net::yield_context y) { st->ssdp_loop(y); });
+    net::spawn(exec, [st] (net::yield_context y) { st->accept_loop(y); });
+
+    return fake_igd{std::move(st)};
+}
+
+net::ip::udp::endpoint fake_igd::ssdp_endpoint() const
+{
+    error_code ec;
+    return _state->_ssdp.local_endpoint(ec);
+}
+
+std::string fake_igd::description_url() const
+{
+    return _state->location();
+}
+
+const std::string& fake_igd::friendly_name() const
+{
+    return _state->_options.friendly_name;
+}
+
+size_t fake_igd::table_size() const
+{
+    return _state->_table.size();
+}
+
+void fake_igd::lose_responses(size_t n)
+{
+    _state->_lose_responses = n;
+}
+
+void fake_igd::fail_requests(size_t n)
+{
+    _state->_fail_requests = n;
+}
+
+fake_igd::counters fake_igd::stats() const
+{
+    return _state->_counters;
+}
+
+void fake_igd::stop()
+{
+    _state->stop();
+    _state = nullptr;
+}
+
+fake_igd::~fake_igd()
+{
+    if (_state) stop();
+}
+
+igd::discover_options discover_options_for(const fake_igd& fake)
+{
+    igd::discover_options opts;
+    opts.search_default_gateway = false;
+    opts.unicast_targets.push_back(fake.ssdp_endpoint());
+    opts.gateway_linger = std::chrono::milliseconds(0);
+    return opts;
+}
+
+std::vector<igd> discover_fake( net::any_io_executor exec
+                              , const fake_igd& fake
+                              , net::yield_context yield)
+{
+    std::vector<igd> ret;
+
+    auto r = igd::discover(exec, discover_options_for(fake), yield);
+    if (!r) return ret;
+
+    for (auto& i : r.value()) {
+        if (i.friendly_name() == fake.friendly_name()) ret.push_back(std::move(i));
+    }
+
+    return ret;
+}
+
+size_t churn_table( net::any_io_executor exec
+                  , igd& igd
+                  , std::chrono::milliseconds interval
+                  , std::function<bool()> keep_going
+                  , net::yield_context yield)
+{
+    net::steady_timer timer(exec);
+    size_t churned = 0;
+
+    while (keep_going()) {
+        timer.expires_after(interval);
+        error_code ec;
+        timer.async_wait(yield[ec]);
+
+        if (churned++ % 2 == 0) {
+            (void) igd.add_port_mapping(igd::tcp, 1, 1, "churn", std::chrono::seconds(60), yield);
+        } else {
+            (void) igd.delete_port_mapping(igd::tcp, 1, yield);
+        }
+    }
+
+    return churned;
+}
+
+}} // namespaces
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <upnp/igd.h>
+#include <upnp/third_party/error_code.h>
+#include <upnp/third_party/net.h>
+#include <upnp/third_party/result.h>
+#include <boost/asio/ip/address_v4.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/ip/udp.hpp>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace upnp { namespace test {
+
+// An IGD:2 stand-in listening on loopback, for tests and benchmarks which
+// can't rely on a real router. It answers unicast M-SEARCH, serves its root
+// device description and implements the WANIPConnection:2 actions used by
+// `igd` on top of an in-memory port mapping table.
+//
+// Latency, jitter and dropped connections can be injected to emulate slow
+// or flaky devices.
+class fake_igd {
+public:
+    struct options {
+        // Each SSDP response and each HTTP response is delayed by `latency`
+        // plus a uniformly distributed random time of up to `jitter`.
+        std::chrono::milliseconds latency{0};
+        std::chrono::milliseconds jitter{0};
+
+        // Probability of ignoring a M-SEARCH or of closing a connection
+        // instead of responding to a request.
+        double drop_probability = 0;
+
+        // Probability of handling a request but closing the connection
+        // instead of sending the response, as if the response was lost.
+        double lost_response_probability = 0;
+
+        // Number of port mappings the table starts with.
+        size_t table_size = 0;
+
+        // Largest number of entries the table can hold, AddPortMapping
+        // fails with error 728 (NoPortMapsAvailable) beyond it.
+        size_t max_table_size = 65535;
+
+        // Most entries a GetListOfPortMappings response holds, whatever
+        // NewNumberOfPorts asks for. Many devices cap it like this.
+        size_t max_listing_size = 65535;
+
+        net::ip::address_v4 external_address = net::ip::make_address_v4("203.0.113.1");
+
+        std::string uuid = "fa4ed16d-0000-4000-8000-00000000c0de";
+        std::string friendly_name = "cpp-upnp fake IGD";
+    };
+
+    struct counters {
+        size_t searches = 0;
+        size_t connections = 0;
+        size_t requests = 0;
+        size_t dropped = 0;
+        size_t faults = 0;
+    };
+
+public:
+    fake_igd(const fake_igd&)            = delete;
+    fake_igd& operator=(const fake_igd&) = delete;
+
+    fake_igd(fake_igd&&)            = default;
+    fake_igd& operator=(fake_igd&&) = default;
+
+    static result<fake_igd> start(net::any_io_executor, options);
+
+    // Where to send unicast M-SEARCH.
+    net::ip::udp::endpoint ssdp_endpoint() const;
+
+    // LOCATION of the root device description.
+    std::string description_url() const;
+
+    const std::string& friendly_name() const;
+
+    size_t table_size() const;
+
+    // Handle the next `n` requests but lose their responses.
+    void lose_responses(size_t n);
+
+    // Answer the next `n` actions with error 501 (ActionFailed).
+    void fail_requests(size_t n);
+
+    counters stats() const;
+
+    void stop();
+
+    ~fake_igd();
+
+private:
+    struct state_t;
+    fake_igd(std::shared_ptr<state_t>);
+
+private:
+    std::shared_ptr<state_t> _state;
+};
+
+// Options for `igd::discover` which search `fake` with unicast M-SEARCH, and
+// not the default gateway, and finish as soon as it answers.
+igd::discover_options discover_options_for(const fake_igd&);
+
+// Discovers IGDs sending unicast M-SEARCH to `fake` only, and returns those
+// which are `fake`. Multicast may find real gateways too. Empty if discovery
+// failed or `fake` wasn't among those found.
+std::vector<igd> discover_fake(net::any_io_executor, const fake_igd&, net::yield_context);
+
+// Alternately adds and deletes a mapping of TCP port 1 through `igd`, every
+// `interval` for as long as `keep_going()` returns true, and returns how
+// many times it did. Port 1 sorts before the preset mappings, so every
+// index of the table moves each time.
+size_t churn_table( net::any_io_executor
+                  , igd&
+                  , std::chrono::milliseconds interval
+                  , std::function<bool()> keep_going
+                  , net::yield_context);
+
+}} // namespaces
@@ -0,0 +1,148 @@
+#define BOOST_TEST_MODULE description_cache
+#include <boost/test/included/unit_test.hpp>
+
+#include <upnp/description_cache.h>
+#include <cstdio>
+#include <fstream>
+
+using namespace std;
+using namespace std::chrono;
+using upnp::description_cache;
+using upnp::url_t;
+
+static const string cache_path = "test-description-cache.tmp";
+
+static string root_xml(const string& udn)
+{
+    return "<?xml version=\"1.0\"?>"
+           "<root xmlns=\"urn:schemas-upnp-org:device-1-0\">"
+           "<specVersion><major>1</major><minor>0</minor></specVersion>"
+           "<device>"
+             "<deviceType>urn:schemas-upnp-org:device:InternetGatewayDevice:1</deviceType>"
+             "<friendlyName>Router " + udn + "</friendlyName>"
+             "<UDN>" + udn + "</UDN>"
+           "</device>"
+           "</root>";
+}
+
+static url_t location(const string& s)
+{
+    auto u = url_t::parse(s);
+    BOOST_REQUIRE(u);
+    return *u;
+}
+
+static const string igd_st = "::urn:schemas-upnp-org:device:InternetGatewayDevice:1";
+static const string wan_st = "::urn:schemas-upnp-org:service:WANIPConnection:1";
+
+static void write_file(const string& content)
+{
+    ofstream f(cache_path, ios::binary | ios::trunc);
+    f << content;
+}
+
+// A cache file holding one entry with `size` as its xml size field
+static string cache_file(const string& size, const string& xml)
+{
+    auto expires = duration_cast<seconds>(
+            (description_cache::clock::now() + hours(1)).time_since_epoch());
+
+    return "cpp-upnp-description-cache 1\n"
+           "uuid:a" + igd_st + "\n"
+           "uuid:a\n"
+           "http://192.168.1.1:5000/rootDesc.xml\n"
+         + to_string(expires.count()) + "\n"
+         + size + "\n"
+         + xml + "\n";
+}
+
+BOOST_AUTO_TEST_CASE(test_save_load_round_trip) {
+    description_cache cache;
+
+    auto loc_a = location("http://192.168.1.1:5000/rootDesc.xml");
+    auto loc_b = location("http://192.168.1.2:49152/desc.xml");
+
+    BOOST_REQUIRE(cache.insert("uuid:a" + igd_st, "uuid:a", loc_a, seconds(600), root_xml("uuid:a")));
+    BOOST_REQUIRE(cache.insert("uuid:b" + igd_st, "uuid:b", loc_b, seconds(600), root_xml("uuid:b")));
+    // Expired, so not saved
+    BOOST_REQUIRE(cache.insert("uuid:c" + igd_st, "uuid:c", loc_b, seconds(0), root_xml("uuid:c")));
+
+    BOOST_REQUIRE(cache.save(cache_path));
+
+    description_cache loaded;
+    BOOST_REQUIRE(loaded.load(cache_path));
+    remove(cache_path.c_str());
+
+    BOOST_REQUIRE_EQUAL(loaded.size(), 2u);
+
+    for (auto e : cache.entries()) {
+        auto l = loaded.find(e->usn, e->location);
+        BOOST_REQUIRE(l);
+        BOOST_CHECK_EQUAL(l->usn, e->usn);
+        BOOST_CHECK_EQUAL(l->uuid, e->uuid);
+        BOOST_CHECK_EQUAL(l->xml, e->xml);
+        BOOST_CHECK_EQUAL(l->root_device.udn, e->root_device.udn);
+        BOOST_CHECK_EQUAL(l->root_device.friendly_name, e->root_device.friendly_name);
+        // The file keeps whole seconds
+        BOOST_CHECK(duration_cast<seconds>(l->expires.time_since_epoch())
+                 == duration_cast<seconds>(e->expires.time_since_epoch()));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_load_bad_size) {
+    auto xml = root_xml("uuid:a");
+
+    // Sanity check of the file layout
+    write_file(cache_file(to_string(xml.size()), xml));
+    {
+        description_cache cache;
+        BOOST_REQUIRE(cache.load(cache_path));
+        BOOST_CHECK_EQUAL(cache.size(), 1u);
+    }
+
+    vector<string> bad = {
+        // Not a number
+        cache_file("abc", xml),
+        // Past the end of the file
+        cache_file(to_string(xml.size() + 100), xml),
+        // Larger than any description, and than the memory to hold one
+        cache_file("18446744073709551615", xml),
+        // Short of the xml, so the newline isn't where it should be
+        cache_file(to_string(xml.size() - 1), xml),
+        // The file cut in the middle of the xml
+        cache_file(to_string(xml.size()), xml).substr(0, 200),
+    };
+
+    for (auto& content : bad) {
+        write_file(content);
+
+        description_cache cache;
+        auto r = cache.load(cache_path);
+        BOOST_CHECK(!r);
+        BOOST_CHECK_EQUAL(cache.size(), 0u);
+    }
+
+    remove(cache_path.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(test_find_by_uuid) {
+    description_cache cache;
+
+    auto loc = location("http://192.168.1.1:5000/rootDesc.xml");
+
+    BOOST_REQUIRE(cache.insert("uuid:abc" + igd_st, "uuid:abc", loc, seconds(600), root_xml("uuid:abc")));
+
+    // Another search target of the same device
+    BOOST_CHECK(cache.find("uuid:abc" + wan_st, loc));
+    BOOST_CHECK(cache.find("uuid:abc", loc));
+
+    // Only the whole uuid is a match, not a prefix of it, nor one it's a
+    // prefix of
+    BOOST_CHECK(!cache.find("uuid:ab" + igd_st, loc));
+    BOOST_CHECK(!cache.find("uuid:ab", loc));
+    BOOST_CHECK(!cache.find("uuid:abcd" + igd_st, loc));
+    BOOST_CHECK(!cache.find("uuid:abcd", loc));
+
+    // Same device elsewhere
+    BOOST_CHECK(!cache.find("uuid:abc" + igd_st, location("http://192.168.1.1:5001/rootDesc.xml")));
+}
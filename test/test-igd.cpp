@@ -0,0 +1,563 @@
+#define BOOST_TEST_MODULE igd
+#include <boost/test/included/unit_test.hpp>
+
+#include "fake_igd.h"
+#include <upnp.h>
+#include <algorithm>
+#include <set>
+
+using namespace std;
+using namespace std::chrono;
+namespace net = upnp::net;
+using upnp::igd;
+using upnp::test::fake_igd;
+using upnp::test::discover_options_for;
+
+// Starts a fake IGD with `fake_opts`, discovers it and runs
+// `f(exec, igd, fake, yield)` on the handle found.
+template<class F>
+static void with_igd(fake_igd::options fake_opts, F f)
+{
+    net::io_context ctx;
+
+    auto fake = fake_igd::start(ctx.get_executor(), fake_opts);
+    BOOST_REQUIRE(fake);
+
+    bool found = false;
+
+    net::spawn(ctx, [&] (net::yield_context yield) {
+        auto igds = upnp::test::discover_fake(ctx.get_executor(), fake.value(), yield);
+
+        if (!igds.empty()) {
+            found = true;
+            f(ctx.get_executor(), igds.front(), fake.value(), yield);
+        }
+
+        fake.value().stop();
+    });
+
+    ctx.run();
+
+    BOOST_REQUIRE(found);
+}
+
+BOOST_AUTO_TEST_CASE(test_delete_with_lost_response) {
+    with_igd({}, [] (net::any_io_executor, igd& igd, fake_igd& fake, net::yield_context yield) {
+        BOOST_REQUIRE(igd.add_port_mapping(igd::tcp, 2000, 2000, "test", seconds(60), yield));
+        BOOST_REQUIRE_EQUAL(fake.table_size(), 1u);
+
+        // The mapping is gone, but we never hear so and ask again
+        fake.lose_responses(1);
+        auto requests = fake.stats().requests;
+
+        BOOST_CHECK(igd.delete_port_mapping(igd::tcp, 2000, yield));
+        BOOST_CHECK_EQUAL(fake.stats().requests - requests, 2u);
+        BOOST_CHECK_EQUAL(fake.table_size(), 0u);
+    });
+}
+
+BOOST_AUTO_TEST_CASE(test_delete_with_lost_response_on_reused_connection) {
+    with_igd({}, [] (net::any_io_executor, igd& igd, fake_igd& fake, net::yield_context yield) {
+        igd.enable_keep_alive();
+
+        BOOST_REQUIRE(igd.add_port_mapping(igd::tcp, 2000, 2000, "test", seconds(60), yield));
+
+        fake.lose_responses(1);
+        auto requests = fake.stats().requests;
+
+        BOOST_CHECK(igd.delete_port_mapping(igd::tcp, 2000, yield));
+        BOOST_CHECK_EQUAL(fake.stats().requests - requests, 2u);
+        BOOST_CHECK_EQUAL(fake.table_size(), 0u);
+    });
+}
+
+BOOST_AUTO_TEST_CASE(test_delete_missing_fails) {
+    with_igd({}, [] (net::any_io_executor, igd& igd, fake_igd&, net::yield_context yield) {
+        auto r = igd.delete_port_mapping(igd::tcp, 2000, yield);
+        BOOST_REQUIRE(!r);
+        BOOST_CHECK_EQUAL(*igd::error::fault_code(r.error()), 714);
+    });
+}
+
+BOOST_AUTO_TEST_CASE(test_add_with_lost_response_isnt_resent) {
+    with_igd({}, [] (net::any_io_executor, igd& igd, fake_igd& fake, net::yield_context yield) {
+        fake.lose_responses(1);
+        auto requests = fake.stats().requests;
+
+        BOOST_CHECK(!igd.add_port_mapping(igd::tcp, 2000, 2000, "test", seconds(60), yield));
+        BOOST_CHECK_EQUAL(fake.stats().requests - requests, 1u);
+        BOOST_CHECK_EQUAL(fake.table_size(), 1u);
+    });
+}
+
+BOOST_AUTO_TEST_CASE(test_discover_query_options) {
+    fake_igd::options fake_opts;
+    fake_opts.drop_probability = 1;
+
+    net::io_context ctx;
+
+    auto fake = fake_igd::start(ctx.get_executor(), fake_opts);
+    BOOST_REQUIRE(fake);
+
+    net::spawn(ctx, [&] (net::yield_context yield) {
+        auto opts = discover_options_for(fake.value());
+        opts.gateway_linger = boost::none;
+        opts.query.timeout = milliseconds(200);
+
+        // Nothing answers, so each M-SEARCH is sent once and then again
+        // as many times as asked. There may be several of them, one per
+        // interface and search target.
+        opts.query.retransmits = 0;
+        (void) igd::discover(ctx.get_executor(), opts, yield);
+        auto once = fake.value().stats().searches;
+        BOOST_REQUIRE(once > 0);
+
+        opts.query.retransmits = 3;
+        (void) igd::discover(ctx.get_executor(), opts, yield);
+        BOOST_CHECK_EQUAL(fake.value().stats().searches - once, 4 * once);
+
+        fake.value().stop();
+    });
+
+    ctx.run();
+}
+
+static bool consistent(const vector<igd::map_entry>& table, size_t preset)
+{
+    // The preset mappings are on TCP ports from 10000, churn is on port 1
+    size_t i = 0;
+    if (!table.empty() && table.front().ext_port == 1) ++i;
+    if (table.size() != i + preset) return false;
+    for (size_t j = 0; j < preset; ++j) {
+        if (table[i + j].ext_port != 10000 + j) return false;
+    }
+    return true;
+}
+
+BOOST_AUTO_TEST_CASE(test_table_with_zero_window) {
+    fake_igd::options opts;
+    opts.table_size = 20;
+
+    with_igd(opts, [] (net::any_io_executor, igd& igd, fake_igd&, net::yield_context yield) {
+        igd::table_options topts;
+        topts.window = 0;
+
+        auto r = igd.get_port_mapping_table(topts, yield);
+        BOOST_REQUIRE(r);
+        BOOST_CHECK(consistent(r.value(), 20));
+    });
+}
+
+BOOST_AUTO_TEST_CASE(test_table_reads_each_index_once) {
+    fake_igd::options opts;
+    opts.table_size = 100;
+
+    with_igd(opts, [] (net::any_io_executor, igd& igd, fake_igd& fake, net::yield_context yield) {
+        auto requests = fake.stats().requests;
+
+        auto r = igd.get_port_mapping_table(yield);
+        BOOST_REQUIRE(r);
+        BOOST_CHECK(consistent(r.value(), 100));
+
+        // 13 windows of 8 up to the end, 23 re-reads along with them, and
+        // a last round of two re-reads and the end
+        BOOST_CHECK_EQUAL(fake.stats().requests - requests, 104u + 23u + 3u);
+    });
+}
+
+BOOST_AUTO_TEST_CASE(test_table_rereads_faulted_window) {
+    fake_igd::options opts;
+    opts.table_size = 20;
+
+    with_igd(opts, [] (net::any_io_executor, igd& igd, fake_igd& fake, net::yield_context yield) {
+        fake.fail_requests(1);
+
+        auto r = igd.get_port_mapping_table(yield);
+        BOOST_REQUIRE(r);
+        BOOST_CHECK(consistent(r.value(), 20));
+
+        igd::table_options topts;
+        topts.max_restarts = 2;
+
+        fake.fail_requests(1000);
+
+        auto failed = igd.get_port_mapping_table(topts, yield);
+        BOOST_REQUIRE(!failed);
+        BOOST_CHECK_EQUAL(*igd::error::fault_code(failed.error()), 501);
+
+        fake.fail_requests(0);
+    });
+}
+
+BOOST_AUTO_TEST_CASE(test_table_under_churn) {
+    fake_igd::options opts;
+    opts.table_size = 100;
+
+    with_igd(opts, [] (net::any_io_executor exec, igd& igd, fake_igd&, net::yield_context yield) {
+        igd.enable_keep_alive();
+
+        bool scanning = true;
+        size_t churned = 0;
+
+        net::steady_timer done(exec);
+        done.expires_at(steady_clock::time_point::max());
+
+        net::spawn(exec, [&] (net::yield_context y) {
+            churned = upnp::test::churn_table( exec, igd, milliseconds(200)
+                                             , [&] { return scanning; }, y);
+            done.cancel();
+        });
+
+        igd::table_options topts;
+        topts.max_restarts = 10;
+
+        size_t snapshots = 0;
+
+        for (int i = 0; i != 20; ++i) {
+            auto r = igd.get_port_mapping_table(topts, yield);
+            if (!r) {
+                BOOST_CHECK(boost::get<igd::error::table_changed>(&r.error()));
+                continue;
+            }
+            ++snapshots;
+            BOOST_CHECK(consistent(r.value(), 100));
+        }
+
+        scanning = false;
+        upnp::error_code ec;
+        done.async_wait(yield[ec]);
+
+        BOOST_CHECK(churned > 0);
+        BOOST_CHECK(snapshots > 0);
+        BOOST_TEST_MESSAGE("churned " << churned << " times, " << snapshots << " snapshots");
+    });
+}
+
+BOOST_AUTO_TEST_CASE(test_listing_past_short_pages) {
+    fake_igd::options opts;
+    opts.table_size = 250;
+    opts.max_listing_size = 40;
+
+    with_igd(opts, [] (net::any_io_executor, igd& igd, fake_igd&, net::yield_context yield) {
+        igd::listing_options lopts;
+        lopts.page_size = 100;
+
+        auto pager = igd.list_port_mappings(igd::tcp, lopts);
+
+        vector<igd::map_entry> entries;
+
+        while (true) {
+            auto r = pager.next(yield);
+            BOOST_REQUIRE(r);
+            if (!r.value()) break;
+            entries.push_back(*r.value());
+        }
+
+        BOOST_CHECK(consistent(entries, 250));
+        // Seven pages and the one which found nothing more
+        BOOST_CHECK_EQUAL(pager.requests(), 8u);
+    });
+}
+
+// Whether `r` holds a handle to `fake` which works
+static bool found_fake(upnp::result<vector<igd>>& r, fake_igd& fake, net::yield_context yield)
+{
+    if (!r) return false;
+    for (auto& i : r.value()) {
+        if (i.friendly_name() != fake.friendly_name()) continue;
+        return bool(i.get_external_address(yield));
+    }
+    return false;
+}
+
+BOOST_AUTO_TEST_CASE(test_shared_discovery) {
+    with_igd({}, [] (net::any_io_executor exec, igd&, fake_igd& fake, net::yield_context yield) {
+        upnp::shared_discovery::options opts;
+        opts.discover = discover_options_for(fake);
+
+        // What a round on its own sends
+        auto searches = fake.stats().searches;
+        upnp::shared_discovery alone(exec, opts);
+        auto r = alone.discover(yield);
+        BOOST_REQUIRE(found_fake(r, fake, yield));
+        auto round = fake.stats().searches - searches;
+        BOOST_REQUIRE(round > 0);
+
+        // Callers arriving while a round is in progress share it, each
+        // with its own handles
+        upnp::shared_discovery sd(exec, opts);
+        searches = fake.stats().searches;
+
+        size_t running = 2;
+        net::steady_timer done(exec);
+        done.expires_at(steady_clock::time_point::max());
+
+        for (int i = 0; i != 2; ++i) {
+            net::spawn(exec, [&] (net::yield_context y) {
+                auto r = sd.discover(y);
+                BOOST_CHECK(found_fake(r, fake, y));
+                if (--running == 0) done.cancel();
+            });
+        }
+
+        upnp::error_code ec;
+        done.async_wait(yield[ec]);
+        BOOST_CHECK_EQUAL(fake.stats().searches - searches, round);
+
+        // Results are reused for `result_ttl`, until invalidated
+        opts.result_ttl = seconds(60);
+        upnp::shared_discovery cached(exec, opts);
+        searches = fake.stats().searches;
+
+        r = cached.discover(yield);
+        BOOST_CHECK(found_fake(r, fake, yield));
+        r = cached.discover(yield);
+        BOOST_CHECK(found_fake(r, fake, yield));
+        BOOST_CHECK_EQUAL(fake.stats().searches - searches, round);
+
+        cached.invalidate();
+        r = cached.discover(yield);
+        BOOST_CHECK(found_fake(r, fake, yield));
+        BOOST_CHECK_EQUAL(fake.stats().searches - searches, 2 * round);
+    });
+}
+
+BOOST_AUTO_TEST_CASE(test_keep_alive_reuse_and_eviction) {
+    with_igd({}, [] (net::any_io_executor exec, igd& igd, fake_igd& fake, net::yield_context yield) {
+        igd::keep_alive_options ka;
+        ka.max_idle_connections = 2;
+        ka.idle_timeout = milliseconds(200);
+        igd.enable_keep_alive(ka);
+
+        // One after another, the same connection serves them all
+        auto connections = fake.stats().connections;
+        for (int i = 0; i != 5; ++i) {
+            BOOST_REQUIRE(igd.get_external_address(yield));
+        }
+        BOOST_CHECK_EQUAL(fake.stats().connections - connections, 1u);
+
+        vector<igd::mapping_spec> specs;
+        vector<igd::mapping_key> keys;
+        for (uint16_t i = 0; i != 4; ++i) {
+            specs.push_back({igd::tcp, uint16_t(2000 + i), uint16_t(2000 + i), "pool", seconds(60)});
+            keys.push_back({igd::tcp, uint16_t(2000 + i)});
+        }
+
+        // Four at once take the idle one and open three more, of which
+        // only two are kept
+        connections = fake.stats().connections;
+        for (auto& r : igd.add_port_mappings(specs, 4, yield)) BOOST_CHECK(r);
+        BOOST_CHECK_EQUAL(fake.stats().connections - connections, 3u);
+
+        connections = fake.stats().connections;
+        for (auto& r : igd.delete_port_mappings(keys, 4, yield)) BOOST_CHECK(r);
+        BOOST_CHECK_EQUAL(fake.stats().connections - connections, 2u);
+
+        // Idle for too long, they aren't reused
+        net::steady_timer t(exec);
+        t.expires_after(milliseconds(300));
+        t.async_wait(yield);
+
+        connections = fake.stats().connections;
+        BOOST_REQUIRE(igd.get_external_address(yield));
+        BOOST_CHECK_EQUAL(fake.stats().connections - connections, 1u);
+
+        // Nor once keep-alive is disabled
+        igd.disable_keep_alive();
+        connections = fake.stats().connections;
+        for (int i = 0; i != 3; ++i) {
+            BOOST_REQUIRE(igd.get_external_address(yield));
+        }
+        BOOST_CHECK_EQUAL(fake.stats().connections - connections, 3u);
+    });
+}
+
+BOOST_AUTO_TEST_CASE(test_batch_results_in_order) {
+    fake_igd::options opts;
+    opts.max_table_size = 3;
+
+    with_igd(opts, [] (net::any_io_executor, igd& igd, fake_igd& fake, net::yield_context yield) {
+        vector<igd::mapping_spec> specs;
+        for (uint16_t i = 0; i != 5; ++i) {
+            specs.push_back({igd::tcp, uint16_t(2000 + i), uint16_t(3000 + i), "batch", seconds(60)});
+        }
+
+        // Two don't fit, which two depends on the order the device gets
+        // them in
+        auto added = igd.add_port_mappings(specs, 2, yield);
+        BOOST_REQUIRE_EQUAL(added.size(), specs.size());
+        BOOST_CHECK_EQUAL(fake.table_size(), 3u);
+
+        set<uint16_t> in_table;
+        for (uint16_t i = 0; i != 3; ++i) {
+            auto e = igd.get_generic_port_mapping_entry(i, yield);
+            BOOST_REQUIRE(e);
+            // Each result is that of the mapping at the same index
+            BOOST_CHECK_EQUAL(e.value().int_port, e.value().ext_port + 1000);
+            in_table.insert(e.value().ext_port);
+        }
+
+        for (size_t i = 0; i != specs.size(); ++i) {
+            if (in_table.count(specs[i].external_port)) {
+                BOOST_CHECK(added[i]);
+            } else {
+                BOOST_REQUIRE(!added[i]);
+                BOOST_CHECK_EQUAL(*igd::error::fault_code(added[i].error()), 728);
+            }
+        }
+
+        // One in the middle isn't there
+        vector<igd::mapping_key> keys = {
+            {igd::tcp, *in_table.begin()},
+            {igd::tcp, 2999},
+            {igd::tcp, *in_table.rbegin()},
+        };
+
+        auto deleted = igd.delete_port_mappings(keys, 2, yield);
+        BOOST_REQUIRE_EQUAL(deleted.size(), 3u);
+        BOOST_CHECK(deleted[0]);
+        BOOST_REQUIRE(!deleted[1]);
+        BOOST_CHECK_EQUAL(*igd::error::fault_code(deleted[1].error()), 714);
+        BOOST_CHECK(deleted[2]);
+        BOOST_CHECK_EQUAL(fake.table_size(), 1u);
+
+        // Nothing to do, and no requests in flight still does it
+        BOOST_CHECK(igd.add_port_mappings({}, 4, yield).empty());
+        auto r = igd.delete_port_mappings({{igd::tcp, *next(in_table.begin())}}, 0, yield);
+        BOOST_REQUIRE_EQUAL(r.size(), 1u);
+        BOOST_CHECK(r[0]);
+        BOOST_CHECK_EQUAL(fake.table_size(), 0u);
+    });
+}
+
+BOOST_AUTO_TEST_CASE(test_soap_arguments_escaped) {
+    with_igd({}, [] (net::any_io_executor, igd& igd, fake_igd& fake, net::yield_context yield) {
+        const string description = "<a href=\"x\">&amp; 'b'</a>";
+
+        BOOST_REQUIRE(igd.add_port_mapping(igd::tcp, 2000, 2000, description, seconds(60), yield));
+
+        auto e = igd.get_generic_port_mapping_entry(0, yield);
+        BOOST_REQUIRE(e);
+        BOOST_CHECK_EQUAL(e.value().description, description);
+
+        auto l = igd.get_list_of_port_mappings(igd::tcp, 2000, 2000, 1, yield);
+        BOOST_REQUIRE(l);
+        BOOST_REQUIRE_EQUAL(l.value().size(), 1u);
+        BOOST_CHECK_EQUAL(l.value()[0].description, description);
+
+        // The fake IGD only reads arguments inside the action element
+        BOOST_CHECK(igd.delete_port_mapping(igd::tcp, 2000, yield));
+        BOOST_CHECK_EQUAL(fake.table_size(), 0u);
+        BOOST_CHECK_EQUAL(fake.stats().faults, 0u);
+    });
+}
+
+static string notify_datagram( const string& nts
+                             , const string& nt
+                             , const fake_igd::options& fake_opts
+                             , const string& location)
+{
+    string usn = "uuid:" + fake_opts.uuid + "::" + nt;
+    return "NOTIFY * HTTP/1.1\r\n"
+           "HOST: 239.255.255.250:1900\r\n"
+           "CACHE-CONTROL: max-age=1800\r\n"
+           "LOCATION: " + location + "\r\n"
+           "NT: " + nt + "\r\n"
+           "NTS: " + nts + "\r\n"
+           "USN: " + usn + "\r\n"
+           "\r\n";
+}
+
+BOOST_AUTO_TEST_CASE(test_igd_registry) {
+    net::io_context ctx;
+
+    fake_igd::options fake_opts;
+    auto fake = fake_igd::start(ctx.get_executor(), fake_opts);
+    BOOST_REQUIRE(fake);
+
+    upnp::igd_registry::options opts;
+    opts.initial_search = false;
+
+    auto registry = upnp::igd_registry::start(ctx.get_executor(), opts);
+    BOOST_REQUIRE(registry);
+
+    net::spawn(ctx, [&] (net::yield_context yield) {
+        auto& reg = registry.value();
+        auto location = fake.value().description_url();
+
+        net::ip::udp::socket s(ctx, net::ip::udp::endpoint(net::ip::address_v4::loopback(), 0));
+        net::ip::udp::endpoint to(net::ip::address_v4::loopback(), 1900);
+
+        // Polls until `reg` tracks `n` devices, or gives up after `ms`
+        auto wait_for = [&] (size_t n, bool fetched, int ms = 2000) {
+            net::steady_timer t(ctx);
+            for (int i = 0; i < ms / 10; ++i) {
+                if (reg.size() == n && (!fetched || reg.igds().size() == n)) return true;
+                t.expires_after(milliseconds(10));
+                t.async_wait(yield);
+            }
+            return false;
+        };
+
+        // Embedded devices and services aren't tracked until the root
+        // device says it's an IGD
+        s.send_to(net::buffer(notify_datagram( "ssdp:alive"
+                                             , "urn:schemas-upnp-org:service:WANIPConnection:2"
+                                             , fake_opts, location)), to);
+        BOOST_CHECK(!wait_for(1, false, 200));
+
+        auto igd_nt = "urn:schemas-upnp-org:device:InternetGatewayDevice:2";
+
+        s.send_to(net::buffer(notify_datagram("ssdp:alive", igd_nt, fake_opts, location)), to);
+        BOOST_REQUIRE(wait_for(1, true));
+
+        auto igds = reg.igds();
+        BOOST_CHECK_EQUAL(igds.front().friendly_name(), fake_opts.friendly_name);
+        BOOST_CHECK(igds.front().get_external_address(yield));
+
+        // Announced again, the description isn't fetched again
+        auto connections = fake.value().stats().connections;
+        s.send_to(net::buffer(notify_datagram("ssdp:alive", igd_nt, fake_opts, location)), to);
+        BOOST_CHECK(!wait_for(2, false, 200));
+        BOOST_CHECK_EQUAL(reg.size(), 1u);
+        BOOST_CHECK_EQUAL(fake.value().stats().connections, connections);
+
+        s.send_to(net::buffer(notify_datagram("ssdp:byebye", igd_nt, fake_opts, location)), to);
+        BOOST_CHECK(wait_for(0, true));
+        BOOST_CHECK(reg.igds().empty());
+
+        reg.stop();
+        fake.value().stop();
+    });
+
+    ctx.run();
+}
+
+BOOST_AUTO_TEST_CASE(test_discover_first) {
+    with_igd({}, [] (net::any_io_executor exec, igd&, fake_igd& fake, net::yield_context yield) {
+        // Without stopping early, these would take the whole window
+        auto opts = discover_options_for(fake);
+        opts.gateway_linger = boost::none;
+        opts.query.timeout = seconds(3);
+
+        auto start = steady_clock::now();
+        auto r = igd::discover_first(exec, opts, yield);
+        BOOST_REQUIRE(r);
+        BOOST_CHECK(steady_clock::now() - start < seconds(1));
+        BOOST_CHECK(r.value().get_external_address(yield));
+
+        // Handed over as soon as the description is fetched, and stopped
+        // once we say so
+        size_t handed = 0;
+        start = steady_clock::now();
+
+        auto s = igd::discover(exec, opts, [&] (igd i) {
+            ++handed;
+            return i.friendly_name() != fake.friendly_name();
+        }, yield);
+
+        BOOST_CHECK(s);
+        BOOST_CHECK(handed > 0);
+        BOOST_CHECK(steady_clock::now() - start < seconds(1));
+    });
+}
@@ -0,0 +1,287 @@
+#define BOOST_TEST_MODULE soap
+#include <boost/test/included/unit_test.hpp>
+
+#include "soap_fields.h"
+#include "soap_schema.h"
+
+using namespace std;
+using upnp::soap::field_collector;
+namespace soap = upnp::soap;
+
+struct fields3 {
+    string a, b, c;
+};
+
+static const auto r_schema = soap::make_schema( "R"
+                                              , soap::bind("A", &fields3::a)
+                                              , soap::bind("B", &fields3::b)
+                                              , soap::bind("C", &fields3::c));
+
+static const auto ra_schema = soap::make_schema("R", soap::bind("A", &fields3::a));
+
+using r_decoder  = soap::decoder<decltype(r_schema)>;
+using ra_decoder = soap::decoder<decltype(ra_schema)>;
+
+struct external {
+    upnp::net::ip::address address;
+};
+
+static const auto external_schema = soap::make_schema(
+        "GetExternalIPAddressResponse",
+        soap::bind("NewExternalIPAddress", &external::address));
+
+static const string external_ip_response =
+    "<?xml version=\"1.0\"?>\r\n"
+    "<!-- some routers comment -->\r\n"
+    "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+                "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+    "<s:Body>"
+    "<u:GetExternalIPAddressResponse xmlns:u=\"urn:schemas-upnp-org:service:WANIPConnection:1\">"
+    "<NewExternalIPAddress>  203.0.113.7\r\n</NewExternalIPAddress>"
+    "</u:GetExternalIPAddressResponse>"
+    "</s:Body>"
+    "</s:Envelope>";
+
+BOOST_AUTO_TEST_CASE(test_whole_body) {
+    external e;
+    soap::decoder<decltype(external_schema)> d(external_schema, e);
+    field_collector f(external_schema.element(), d);
+    f.feed(external_ip_response);
+    BOOST_REQUIRE(f.complete());
+    BOOST_REQUIRE(!f.malformed());
+    BOOST_REQUIRE(!d.error());
+    BOOST_REQUIRE_EQUAL(e.address.to_string(), "203.0.113.7");
+}
+
+BOOST_AUTO_TEST_CASE(test_byte_by_byte) {
+    external e;
+    soap::decoder<decltype(external_schema)> d(external_schema, e);
+    field_collector f(external_schema.element(), d);
+
+    size_t fed = 0;
+    for (char c : external_ip_response) {
+        if (f.finished()) break;
+        f.feed(upnp::string_view(&c, 1));
+        ++fed;
+    }
+
+    BOOST_REQUIRE(f.complete());
+    BOOST_REQUIRE_EQUAL(e.address.to_string(), "203.0.113.7");
+    // Done before the end of the envelope
+    BOOST_REQUIRE_LT(fed, external_ip_response.size());
+}
+
+BOOST_AUTO_TEST_CASE(test_entities_and_cdata) {
+    fields3 v;
+    r_decoder d(r_schema, v);
+    field_collector f("R", d);
+    f.feed("<R><A>x &amp; &lt;y&gt; &#65;&#x42;</A>"
+           "<B><![CDATA[<not> &amp; markup]]></B>"
+           "<C attr='a>b' /></R>");
+    BOOST_REQUIRE(f.complete());
+    BOOST_REQUIRE_EQUAL(v.a, "x & <y> AB");
+    BOOST_REQUIRE_EQUAL(v.b, "<not> &amp; markup");
+    BOOST_REQUIRE_EQUAL(v.c, "");
+}
+
+BOOST_AUTO_TEST_CASE(test_only_direct_children) {
+    fields3 v;
+    ra_decoder d(ra_schema, v);
+    field_collector f("R", d);
+    f.feed("<A>outside</A><R><X><A>nested</A></X><A>mine</A></R>");
+    BOOST_REQUIRE(f.complete());
+    BOOST_REQUIRE_EQUAL(v.a, "mine");
+}
+
+BOOST_AUTO_TEST_CASE(test_missing_field) {
+    fields3 v;
+    r_decoder d(r_schema, v);
+    field_collector f("R", d);
+    f.feed("<R><A>1</A><C>3</C></R><padding/>");
+    BOOST_REQUIRE(f.finished());
+    BOOST_REQUIRE(!f.complete());
+    BOOST_REQUIRE(!f.malformed());
+    BOOST_REQUIRE_EQUAL(v.a, "1");
+
+    auto e = d.error();
+    BOOST_REQUIRE(e);
+    BOOST_REQUIRE_EQUAL(e->name, "B");
+    BOOST_REQUIRE(e->missing);
+
+    f.reset();
+    BOOST_REQUIRE(!f.complete());
+    f.feed("<R><B>2</B><A>1</A><C>3</C></R>");
+    BOOST_REQUIRE(f.complete());
+    BOOST_REQUIRE(!d.error());
+}
+
+BOOST_AUTO_TEST_CASE(test_malformed) {
+    fields3 v;
+    {
+        ra_decoder d(ra_schema, v);
+        field_collector f("R", d);
+        f.feed("<R><A>1</B></R>");
+        BOOST_REQUIRE(f.malformed());
+    }
+    {
+        ra_decoder d(ra_schema, v);
+        field_collector f("R", d);
+        f.feed("<R><A>&bogus;</A></R>");
+        BOOST_REQUIRE(f.malformed());
+    }
+    {
+        ra_decoder d(ra_schema, v);
+        field_collector f("R", d);
+        f.feed("<R><A>1");
+        f.end();
+        BOOST_REQUIRE(f.malformed());
+    }
+}
+
+struct typed {
+    uint16_t port;
+    std::chrono::seconds lease;
+    bool enabled;
+    upnp::igd::protocol proto;
+};
+
+static const auto typed_schema = soap::make_schema( "E"
+                                                  , soap::bind("Port",    &typed::port)
+                                                  , soap::bind("Lease",   &typed::lease)
+                                                  , soap::bind("Enabled", &typed::enabled)
+                                                  , soap::bind("Proto",   &typed::proto));
+
+static upnp::optional<soap::field_error> decode_typed(upnp::string_view doc, typed& out)
+{
+    soap::decoder<decltype(typed_schema)> d(typed_schema, out);
+    field_collector f("E", d);
+    f.feed(doc);
+    f.end();
+    BOOST_REQUIRE(!f.malformed());
+    return d.error();
+}
+
+BOOST_AUTO_TEST_CASE(test_schema_types) {
+    typed t;
+    auto e = decode_typed("<E><Proto>udp</Proto><Port>8080</Port>"
+                          "<X>ignored</X><Lease> 3600 </Lease>"
+                          "<Enabled>1</Enabled></E>", t);
+    BOOST_REQUIRE(!e);
+    BOOST_REQUIRE_EQUAL(t.port, 8080);
+    BOOST_REQUIRE_EQUAL(t.lease.count(), 3600);
+    BOOST_REQUIRE(t.enabled);
+    BOOST_REQUIRE(t.proto == upnp::igd::udp);
+}
+
+BOOST_AUTO_TEST_CASE(test_schema_errors) {
+    typed t;
+
+    // Invalid fields take precedence over missing ones
+    auto e = decode_typed("<E><Port>70000</Port><Enabled>2</Enabled></E>", t);
+    BOOST_REQUIRE(e);
+    BOOST_REQUIRE_EQUAL(e->name, "Port");
+    BOOST_REQUIRE(!e->missing);
+
+    e = decode_typed("<E><Port>1</Port><Lease>1</Lease><Enabled>yes</Enabled>"
+                     "<Proto>SCTP</Proto></E>", t);
+    BOOST_REQUIRE(e);
+    BOOST_REQUIRE_EQUAL(e->name, "Proto");
+    BOOST_REQUIRE(!e->missing);
+
+    e = decode_typed("<E><Port>1</Port><Enabled>0</Enabled><Proto>TCP</Proto></E>", t);
+    BOOST_REQUIRE(e);
+    BOOST_REQUIRE_EQUAL(e->name, "Lease");
+    BOOST_REQUIRE(e->missing);
+}
+
+struct entry {
+    uint16_t port;
+    string description;
+};
+
+static const auto entry_schema = soap::make_schema( "Entry"
+                                                  , soap::bind("Port", &entry::port)
+                                                  , soap::bind("Desc", &entry::description));
+
+static const string listing_response =
+    "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\"><s:Body>"
+    "<u:ListResponse xmlns:u=\"urn:test\"><Listing>"
+    "&lt;?xml version=&quot;1.0&quot;?&gt;"
+    "&lt;p:List xmlns:p=&quot;urn:test&quot;&gt;"
+    "&lt;p:Entry&gt;&lt;p:Port&gt;1&lt;/p:Port&gt;&lt;p:Desc&gt;a &amp;amp; b&lt;/p:Desc&gt;&lt;/p:Entry&gt;"
+    "&lt;p:Entry&gt;&lt;p:Port&gt;bad&lt;/p:Port&gt;&lt;p:Desc/&gt;&lt;/p:Entry&gt;"
+    "&lt;p:Entry&gt;&lt;p:Desc&gt;c&lt;/p:Desc&gt;&lt;p:Port&gt;3&lt;/p:Port&gt;&lt;/p:Entry&gt;"
+    "&lt;/p:List&gt;"
+    "</Listing></u:ListResponse></s:Body></s:Envelope>";
+
+static vector<entry> feed_listing(upnp::string_view body, size_t chunk)
+{
+    vector<entry> ret;
+    auto on_entry = [&] (entry e) { ret.push_back(move(e)); };
+
+    soap::embedded_records<decltype(entry_schema), decltype(on_entry)>
+        listing("Listing", entry_schema, on_entry);
+    field_collector f("ListResponse", listing);
+
+    while (!body.empty() && !f.finished()) {
+        auto n = min(chunk, body.size());
+        f.feed(body.substr(0, n));
+        body.remove_prefix(n);
+    }
+
+    BOOST_REQUIRE(!f.malformed());
+    BOOST_REQUIRE(!listing.malformed());
+    BOOST_REQUIRE(listing.complete());
+    BOOST_REQUIRE_EQUAL(listing.delivered(), ret.size());
+    return ret;
+}
+
+BOOST_AUTO_TEST_CASE(test_embedded_records) {
+    for (size_t chunk : {size_t(1), size_t(7), listing_response.size()}) {
+        auto es = feed_listing(listing_response, chunk);
+        BOOST_REQUIRE_EQUAL(es.size(), 2);
+        BOOST_REQUIRE_EQUAL(es[0].port, 1);
+        BOOST_REQUIRE_EQUAL(es[0].description, "a & b");
+        BOOST_REQUIRE_EQUAL(es[1].port, 3);
+        BOOST_REQUIRE_EQUAL(es[1].description, "c");
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_embedded_records_cdata) {
+    string body =
+        "<R><L><![CDATA[<List><Entry><Port>5</Port><Desc>x &amp; y]]]]><![CDATA[></Desc>"
+        "</Entry></List>]]></L></R>";
+
+    vector<entry> es;
+    auto on_entry = [&] (entry e) { es.push_back(move(e)); };
+    soap::embedded_records<decltype(entry_schema), decltype(on_entry)>
+        listing("L", entry_schema, on_entry);
+    field_collector f("R", listing);
+    f.feed(body);
+
+    BOOST_REQUIRE(!f.malformed());
+    BOOST_REQUIRE(!listing.malformed());
+    BOOST_REQUIRE_EQUAL(es.size(), 1);
+    BOOST_REQUIRE_EQUAL(es[0].port, 5);
+    BOOST_REQUIRE_EQUAL(es[0].description, "x & y]]>");
+}
+
+BOOST_AUTO_TEST_CASE(test_embedded_records_repeated) {
+    vector<entry> es;
+    auto on_entry = [&] (entry e) { es.push_back(move(e)); };
+    soap::embedded_records<decltype(entry_schema), decltype(on_entry)>
+        listing("Listing", entry_schema, on_entry);
+    field_collector f("ListResponse", listing);
+
+    // The first response breaks off after an entry...
+    f.reset();
+    f.feed(listing_response.substr(0, listing_response.find("bad")));
+    BOOST_REQUIRE_EQUAL(es.size(), 1);
+
+    // ...and only the rest of the repeated one is handed over
+    f.reset();
+    f.feed(listing_response);
+    BOOST_REQUIRE(listing.complete());
+    BOOST_REQUIRE_EQUAL(es.size(), 2);
+    BOOST_REQUIRE_EQUAL(es[1].port, 3);
+}
@@ -0,0 +1,397 @@
+#define BOOST_TEST_MODULE ssdp
+#include <boost/test/included/unit_test.hpp>
+
+#include <upnp/ssdp.h>
+#include "default_gateways.h"
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+using namespace std;
+using namespace upnp::ssdp;
+
+inline string read_vector(const string& name) {
+    ifstream f(string(TEST_VECTORS_DIR) + "/" + name, ios::binary);
+    stringstream ss;
+    ss << f.rdbuf();
+    return ss.str();
+}
+
+BOOST_AUTO_TEST_CASE(test_parse_discover_response) {
+    auto data = read_vector("test-vector-ssdp-discover-response.txt");
+    BOOST_REQUIRE(!data.empty());
+
+    auto r = query::response::parse(data);
+    BOOST_REQUIRE(r);
+    auto& rs = r.value();
+
+    BOOST_REQUIRE_EQUAL(rs.service_type, "urn:schemas-upnp-org:device:InternetGatewayDevice:2");
+    BOOST_REQUIRE_EQUAL(rs.usn, "uuid:A37351C5-8521-4c24-A43E-DC537CBA5DE6::urn:schemas-upnp-org:device:InternetGatewayDevice:2");
+    BOOST_REQUIRE_EQUAL(rs.uuid, "A37351C5-8521-4c24-A43E-DC537CBA5DE6");
+    BOOST_REQUIRE_EQUAL(upnp::string_view(rs.location), "http://192.168.0.1:5000/rootDesc.xml");
+    BOOST_REQUIRE_EQUAL(rs.server, "Compal Broadband Networks, Inc/Linux/2.6.39.3 UPnP/1.1 MiniUPnPd/1.9");
+    BOOST_REQUIRE(rs.max_age);
+    BOOST_REQUIRE_EQUAL(rs.max_age->count(), 120);
+    BOOST_REQUIRE(rs.boot_id);
+    BOOST_REQUIRE_EQUAL(*rs.boot_id, 1578473456u);
+    BOOST_REQUIRE(rs.config_id);
+    BOOST_REQUIRE_EQUAL(*rs.config_id, 1337u);
+}
+
+BOOST_AUTO_TEST_CASE(test_parse_response_view) {
+    string data = "HTTP/1.1 200 OK\n"
+                  "cache-control: no-cache, max-age = 60\n"
+                  "usn: uuid:abc::upnp:rootdevice\n"
+                  "Location: http://10.0.0.1/desc.xml\n"
+                  "\n";
+
+    auto r = query::response_view::parse(data);
+    BOOST_REQUIRE(r);
+    auto& rv = r.value();
+
+    BOOST_REQUIRE_EQUAL(rv.uuid, "abc");
+    BOOST_REQUIRE_EQUAL(rv.location, "http://10.0.0.1/desc.xml");
+    BOOST_REQUIRE(rv.max_age);
+    BOOST_REQUIRE_EQUAL(rv.max_age->count(), 60);
+    BOOST_REQUIRE(!rv.boot_id);
+
+    // Views point into the datagram
+    BOOST_REQUIRE(rv.location.data() >= data.data());
+    BOOST_REQUIRE(rv.location.data() < data.data() + data.size());
+}
+
+BOOST_AUTO_TEST_CASE(test_parse_errors) {
+    {
+        auto r = query::response::parse("NOTIFY * HTTP/1.1\r\n\r\n");
+        BOOST_REQUIRE(!r);
+        auto e = boost::get<query::error::http_status_line>(&r.error().inner);
+        BOOST_REQUIRE(e);
+        BOOST_REQUIRE_EQUAL(e->offset, 0u);
+    }
+    {
+        auto r = query::response::parse("HTTP/1.1 404 Not Found\r\n\r\n");
+        BOOST_REQUIRE(!r);
+        auto e = boost::get<query::error::http_result>(&r.error().inner);
+        BOOST_REQUIRE(e);
+        BOOST_REQUIRE_EQUAL(e->offset, 9u);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_parse_notify) {
+    auto n = notify::parse(
+        "NOTIFY * HTTP/1.1\r\n"
+        "HOST: 239.255.255.250:1900\r\n"
+        "CACHE-CONTROL: max-age=1800\r\n"
+        "LOCATION: http://192.168.0.1:5000/rootDesc.xml\r\n"
+        "NT: urn:schemas-upnp-org:device:InternetGatewayDevice:1\r\n"
+        "NTS: ssdp:alive\r\n"
+        "USN: uuid:abc::urn:schemas-upnp-org:device:InternetGatewayDevice:1\r\n"
+        "BOOTID.UPNP.ORG: 7\r\n"
+        "\r\n");
+
+    BOOST_REQUIRE(n);
+    BOOST_REQUIRE_EQUAL(n->sub_type, notify::alive);
+    BOOST_REQUIRE_EQUAL(n->uuid, "abc");
+    BOOST_REQUIRE_EQUAL(n->notification_type, "urn:schemas-upnp-org:device:InternetGatewayDevice:1");
+    BOOST_REQUIRE_EQUAL(n->max_age->count(), 1800);
+    BOOST_REQUIRE_EQUAL(*n->boot_id, 7u);
+
+    auto bye = notify::parse(
+        "NOTIFY * HTTP/1.1\r\n"
+        "NT: upnp:rootdevice\r\n"
+        "NTS: ssdp:byebye\r\n"
+        "USN: uuid:abc::upnp:rootdevice\r\n"
+        "\r\n");
+
+    BOOST_REQUIRE(bye);
+    BOOST_REQUIRE_EQUAL(bye->sub_type, notify::byebye);
+
+    // ssdp:alive must have a location
+    BOOST_REQUIRE(!notify::parse(
+        "NOTIFY * HTTP/1.1\r\n"
+        "NTS: ssdp:alive\r\n"
+        "USN: uuid:abc::upnp:rootdevice\r\n"
+        "\r\n"));
+
+    BOOST_REQUIRE(!notify::parse("M-SEARCH * HTTP/1.1\r\n\r\n"));
+}
+
+// As the kernel prints a `__be32` in /proc/net/route
+inline string route_hex(upnp::net::ip::address_v4 a) {
+    auto bytes = a.to_bytes();
+    uint32_t v;
+    memcpy(&v, bytes.data(), sizeof(v));
+    char buf[9];
+    snprintf(buf, sizeof(buf), "%08X", v);
+    return buf;
+}
+
+BOOST_AUTO_TEST_CASE(test_parse_default_route) {
+    using upnp::parse_default_route;
+    auto gw = upnp::net::ip::make_address_v4("192.168.0.1");
+
+    auto r = parse_default_route("eth0\t00000000\t" + route_hex(gw) + "\t0003\t0\t0\t100\t00000000\t0\t0\t0");
+    BOOST_REQUIRE(r);
+    BOOST_REQUIRE_EQUAL(*r, gw);
+
+    // Not a default route
+    BOOST_REQUIRE(!parse_default_route("eth0\t0000A8C0\t" + route_hex(gw) + "\t0003\t0\t0\t100\t00FFFFFF\t0\t0\t0"));
+    // Down, and without a gateway
+    BOOST_REQUIRE(!parse_default_route("eth0\t00000000\t" + route_hex(gw) + "\t0002\t0\t0\t100\t00000000\t0\t0\t0"));
+    BOOST_REQUIRE(!parse_default_route("eth0\t00000000\t00000000\t0001\t0\t0\t100\t00000000\t0\t0\t0"));
+    // The header
+    BOOST_REQUIRE(!parse_default_route("Iface\tDestination\tGateway\tFlags\tRefCnt\tUse\tMetric\tMask"));
+}
+
+// One query round in which the devices in `latencies` responded
+static response_history::window
+history_round(response_history& h, const map<string, chrono::milliseconds>& latencies)
+{
+    auto w = h.begin_round();
+    for (auto& l : latencies) h.record(l.first, l.second);
+    h.end_round();
+    return w;
+}
+
+BOOST_AUTO_TEST_CASE(test_history_rotates_samples) {
+    using chrono::milliseconds;
+    using chrono::seconds;
+
+    const query::options defaults;
+    response_history h;
+
+    // Nothing to go by yet
+    auto w = history_round(h, {{"a", milliseconds(300)}});
+    BOOST_CHECK(w.mx == defaults.mx);
+    BOOST_CHECK(w.timeout == defaults.timeout);
+
+    // Twice the worst latency, plus 50ms
+    for (int i = 0; i != 7; ++i) {
+        w = history_round(h, {{"a", milliseconds(10)}});
+        BOOST_CHECK(w.timeout == milliseconds(650));
+        BOOST_CHECK(w.mx == seconds(1));
+    }
+
+    // The eighth newer sample pushes the slow one out, and the window
+    // doesn't go below 100ms
+    w = history_round(h, {{"a", milliseconds(10)}});
+    BOOST_CHECK(w.timeout == milliseconds(650));
+
+    // Rounds which aren't ended don't count as missed
+    for (int i = 0; i != 4; ++i) {
+        w = h.begin_round();
+        BOOST_CHECK(w.timeout == milliseconds(100));
+    }
+    BOOST_CHECK_EQUAL(h.size(), 1u);
+}
+
+BOOST_AUTO_TEST_CASE(test_history_missing_device) {
+    using chrono::milliseconds;
+
+    const query::options defaults;
+    response_history h;
+
+    history_round(h, {{"a", milliseconds(20)}, {"b", milliseconds(20)}});
+
+    // `a` misses the round, it's taken to be as slow as the window was
+    auto w = history_round(h, {{"b", milliseconds(20)}});
+    BOOST_CHECK(w.timeout == milliseconds(100));
+    BOOST_CHECK_EQUAL(h.size(), 2u);
+
+    w = history_round(h, {{"b", milliseconds(20)}});
+    BOOST_CHECK(w.timeout == milliseconds(250));
+    BOOST_CHECK_EQUAL(h.size(), 2u);
+
+    // Forgotten after the third round missed in a row
+    w = history_round(h, {{"b", milliseconds(20)}});
+    BOOST_CHECK(w.timeout == milliseconds(550));
+    BOOST_CHECK_EQUAL(h.size(), 1u);
+
+    w = h.begin_round();
+    BOOST_CHECK(w.timeout == milliseconds(100));
+    h.end_round();
+
+    // Nobody answered that one, so it's back to the defaults
+    BOOST_CHECK_EQUAL(h.size(), 1u);
+    w = h.begin_round();
+    BOOST_CHECK(w.mx == defaults.mx);
+    BOOST_CHECK(w.timeout == defaults.timeout);
+}
+
+namespace net = upnp::net;
+using udp = net::ip::udp;
+
+inline string ssdp_response(const string& uuid) {
+    return "HTTP/1.1 200 OK\r\n"
+           "CACHE-CONTROL: max-age=120\r\n"
+           "ST: urn:schemas-upnp-org:device:InternetGatewayDevice:1\r\n"
+           "USN: uuid:" + uuid + "::urn:schemas-upnp-org:device:InternetGatewayDevice:1\r\n"
+           "EXT:\r\n"
+           "LOCATION: http://127.0.0.1:5000/rootDesc.xml\r\n"
+           "\r\n";
+}
+
+// Runs a query which searches a unicast "device" on loopback. Once the
+// M-SEARCH arrives, `respond(ctx, query_endpoint, yield)` sends whatever it
+// wants to the query. Responses are only taken from the query after
+// `consumer_delay`. Returns the number of responses the query reported
+// and its counters.
+template<class Respond>
+static pair<size_t, query::counters>
+run_query( query::options opts
+         , Respond respond
+         , chrono::milliseconds consumer_delay = chrono::milliseconds(0))
+{
+    net::io_context ctx;
+
+    udp::socket device(ctx, udp::endpoint(net::ip::make_address_v4("127.0.0.1"), 0));
+
+    opts.interfaces = { net::ip::address_v4::any() };
+    opts.unicast_targets = { device.local_endpoint() };
+    opts.retransmits = 0;
+    opts.timeout = chrono::milliseconds(500);
+
+    size_t responses = 0;
+    query::counters counters;
+
+    net::spawn(ctx, [&] (net::yield_context yield) {
+        char buf[1024];
+        udp::endpoint from;
+        device.async_receive_from(net::buffer(buf), from, yield);
+        respond(ctx, from, yield);
+    });
+
+    net::spawn(ctx, [&] (net::yield_context yield) {
+        auto q = query::start(ctx.get_executor(), opts, yield);
+        BOOST_REQUIRE(q);
+
+        if (consumer_delay.count()) {
+            net::steady_timer t(ctx);
+            t.expires_after(consumer_delay);
+            t.async_wait(yield);
+        }
+
+        while (true) {
+            auto r = q.value().get_response(yield);
+            if (!r && !r.error().is_parse_error()) break;
+            if (r) ++responses;
+        }
+
+        q.value().stop();
+        counters = q.value().stats();
+    });
+
+    ctx.run();
+
+    return {responses, counters};
+}
+
+// Sends `datagram` to `to` from a socket bound to `from`. Doesn't yield,
+// so consecutive datagrams are all queued before the query reads any.
+static void send_from( net::io_context& ctx
+                     , const string& from
+                     , const udp::endpoint& to
+                     , const string& datagram)
+{
+    udp::socket s(ctx, udp::endpoint(net::ip::make_address_v4(from), 0));
+    s.send_to(net::buffer(datagram), to);
+}
+
+BOOST_AUTO_TEST_CASE(test_query_rate_limit_and_dedupe) {
+    query::options opts;
+    opts.source_burst = 5;
+    opts.source_rate = 0.001;
+
+    auto r = run_query(opts, [] (net::io_context& ctx, udp::endpoint to, net::yield_context yield) {
+        // A noisy host gets its burst through and no more
+        for (int i = 0; i != 10; ++i) {
+            send_from(ctx, "127.0.0.1", to, ssdp_response("noisy-" + to_string(i)));
+        }
+
+        // The same device twice is reported once
+        send_from(ctx, "127.0.0.2", to, ssdp_response("gateway"));
+        send_from(ctx, "127.0.0.2", to, ssdp_response("gateway"));
+    });
+
+    BOOST_CHECK_EQUAL(r.first, 6u);
+    BOOST_CHECK_EQUAL(r.second.received, 12u);
+    BOOST_CHECK_EQUAL(r.second.rate_limited, 5u);
+    BOOST_CHECK_EQUAL(r.second.duplicates, 1u);
+}
+
+BOOST_AUTO_TEST_CASE(test_query_source_flood) {
+    query::options opts;
+    opts.source_rate = 0.001;
+    opts.max_queued_responses = 1024;
+
+    auto r = run_query(opts, [] (net::io_context& ctx, udp::endpoint to, net::yield_context yield) {
+        net::steady_timer t(ctx);
+
+        // More spoofed sources than are tracked at once, each still
+        // within its limit
+        for (int i = 0; i != 300; ++i) {
+            auto from = "127.0.1." + to_string(i % 250 + 1);
+            if (i >= 250) from = "127.0.2." + to_string(i - 249);
+            send_from(ctx, from, to, ssdp_response("flood-" + to_string(i)));
+
+            // Don't overflow the receive buffer
+            if (i % 50 == 0) {
+                t.expires_after(chrono::milliseconds(5));
+                t.async_wait(yield);
+            }
+        }
+
+        // The gateway isn't locked out by them
+        send_from(ctx, "127.0.0.2", to, ssdp_response("gateway"));
+    });
+
+    BOOST_CHECK_EQUAL(r.first, 301u);
+    BOOST_CHECK_EQUAL(r.second.rate_limited, 0u);
+}
+
+BOOST_AUTO_TEST_CASE(test_query_full_queue_resends) {
+    query::options opts;
+    opts.max_queued_responses = 1;
+
+    auto r = run_query(opts, [] (net::io_context& ctx, udp::endpoint to, net::yield_context yield) {
+        for (int i = 0; i != 3; ++i) {
+            send_from(ctx, "127.0.0.1", to, ssdp_response("device-" + to_string(i)));
+        }
+
+        net::steady_timer t(ctx);
+
+        // Responses which didn't fit into the queue the first time around
+        // aren't taken for duplicates when sent again
+        for (int round = 0; round != 3; ++round) {
+            t.expires_after(chrono::milliseconds(round == 0 ? 150 : 20));
+            t.async_wait(yield);
+
+            for (int i = 0; i != 3; ++i) {
+                send_from(ctx, "127.0.0.1", to, ssdp_response("device-" + to_string(i)));
+            }
+        }
+    }, chrono::milliseconds(100));
+
+    BOOST_CHECK_EQUAL(r.first, 3u);
+}
+
+BOOST_AUTO_TEST_CASE(test_query_full_queue_backpressure) {
+    query::options opts;
+    opts.max_queued_responses = 1;
+
+    auto r = run_query(opts, [] (net::io_context& ctx, udp::endpoint to, net::yield_context) {
+        // All arrive while the consumer is busy, only one fits into the
+        // queue and the others wait on the socket
+        for (int i = 0; i != 5; ++i) {
+            send_from(ctx, "127.0.0.1", to, ssdp_response("device-" + to_string(i)));
+        }
+    }, chrono::milliseconds(100));
+
+    BOOST_CHECK_EQUAL(r.first, 5u);
+    BOOST_CHECK_EQUAL(r.second.received, 5u);
+    BOOST_CHECK_EQUAL(r.second.overflow, 0u);
+}
@@ -34,6 +34,25 @@ BOOST_AUTO_TEST_CASE(test_url) {
     test("");
     test("/");
     test("/foo/bar");
+    test("http://[fe80::1]:5000/rootDesc.xml");
+    test("http://[::1]/");
+    test("http://[::1]:80");
+}
+
+BOOST_AUTO_TEST_CASE(test_url_ipv6) {
+    auto url = upnp::url_t::parse("http://[fe80::1%2]:5000/rootDesc.xml");
+    BOOST_REQUIRE(url);
+    BOOST_REQUIRE_EQUAL(url->host(), "[fe80::1%2]");
+    BOOST_REQUIRE_EQUAL(url->port(), "5000");
+    BOOST_REQUIRE_EQUAL(url->path(), "/rootDesc.xml");
+    BOOST_REQUIRE_EQUAL(url->host_and_port(), "[fe80::1%2]:5000");
+    BOOST_REQUIRE_EQUAL(url->host_header(), "[fe80::1]:5000");
+
+    BOOST_REQUIRE_EQUAL(upnp::url_t::parse("http://[fe80::1%eth0]/")->host_header(), "[fe80::1]");
+    BOOST_REQUIRE_EQUAL(upnp::url_t::parse("http://[::1]:80/")->host_header(), "[::1]:80");
+    BOOST_REQUIRE_EQUAL(upnp::url_t::parse("http://example.org/")->host_header(), "example.org");
+
+    BOOST_REQUIRE(!upnp::url_t::parse("http://[fe80::1/"));
 }
 
 BOOST_AUTO_TEST_CASE(test_url_replace) {
@@ -0,0 +1,108 @@
+#define BOOST_TEST_MODULE xml
+#include <boost/test/included/unit_test.hpp>
+
+#include "xml.h"
+#include "parse_device.h"
+
+using namespace std;
+namespace xml = upnp::xml;
+using event = xml::reader::event;
+
+BOOST_AUTO_TEST_CASE(test_events) {
+    xml::reader r( "<?xml version=\"1.0\"?>\n"
+                   "<!DOCTYPE a [<!ENTITY x \"y\">]>"
+                   "<a:x xmlns:a=\"urn:a\" b='1'><!-- c --><y/>t&amp;u<![CDATA[<v>]]></a:x>");
+
+    BOOST_REQUIRE(r.next() == event::start);
+    BOOST_REQUIRE_EQUAL(r.name(), "a:x");
+    BOOST_REQUIRE_EQUAL(r.prefix(), "a");
+    BOOST_REQUIRE_EQUAL(r.local_name(), "x");
+    BOOST_REQUIRE_EQUAL(r.namespace_uri(), "urn:a");
+    BOOST_REQUIRE_EQUAL(r.depth(), 1);
+
+    BOOST_REQUIRE(r.next() == event::start);
+    BOOST_REQUIRE_EQUAL(r.name(), "y");
+    BOOST_REQUIRE_EQUAL(r.depth(), 2);
+    BOOST_REQUIRE(r.next() == event::end);
+    BOOST_REQUIRE_EQUAL(r.name(), "y");
+    BOOST_REQUIRE_EQUAL(r.depth(), 2);
+
+    BOOST_REQUIRE(r.next() == event::text);
+    BOOST_REQUIRE_EQUAL(r.text(), "t&u");
+    BOOST_REQUIRE(r.next() == event::text);
+    BOOST_REQUIRE_EQUAL(r.text(), "<v>");
+
+    BOOST_REQUIRE(r.next() == event::end);
+    BOOST_REQUIRE_EQUAL(r.namespace_uri(), "urn:a");
+    BOOST_REQUIRE_EQUAL(r.depth(), 1);
+    BOOST_REQUIRE(r.next() == event::done);
+}
+
+BOOST_AUTO_TEST_CASE(test_malformed) {
+    auto fails = [] (const char* doc) {
+        xml::reader r(doc);
+        while (true) {
+            auto e = r.next();
+            if (e == event::done) return false;
+            if (e == event::error) return true;
+        }
+    };
+
+    BOOST_REQUIRE(!fails("<a><b/></a>"));
+    BOOST_REQUIRE(fails("<a><b></a>"));
+    BOOST_REQUIRE(fails("<a>"));
+    BOOST_REQUIRE(fails("<a b=c/>"));
+    BOOST_REQUIRE(fails("<a>&nope;</a>"));
+    BOOST_REQUIRE(fails("<a><!-- </a>"));
+}
+
+BOOST_AUTO_TEST_CASE(test_find_and_read_text) {
+    xml::reader r( "<s:Envelope xmlns:s=\"x\"><s:Body>"
+                   "<u:R xmlns:u=\"y\"><Skip><A>no</A></Skip>"
+                   "<A>\n  one <b>two</b> three &lt;4&gt; </A></u:R>"
+                   "</s:Body></s:Envelope>");
+
+    BOOST_REQUIRE(xml::find(r, "*:Envelope.*:Body.u:R.A"));
+    auto t = r.read_text();
+    BOOST_REQUIRE(t);
+    BOOST_REQUIRE_EQUAL(*t, "one  three <4>");
+
+    xml::reader r2("<a><b/></a>");
+    BOOST_REQUIRE(!xml::find(r2, "a.c"));
+    BOOST_REQUIRE(!r2.failed());
+}
+
+BOOST_AUTO_TEST_CASE(test_device_parse) {
+    auto dev = upnp::device_parse_root(
+        "<?xml version=\"1.0\"?>"
+        "<root xmlns=\"urn:schemas-upnp-org:device-1-0\">"
+        "<specVersion><major>1</major><minor>0</minor></specVersion>"
+        "<device>"
+          "<deviceType>urn:schemas-upnp-org:device:InternetGatewayDevice:1</deviceType>"
+          "<friendlyName>Router &amp; co</friendlyName>"
+          "<UDN>uuid:1</UDN>"
+          "<deviceList><device>"
+            "<deviceType>urn:schemas-upnp-org:device:WANDevice:1</deviceType>"
+            "<friendlyName>WAN</friendlyName>"
+            "<UDN>uuid:2</UDN>"
+            "<serviceList><service>"
+              "<serviceType>urn:schemas-upnp-org:service:WANIPConnection:1</serviceType>"
+              "<serviceId>urn:upnp-org:serviceId:WANIPConn1</serviceId>"
+              "<controlURL> /ctl/IPConn </controlURL>"
+            "</service></serviceList>"
+          "</device></deviceList>"
+        "</device>"
+        "</root>");
+
+    BOOST_REQUIRE(dev);
+    BOOST_REQUIRE_EQUAL(dev->friendly_name, "Router & co");
+    BOOST_REQUIRE_EQUAL(dev->udn, "uuid:1");
+    BOOST_REQUIRE_EQUAL(dev->devices.size(), 1u);
+    BOOST_REQUIRE_EQUAL(dev->devices[0].services.size(), 1u);
+    auto& s = dev->devices[0].services[0];
+    BOOST_REQUIRE_EQUAL(s.id, "urn:upnp-org:serviceId:WANIPConn1");
+    BOOST_REQUIRE_EQUAL(s.control_url.path(), "/ctl/IPConn");
+
+    BOOST_REQUIRE(!upnp::device_parse_root("<root><device><UDN>x</UDN></device></root>"));
+    BOOST_REQUIRE(!upnp::device_parse_root("<root><device>"));
+}